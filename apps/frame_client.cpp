@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * frame_client.cpp - example of receiving frames from rpicam-vid --share-socket.
+ */
+
+#include <time.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "core/duration_stats.hpp"
+#include "core/frame_share.hpp"
+
+// Usage: rpicam-frame-client SOCKET [FRAMES [OUTPUT]]
+//
+// Reads FRAMES frames (or until the camera stops) from the app sharing them on SOCKET, reporting
+// the rate, losses and delivery latency once a second. With OUTPUT, the raw frames are appended
+// to that file as well.
+
+static uint64_t monotonic_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " SOCKET [FRAMES [OUTPUT]]" << std::endl;
+		return -1;
+	}
+
+	try
+	{
+		FrameShareClient client(argv[1]);
+		const uint64_t max_frames = argc > 2 ? std::stoull(argv[2]) : 0;
+		std::ofstream output;
+		if (argc > 3)
+			output.open(argv[3], std::ios::binary);
+
+		FrameShareFormat const &format = client.Format();
+		std::cout << "Connected: " << format.width << "x" << format.height << " stride " << format.stride
+				  << std::endl;
+
+		DurationStats latency("Delivery latency");
+		uint64_t frames = 0, reclaimed = 0, last_lost = 0;
+		auto report_time = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+		FrameShareClient::Frame frame;
+		// When the camera stops, the frames do too.
+		while ((!max_frames || frames < max_frames) && client.Acquire(frame, 2000))
+		{
+			latency.Add(std::chrono::nanoseconds(monotonic_ns() - frame.published_ns));
+			if (output.is_open())
+				output.write(reinterpret_cast<char const *>(frame.data), frame.size);
+			if (client.Release(frame))
+				frames++;
+			else
+				reclaimed++;
+
+			if (std::chrono::steady_clock::now() >= report_time)
+			{
+				std::cout << "Frame " << frame.sequence << ": " << latency.Count() << " fps, "
+						  << client.Lost() - last_lost << " lost, " << latency.ToString() << std::endl;
+				latency.Reset();
+				last_lost = client.Lost();
+				report_time += std::chrono::seconds(1);
+			}
+		}
+
+		std::cout << frames << " frames received, " << client.Lost() << " lost, " << reclaimed
+				  << " reclaimed while being read" << std::endl;
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,221 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * frame_share_bench.cpp - throughput and latency of sharing frames with other processes.
+ */
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/duration_stats.hpp"
+#include "core/frame_share.hpp"
+
+// A synthetic camera stands in for the real one: it writes each frame's sequence number into the
+// start of a free buffer and publishes it, and only reuses a buffer once the server lets it go.
+// Clients run in their own processes, and check every frame they read carries the sequence number
+// it was announced with. One of them is much slower than the frame rate, to show that a late
+// client only loses frames and never holds the camera up.
+
+static constexpr unsigned int WIDTH = 1920;
+static constexpr unsigned int HEIGHT = 1080;
+static constexpr size_t FRAME_SIZE = WIDTH * HEIGHT * 3 / 2;
+static constexpr unsigned int NUM_BUFFERS = 6;
+static constexpr unsigned int MAX_HELD = 3;
+
+struct ClientResult
+{
+	uint64_t frames;
+	uint64_t lost;
+	uint64_t torn;
+	uint64_t corrupt;
+	double mean_latency_us;
+	double max_latency_us;
+};
+
+static uint64_t monotonic_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static ClientResult run_client(std::string const &socket_path, std::chrono::microseconds work, bool latest)
+{
+	// Wait for the server to start listening.
+	std::unique_ptr<FrameShareClient> connection;
+	for (unsigned int tries = 0; !connection; tries++)
+	{
+		try
+		{
+			connection = std::make_unique<FrameShareClient>(socket_path);
+		}
+		catch (std::exception const &e)
+		{
+			if (tries == 5000)
+				throw;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+	FrameShareClient &client = *connection;
+	DurationStats latency("latency");
+	ClientResult result = {};
+	FrameShareClient::Frame frame;
+	// The server stops announcing frames before it goes, so a quiet second means it's finished.
+	while (client.Acquire(frame, 1000, latest))
+	{
+		latency.Add(std::chrono::nanoseconds(monotonic_ns() - frame.published_ns));
+		uint64_t sequence;
+		memcpy(&sequence, frame.data, sizeof(sequence));
+		if (work.count())
+			std::this_thread::sleep_for(work);
+		// Don't count data read from a frame that turned out to be reclaimed.
+		if (!client.Release(frame))
+			result.torn++;
+		else if (sequence != frame.sequence)
+			result.corrupt++;
+		else
+			result.frames++;
+	}
+	result.lost = client.Lost();
+	result.mean_latency_us = latency.MeanUs();
+	result.max_latency_us = latency.MaxUs();
+	return result;
+}
+
+int main(int argc, char *argv[])
+{
+	const double fps = argc > 1 ? std::stod(argv[1]) : 0;
+	const unsigned int seconds = argc > 2 ? std::stoul(argv[2]) : 5;
+	const unsigned int num_clients = argc > 3 ? std::stoul(argv[3]) : 3;
+	const std::string socket_path = "/tmp/rpicam-frame-share-bench-" + std::to_string(getpid());
+
+	std::vector<int> fds;
+	std::vector<uint8_t *> buffers;
+	for (unsigned int i = 0; i < NUM_BUFFERS; i++)
+	{
+		int fd = memfd_create("rpicam-bench-frame", MFD_CLOEXEC);
+		if (fd < 0 || ftruncate(fd, FRAME_SIZE))
+			throw std::runtime_error("failed to make a frame buffer");
+		fds.push_back(fd);
+		buffers.push_back(static_cast<uint8_t *>(
+			mmap(nullptr, FRAME_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)));
+	}
+
+	std::mutex free_mutex;
+	std::vector<unsigned int> free_buffers;
+	for (unsigned int i = 0; i < NUM_BUFFERS; i++)
+		free_buffers.push_back(i);
+
+	// Start the clients before the server's thread exists, so that they're forked from a process
+	// with only one thread. The last client takes twice the frame interval (or 20ms flat out)
+	// over each frame, and always asks for the newest.
+	std::vector<pid_t> children;
+	std::vector<int> pipes;
+	for (unsigned int i = 0; i < num_clients; i++)
+	{
+		bool slow = i == num_clients - 1 && num_clients > 1;
+		auto work = std::chrono::microseconds(slow ? (fps ? (int)(2e6 / fps) : 20000) : 0);
+		int p[2];
+		if (pipe(p))
+			throw std::runtime_error("pipe failed");
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			close(p[0]);
+			ClientResult result = run_client(socket_path, work, slow);
+			if (write(p[1], &result, sizeof(result)) != sizeof(result))
+				_exit(1);
+			_exit(0);
+		}
+		close(p[1]);
+		children.push_back(pid);
+		pipes.push_back(p[0]);
+	}
+
+	FrameShareServer server(socket_path, { WIDTH, HEIGHT, WIDTH, 0 }, fds, FRAME_SIZE, MAX_HELD);
+	while (server.NumClients() < num_clients)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	DurationStats publish_stats("publish");
+	uint64_t sequence = 0, stalls = 0;
+	auto interval = std::chrono::nanoseconds(fps ? (int64_t)(1e9 / fps) : 0);
+	auto start = std::chrono::steady_clock::now(), next = start;
+	auto end = start + std::chrono::seconds(seconds);
+	while (std::chrono::steady_clock::now() < end)
+	{
+		if (interval.count())
+		{
+			next += interval;
+			std::this_thread::sleep_until(next);
+		}
+
+		unsigned int index;
+		{
+			std::lock_guard<std::mutex> lock(free_mutex);
+			if (free_buffers.empty())
+			{
+				// A real camera would have nowhere to put this frame.
+				stalls++;
+				continue;
+			}
+			index = free_buffers.back();
+			free_buffers.pop_back();
+		}
+		memcpy(buffers[index], &sequence, sizeof(sequence));
+
+		std::shared_ptr<void> hold(nullptr, [&, index](void *) {
+			std::lock_guard<std::mutex> lock(free_mutex);
+			free_buffers.push_back(index);
+		});
+		auto publish_start = DurationStats::Clock::now();
+		server.Publish(index, sequence++, monotonic_ns(), std::move(hold));
+		publish_stats.Add(publish_start);
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << "Published " << sequence << " " << WIDTH << "x" << HEIGHT << " frames in " << std::fixed
+			  << std::setprecision(2) << elapsed << "s (" << sequence / elapsed << " fps), " << stalls
+			  << " camera stalls, " << server.Reclaimed() << " frames reclaimed from clients" << std::endl;
+	std::cout << publish_stats.ToString() << std::endl;
+
+	int failures = stalls ? 1 : 0;
+	for (unsigned int i = 0; i < num_clients; i++)
+	{
+		ClientResult result = {};
+		if (read(pipes[i], &result, sizeof(result)) != sizeof(result))
+		{
+			std::cout << "client " << i << ": failed" << std::endl;
+			failures++;
+		}
+		else
+		{
+			std::cout << "client " << i << (i == num_clients - 1 && num_clients > 1 ? " (slow)" : "") << ": "
+					  << result.frames << " frames (" << result.frames / elapsed << " fps), " << result.lost
+					  << " lost, " << result.torn << " reclaimed while reading, latency mean "
+					  << std::setprecision(1) << result.mean_latency_us << "us max " << result.max_latency_us << "us"
+					  << std::setprecision(2) << std::endl;
+			failures += result.corrupt != 0;
+		}
+		close(pipes[i]);
+		waitpid(children[i], nullptr, 0);
+	}
+
+	for (unsigned int i = 0; i < NUM_BUFFERS; i++)
+	{
+		munmap(buffers[i], FRAME_SIZE);
+		close(fds[i]);
+	}
+	return failures ? 1 : 0;
+}
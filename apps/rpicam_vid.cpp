@@ -5,43 +5,136 @@
  * rpicam_vid.cpp - libcamera video record app.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 #include <poll.h>
 #include <signal.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
+#include "core/buffer_sync.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/logging.hpp"
 #include "core/options.hpp"
+#include "core/reactor.hpp"
 
 using namespace std::placeholders;
 
-// Some keypress/signal handling.
+static void cycle_overlay(RPiCamApp &app)
+{
+	unsigned int overlay = static_cast<unsigned int>(app.GetAnalysisOverlay()) + 1;
+	overlay %= static_cast<unsigned int>(Preview::AnalysisOverlay::Count);
+	app.SetAnalysisOverlay(static_cast<Preview::AnalysisOverlay>(overlay));
+	LOG(1, "Analysis overlay " << overlay);
+}
 
-static int signal_received;
-static void default_signal_handler(int signal_number)
+static void reply(int client, std::string const &text)
 {
-	signal_received = signal_number;
-	LOG(1, "Received signal " << signal_number);
+	if (send(client, text.data(), text.size(), MSG_NOSIGNAL) < 0)
+		LOG(1, "Failed to reply to client: " << strerror(errno));
 }
 
-static int get_key_or_signal(Options const *options, pollfd p[1])
+// The --subscribe consumers each read the frames their subscription gives them on their own
+// thread, measuring the mean brightness, and can take a set time over each one so that the
+// subscription's drop policy comes into play.
+class FrameConsumers
 {
-	int key = 0;
-	if (signal_received == SIGINT)
+public:
+	FrameConsumers(RPiCamApp &app) : app_(app) {}
+	~FrameConsumers() { Stop(); }
+
+	void Start()
 	{
-		return 'x';
+		stop_ = false;
+		for (Options::Subscriber const &subscriber : app_.GetOptions()->subscribers)
+		{
+			auto consumer = std::make_unique<Consumer>();
+			consumer->name = subscriber.name;
+			consumer->subscription = app_.Subscribe(app_.GetStream(), subscriber.policy);
+			consumer->thread = std::thread(&FrameConsumers::run, this, consumer.get(),
+										   std::chrono::milliseconds(subscriber.work_ms));
+			consumers_.push_back(std::move(consumer));
+		}
 	}
 
-	return key;
-}
+	// Subscriptions are to a stream, so have to stop before the camera is reconfigured.
+	void Stop()
+	{
+		stop_ = true;
+		for (auto &consumer : consumers_)
+		{
+			consumer->thread.join();
+			LOG(1, "Subscriber " << consumer->name << ": " << consumer->frames << " frames read, "
+								 << consumer->subscription->Dropped() << " dropped, mean luma "
+								 << (consumer->frames ? consumer->luma / consumer->frames : 0));
+			app_.Unsubscribe(consumer->subscription);
+		}
+		consumers_.clear();
+	}
+
+private:
+	struct Consumer
+	{
+		std::string name;
+		FrameSubscriptionPtr subscription;
+		std::thread thread;
+		uint64_t frames = 0;
+		double luma = 0;
+	};
+
+	void run(Consumer *consumer, std::chrono::milliseconds work)
+	{
+		libcamera::Stream *stream = consumer->subscription->GetStream();
+		StreamInfo info = app_.GetStreamInfo(stream);
+		while (!stop_)
+		{
+			CompletedRequestPtr frame = consumer->subscription->Wait(100);
+			if (!frame)
+				continue;
+
+			BufferReadSync r(&app_, frame->buffers.at(stream));
+			uint8_t const *y = r.Get()[0].data();
+			uint64_t sum = 0;
+			for (unsigned int row = 0; row < info.height; row += 8)
+				for (unsigned int col = 0; col < info.width; col += 8)
+					sum += y[row * info.stride + col];
+			consumer->luma += (double)sum / (((info.height + 7) / 8) * ((info.width + 7) / 8));
+			consumer->frames++;
+			if (work.count())
+				std::this_thread::sleep_for(work);
+		}
+	}
+
+	RPiCamApp &app_;
+	std::atomic<bool> stop_ = false;
+	std::vector<std::unique_ptr<Consumer>> consumers_;
+};
 
-// The main even loop for the application.
+// The main even loop for the application. Camera messages, signals and keypresses all arrive as
+// file descriptors becoming readable, so one thread sleeps in the reactor until any of them does.
+//
+// With --daemon, the camera is opened and configured, its buffers allocated and the display set
+// up, but it only runs when a client on the daemon socket sends "start", until it sends "stop".
+// The reply to "start" comes once the first frame is on its way to the screen, with the time
+// that took. "reconfigure WIDTH HEIGHT [FPS]" changes the video size and frame rate, and replies
+// with how long the old frame was left on the screen (0 if the camera didn't have to stop).
+// "switch-preview" moves to the other preview backend at the next frame. "status" and "quit" do
+// as they say. A command that fails replies "error" and the reason, and the daemon carries on.
 
-static void event_loop(RPiCamApp &app)
+static void event_loop(RPiCamApp &app, std::chrono::steady_clock::time_point launch_time)
 {
 	Options const *options = app.GetOptions();
+	const bool daemon = !options->daemon.empty();
 
 	app.OpenCamera();
 
@@ -50,49 +143,275 @@ static void event_loop(RPiCamApp &app)
 	// libcamera::ColorSpace::Smpte170m;
 
 	app.ConfigureVideo(libcamera::ColorSpace::Sycc);
-	app.StartCamera();
-
-	// Monitoring for keypresses and signals.
-	signal(SIGUSR1, default_signal_handler);
-	signal(SIGUSR2, default_signal_handler);
-	signal(SIGINT, default_signal_handler);
-	// SIGPIPE gets raised when trying to write to an already closed socket. This can happen, when
-	// you're using TCP to stream to VLC and the user presses the stop button in VLC. Catching the
-	// signal to be able to react on it, otherwise the app terminates.
-	signal(SIGPIPE, default_signal_handler);
-	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
-
-	for (unsigned int count = 0; ; count++)
-	{
-		RPiCamApp::Msg msg = app.Wait();
-		if (msg.type == RPiCamApp::MsgType::Timeout)
+	FrameConsumers consumers(app);
+	consumers.Start();
+
+	Reactor reactor;
+	unsigned int count = 0;
+	bool running = false, awaiting_first_frame = false;
+	auto start_time = launch_time;
+	int start_client = -1, reconfigure_client = -1;
+
+	auto start = [&]() {
+		if (daemon)
+			start_time = std::chrono::steady_clock::now();
+		app.StartCamera();
+		running = awaiting_first_frame = true;
+	};
+	if (!daemon)
+		start();
+
+	reactor.Add(app.GetMessageFd(), [&](uint32_t) {
+		std::optional<RPiCamApp::Msg> msg = app.TryWait();
+		if (!msg)
+			return;
+		if (msg->type == RPiCamApp::MsgType::Timeout)
 		{
 			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
 			app.StopCamera();
 			app.StartCamera();
-			continue;
+			return;
 		}
-		if (msg.type == RPiCamApp::MsgType::Quit)
+		if (msg->type == RPiCamApp::MsgType::Quit)
+		{
+			reactor.Stop();
 			return;
-		else if (msg.type != RPiCamApp::MsgType::RequestComplete)
+		}
+		else if (msg->type == RPiCamApp::MsgType::PreviewStarted)
+		{
+			if (reconfigure_client >= 0)
+			{
+				std::chrono::duration<double, std::milli> gap = app.ReconfigureGap();
+				reply(reconfigure_client, "reconfigured " + std::to_string(gap.count()));
+				reconfigure_client = -1;
+			}
+			// A restart after a timeout isn't interesting.
+			if (!awaiting_first_frame)
+				return;
+			awaiting_first_frame = false;
+			std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start_time;
+			LOG(1, "First frame shown " << ms.count() << "ms after " << (daemon ? "start command" : "launch"));
+			if (start_client >= 0)
+				reply(start_client, "started " + std::to_string(ms.count()));
+			start_client = -1;
+			return;
+		}
+		else if (msg->type != RPiCamApp::MsgType::RequestComplete)
 			throw std::runtime_error("unrecognised message!");
-		int key = get_key_or_signal(options, p);
 
-		LOG(2, "Viewfinder frame " << count);
+		LOG(2, "Viewfinder frame " << count++);
+		// With --direct-preview, the frame has already gone to the preview from the camera thread.
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg->payload);
+		if (!app.GetOptions()->direct_preview)
+			app.ShowPreview(completed_request, app.GetPreviewStream());
+	});
+
+	// main() blocked these signals in every thread, so they're only ever delivered here.
+	sigset_t signals;
+	sigemptyset(&signals);
+	for (int sig : { SIGINT, SIGTERM, SIGUSR1, SIGUSR2, SIGPIPE })
+		sigaddset(&signals, sig);
+	int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (signal_fd < 0)
+		throw std::runtime_error("failed to create signalfd");
+	reactor.Add(signal_fd, [&](uint32_t) {
+		signalfd_siginfo info;
+		while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+		{
+			LOG(1, "Received signal " << info.ssi_signo);
+			if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM)
+			{
+				app.StopCamera(); // stop complains if encoder very slow to close
+				reactor.Stop();
+			}
+			else if (info.ssi_signo == SIGUSR1)
+				cycle_overlay(app);
+			else if (info.ssi_signo == SIGUSR2)
+				app.SwitchPreview();
+			// SIGPIPE gets raised when trying to write to an already closed socket. This can happen, when
+			// you're using TCP to stream to VLC and the user presses the stop button in VLC. Receiving it
+			// here means it no longer terminates the app.
+		}
+	});
+
+	// Keypresses: 'x' quits, 'o' cycles the analysis overlays and 'p' switches between the DRM and
+	// EGL previews. Stdin may be something epoll can't watch, such as /dev/null, in which case there
+	// simply aren't any.
+	try
+	{
+		reactor.Add(STDIN_FILENO, [&](uint32_t) {
+			char buf[64];
+			ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+			if (n <= 0)
+			{
+				reactor.Remove(STDIN_FILENO);
+				return;
+			}
+			for (ssize_t i = 0; i < n; i++)
+			{
+				if (buf[i] == 'x' || buf[i] == 'X')
+				{
+					app.StopCamera();
+					reactor.Stop();
+					return;
+				}
+				else if (buf[i] == 'o')
+					cycle_overlay(app);
+				else if (buf[i] == 'p')
+					app.SwitchPreview();
+			}
+		});
+	}
+	catch (std::exception const &e)
+	{
+		LOG(2, "Not reading commands from stdin: " << e.what());
+	}
+
+	int listen_fd = -1;
+	std::vector<int> clients;
+	auto run_command = [&](int client, std::string const &cmd) {
+		if (cmd == "start" && !running)
+		{
+			start_client = client;
+			start();
+		}
+		else if (cmd == "start")
+			reply(client, "running");
+		else if (cmd == "stop")
+		{
+			if (running)
+			{
+				app.StopCamera();
+				app.HidePreview();
+				running = awaiting_first_frame = false;
+			}
+			reply(client, "stopped");
+		}
+		else if (cmd.rfind("reconfigure", 0) == 0)
+		{
+			unsigned int width, height;
+			float fps = 0;
+			if (sscanf(cmd.c_str(), "reconfigure %u %u %f", &width, &height, &fps) < 2)
+				reply(client, "usage: reconfigure WIDTH HEIGHT [FPS]");
+			else
+			{
+				consumers.Stop();
+				bool restarted;
+				try
+				{
+					restarted = app.Reconfigure(width, height, fps);
+				}
+				catch (...)
+				{
+					consumers.Start();
+					throw;
+				}
+				consumers.Start();
+				if (restarted)
+					reconfigure_client = client;
+				else
+					reply(client, "reconfigured 0");
+			}
+		}
+		else if (cmd == "switch-preview")
+			reply(client, app.SwitchPreview() ? "switching to " + options->preview_backend : "not switching");
+		else if (cmd == "status")
+			reply(client, running ? "running" : "idle");
+		else if (cmd == "quit")
+		{
+			reply(client, "quitting");
+			app.StopCamera();
+			reactor.Stop();
+		}
+		else
+			reply(client, "unknown command " + cmd);
+	};
 
-		if (key == 'x' || key == 'X')
+	auto command = [&](int client) {
+		char buf[64];
+		ssize_t n = recv(client, buf, sizeof(buf) - 1, 0);
+		if (n <= 0)
 		{
-			app.StopCamera(); // stop complains if encoder very slow to close
+			reactor.Remove(client);
+			close(client);
+			clients.erase(std::find(clients.begin(), clients.end(), client));
+			if (start_client == client)
+				start_client = -1;
+			if (reconfigure_client == client)
+				reconfigure_client = -1;
 			return;
 		}
+		std::string cmd(buf, n);
+		cmd.erase(cmd.find_last_not_of(" \r\n") + 1);
+		LOG(2, "Daemon command: " << cmd);
 
-		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
-		app.ShowPreview(completed_request, app.GetStream());
+		// A client asking for something the camera can't do mustn't take the daemon down.
+		try
+		{
+			run_command(client, cmd);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: daemon command \"" << cmd << "\" failed: " << e.what());
+			if (start_client == client)
+				start_client = -1;
+			if (reconfigure_client == client)
+				reconfigure_client = -1;
+			// A start that failed part of the way through, or a reconfigure that couldn't put the
+			// old configuration back, leaves the camera stopped.
+			if (!running || !app.CameraRunning())
+			{
+				app.StopCamera();
+				running = awaiting_first_frame = false;
+			}
+			reply(client, std::string("error ") + e.what());
+		}
+	};
+
+	if (daemon)
+	{
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (options->daemon.size() >= sizeof(addr.sun_path))
+			throw std::runtime_error("daemon socket path too long");
+		strcpy(addr.sun_path, options->daemon.c_str());
+		unlink(addr.sun_path);
+		listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (listen_fd < 0 || bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) || listen(listen_fd, 4))
+			throw std::runtime_error("failed to listen on " + options->daemon + ": " + strerror(errno));
+		reactor.Add(listen_fd, [&](uint32_t) {
+			int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (client < 0)
+				return;
+			clients.push_back(client);
+			reactor.Add(client, [&command, client](uint32_t) { command(client); });
+		});
+		std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - launch_time;
+		LOG(1, "Camera ready " << ms.count() << "ms after launch, waiting for commands on " << options->daemon);
+	}
+
+	reactor.Run();
+	close(signal_fd);
+	for (int client : clients)
+		close(client);
+	if (listen_fd >= 0)
+	{
+		close(listen_fd);
+		unlink(options->daemon.c_str());
 	}
 }
 
 int main(int argc, char *argv[])
 {
+	// Block the signals we handle before any threads start, so that they all inherit the mask and
+	// the signals are only delivered through the event loop's signalfd.
+	sigset_t signals;
+	sigemptyset(&signals);
+	for (int sig : { SIGINT, SIGTERM, SIGUSR1, SIGUSR2, SIGPIPE })
+		sigaddset(&signals, sig);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+	auto launch_time = std::chrono::steady_clock::now();
+
 	try
 	{
 		RPiCamApp app;
@@ -105,18 +424,21 @@ int main(int argc, char *argv[])
 			// options->height = 1080;
 			// options->width = 1920;
 
-			options->height = 1232;
-			options->width = 1640;
+			// The stream is sized to the display later on if asked, unless there's a lores stream for that.
+			if (!options->match_display || options->lores_preview)
+			{
+				options->height = 1232;
+				options->width = 1640;
+			}
 
 			options->framerate = 60.0;
 
-			options->useGlesPreview = true;
 			if (options->verbose >= 2)
 			{
 				options->Print();
 			}
 
-			event_loop(app);
+			event_loop(app, launch_time);
 		}
 	}
 	catch (std::exception const &e)
@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * yuv_bench.cpp - throughput of the preview's YUV420 to RGB conversion kernels.
+ */
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "preview/yuv_convert.hpp"
+
+// Camera output sizes to convert, each of which is shown both unscaled and letterboxed
+// onto a 1080p screen as the DRM preview would.
+static const std::vector<std::pair<unsigned int, unsigned int>> sizes = {
+	{ 640, 480 }, { 1280, 720 }, { 1640, 1232 }, { 1920, 1080 }, { 2028, 1520 }, { 4056, 3040 },
+};
+
+static constexpr unsigned int SCREEN_WIDTH = 1920;
+static constexpr unsigned int SCREEN_HEIGHT = 1080;
+
+int main(int argc, char *argv[])
+{
+	const unsigned int iterations = argc > 1 ? std::stoul(argv[1]) : 50;
+	const YuvCoefficients coeffs = yuv_coefficients(libcamera::ColorSpace::Smpte170m);
+	std::mt19937 rng(1234);
+
+	std::cout << std::left << std::setw(8) << "kernel" << std::setw(9) << "threads" << std::setw(12) << "source"
+			  << std::setw(12) << "output" << std::setw(12) << "ms/frame" << std::setw(12) << "Mpix/s"
+			  << "check" << std::endl;
+
+	for (auto const &[width, height] : sizes)
+	{
+		const unsigned int stride = (width + 63) & ~63;
+		std::vector<uint8_t> src(stride * height * 3 / 2);
+		for (auto &p : src)
+			p = rng();
+
+		// Letterbox the image onto the screen.
+		unsigned int out_w = SCREEN_WIDTH, out_h = SCREEN_HEIGHT;
+		if (width * SCREEN_HEIGHT > SCREEN_WIDTH * height)
+			out_h = SCREEN_WIDTH * height / width;
+		else
+			out_w = SCREEN_HEIGHT * width / height;
+
+		for (auto const &[dst_w, dst_h] : { std::make_pair(width, height), std::make_pair(out_w, out_h) })
+		{
+			std::vector<uint32_t> reference(dst_w * dst_h), dst(dst_w * dst_h);
+			YuvToRgb single(1);
+			single.SetKernel("scalar");
+			single.Convert(src.data(), width, height, stride, coeffs, reinterpret_cast<uint8_t *>(reference.data()),
+						   dst_w, dst_h, dst_w * 4);
+
+			for (auto const &kernel : yuv_kernels())
+			{
+				for (unsigned int threads : { 1u, 0u })
+				{
+					YuvToRgb converter(threads);
+					converter.SetKernel(kernel.name);
+					// There's no point repeating the single threaded case.
+					if (threads == 0 && converter.NumThreads() == 1)
+						continue;
+
+					auto start = std::chrono::steady_clock::now();
+					for (unsigned int i = 0; i < iterations; i++)
+						converter.Convert(src.data(), width, height, stride, coeffs,
+										  reinterpret_cast<uint8_t *>(dst.data()), dst_w, dst_h, dst_w * 4);
+					std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+					const double ms = elapsed.count() / iterations;
+					bool ok = !memcmp(dst.data(), reference.data(), dst.size() * 4);
+					std::cout << std::left << std::setw(8) << kernel.name << std::setw(9) << converter.NumThreads()
+							  << std::setw(12) << (std::to_string(width) + "x" + std::to_string(height))
+							  << std::setw(12) << (std::to_string(dst_w) + "x" + std::to_string(dst_h))
+							  << std::setw(12) << std::fixed << std::setprecision(3) << ms << std::setw(12)
+							  << std::setprecision(1) << dst_w * dst_h / ms / 1000.0 << (ok ? "ok" : "MISMATCH")
+							  << std::endl;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * ae_seed.cpp - remember converged AE/AWB state between runs, and measure convergence.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include <libcamera/control_ids.h>
+
+#include "core/ae_seed.hpp"
+#include "core/logging.hpp"
+
+namespace controls = libcamera::controls;
+
+// AE and AWB count as settled once nothing has moved by more than this for a few frames.
+static constexpr double STABLE_TOLERANCE = 0.02;
+static constexpr unsigned int STABLE_FRAMES = 3;
+
+std::optional<AeSeed> ae_seed_load(std::string const &filename, std::string const &camera_id)
+{
+	std::ifstream file(filename);
+	std::string line;
+	while (std::getline(file, line))
+	{
+		std::istringstream s(line);
+		std::string id;
+		AeSeed seed;
+		if (s >> id >> seed.exposure_time >> seed.analogue_gain >> seed.colour_gains[0] >> seed.colour_gains[1] &&
+			id == camera_id)
+			return seed;
+	}
+	return {};
+}
+
+void ae_seed_save(std::string const &filename, std::string const &camera_id, AeSeed const &seed)
+{
+	// Keep the other cameras' lines as they are.
+	std::vector<std::string> lines;
+	{
+		std::ifstream file(filename);
+		std::string line;
+		while (std::getline(file, line))
+		{
+			std::istringstream s(line);
+			std::string id;
+			if (s >> id && id != camera_id)
+				lines.push_back(line);
+		}
+	}
+	std::ostringstream s;
+	s << camera_id << " " << seed.exposure_time << " " << seed.analogue_gain << " " << seed.colour_gains[0] << " "
+	  << seed.colour_gains[1];
+	lines.push_back(s.str());
+
+	// Write a new file and rename it over the old one, so a crash never leaves a truncated file.
+	std::string tmp = filename + ".tmp";
+	{
+		std::ofstream file(tmp);
+		for (auto const &line : lines)
+			file << line << std::endl;
+		if (!file)
+		{
+			LOG_ERROR("WARNING: failed to write AE/AWB seed file " << tmp);
+			return;
+		}
+	}
+	if (std::rename(tmp.c_str(), filename.c_str()))
+		LOG_ERROR("WARNING: failed to replace AE/AWB seed file " << filename);
+}
+
+void ConvergenceMonitor::Reset()
+{
+	last_ = {};
+	frames_ = stable_frames_ = 0;
+	first_timestamp_ = last_timestamp_ = 0;
+	converged_ = false;
+}
+
+bool ConvergenceMonitor::Update(libcamera::ControlList const &metadata, uint64_t timestamp)
+{
+	auto exposure_time = metadata.get(controls::ExposureTime);
+	auto analogue_gain = metadata.get(controls::AnalogueGain);
+	auto colour_gains = metadata.get(controls::ColourGains);
+	if (!exposure_time || !analogue_gain || !colour_gains)
+		return false;
+
+	AeSeed current = { *exposure_time, *analogue_gain, { (*colour_gains)[0], (*colour_gains)[1] } };
+	if (!converged_)
+	{
+		if (!frames_)
+			first_timestamp_ = timestamp;
+		last_timestamp_ = timestamp;
+		frames_++;
+	}
+
+	auto close = [](double a, double b) { return std::abs(a - b) <= STABLE_TOLERANCE * std::max(a, b); };
+	// Exposure and gain can trade off against each other, so it's their product that needs to settle.
+	bool stable = close((double)current.exposure_time * current.analogue_gain,
+						(double)last_.exposure_time * last_.analogue_gain) &&
+				  close(current.colour_gains[0], last_.colour_gains[0]) &&
+				  close(current.colour_gains[1], last_.colour_gains[1]);
+	// Where the AGC reports its own view, it has the final say.
+	auto locked = metadata.get(controls::AeLocked);
+	if (locked && !*locked)
+		stable = false;
+	last_ = current;
+
+	if (converged_)
+		return false;
+	stable_frames_ = stable ? stable_frames_ + 1 : 0;
+	converged_ = stable_frames_ >= STABLE_FRAMES;
+	return converged_;
+}
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * ae_seed.hpp - remember converged AE/AWB state between runs, and measure convergence.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include <libcamera/controls.h>
+
+// The exposure and colour gains that the control algorithms last settled on.
+struct AeSeed
+{
+	int32_t exposure_time;
+	float analogue_gain;
+	std::array<float, 2> colour_gains;
+};
+
+// The seed file is plain text with one line per camera: the camera id followed by the
+// exposure time, analogue gain and red and blue gains.
+std::optional<AeSeed> ae_seed_load(std::string const &filename, std::string const &camera_id);
+void ae_seed_save(std::string const &filename, std::string const &camera_id, AeSeed const &seed);
+
+// Watches the metadata of each frame after the camera starts and notes the first one at
+// which both AE and AWB have settled down.
+class ConvergenceMonitor
+{
+public:
+	ConvergenceMonitor() { Reset(); }
+
+	void Reset();
+	// Returns true only for the frame on which convergence is first seen.
+	bool Update(libcamera::ControlList const &metadata, uint64_t timestamp);
+
+	bool Converged() const { return converged_; }
+	unsigned int Frames() const { return frames_; }
+	double Ms() const { return (last_timestamp_ - first_timestamp_) / 1e6; }
+	// The most recent values seen once converged, suitable for seeding the next run.
+	std::optional<AeSeed> Seed() const { return converged_ ? std::optional<AeSeed>(last_) : std::nullopt; }
+
+private:
+	AeSeed last_;
+	unsigned int frames_;
+	unsigned int stable_frames_;
+	uint64_t first_timestamp_;
+	uint64_t last_timestamp_;
+	bool converged_;
+};
@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include <chrono>
 #include <memory>
 
 #include <libcamera/controls.h>
@@ -18,14 +19,19 @@ struct CompletedRequest
 	using ControlList = libcamera::ControlList;
 	using Request = libcamera::Request;
 
-	CompletedRequest(Request *r)
-		: buffers(r->buffers()), request(r)
+	CompletedRequest(unsigned int seq, Request *r)
+		: sequence(seq), buffers(r->buffers()), metadata(r->metadata()), request(r), framerate(0),
+		  completed(std::chrono::steady_clock::now())
 	{
 		r->reuse();
 	}
 
+	unsigned int sequence;
 	BufferMap buffers;
+	ControlList metadata;
 	Request *request;
+	float framerate;
+	std::chrono::steady_clock::time_point completed;
 };
 
 using CompletedRequestPtr = std::shared_ptr<CompletedRequest>;
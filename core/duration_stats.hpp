@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * duration_stats.hpp - accumulate timings of a repeated operation.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+class DurationStats
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	DurationStats(std::string const &name) : name_(name) { Reset(); }
+
+	void Add(std::chrono::nanoseconds d)
+	{
+		count_++;
+		total_ += d;
+		max_ = std::max(max_, d);
+	}
+	// Convenience for the common "time this block" pattern.
+	void Add(Clock::time_point start) { Add(Clock::now() - start); }
+
+	void Reset()
+	{
+		count_ = 0;
+		total_ = max_ = std::chrono::nanoseconds(0);
+	}
+
+	uint64_t Count() const { return count_; }
+	double MeanUs() const { return count_ ? total_.count() / 1000.0 / count_ : 0; }
+	double MaxUs() const { return max_.count() / 1000.0; }
+
+	std::string ToString() const
+	{
+		std::stringstream ss;
+		ss << name_ << ": " << count_ << " calls";
+		if (count_)
+			ss << ", mean " << MeanUs() << "us, max " << MaxUs() << "us";
+		return ss.str();
+	}
+
+private:
+	std::string name_;
+	uint64_t count_;
+	std::chrono::nanoseconds total_;
+	std::chrono::nanoseconds max_;
+};
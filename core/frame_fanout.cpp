@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * frame_fanout.cpp - hand completed frames to several consumers.
+ */
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <stdexcept>
+
+#include "core/frame_fanout.hpp"
+
+FramePolicy FramePolicy::FromString(std::string const &policy)
+{
+	unsigned int n = 0, depth = 0;
+	char end;
+	if (policy == "latest")
+		return LatestOnly();
+	if (sscanf(policy.c_str(), "fifo:%u%c", &depth, &end) == 1 && depth)
+		return Fifo(depth);
+	if (sscanf(policy.c_str(), "every:%u%c", &n, &end) == 1 && n)
+		return EveryNth(n);
+	if (sscanf(policy.c_str(), "every:%u:%u%c", &n, &depth, &end) == 2 && n && depth)
+		return EveryNth(n, depth);
+	throw std::runtime_error("invalid frame policy \"" + policy + "\", expected latest, fifo:DEPTH or every:N[:DEPTH]");
+}
+
+FrameSubscription::FrameSubscription(libcamera::Stream *stream, FramePolicy policy)
+	: stream_(stream), policy_(policy), published_(0), delivered_(0), dropped_(0)
+{
+	if (!policy_.depth || !policy_.every)
+		throw std::runtime_error("frame subscription depth and interval must be at least 1");
+	fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fd_ < 0)
+		throw std::runtime_error("failed to create frame subscription eventfd");
+}
+
+FrameSubscription::~FrameSubscription()
+{
+	close(fd_);
+}
+
+// The eventfd is kept readable exactly while the queue is non-empty. That's simpler than
+// counting, as frames can leave the queue by being dropped as well as by being popped.
+
+void FrameSubscription::Publish(CompletedRequestPtr const &frame)
+{
+	// A dropped frame goes back to the camera when this goes, after the lock is released.
+	CompletedRequestPtr dropped;
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (published_++ % policy_.every)
+		return;
+
+	if (queue_.size() == policy_.depth)
+	{
+		dropped = std::move(queue_.front());
+		queue_.pop_front();
+		dropped_++;
+	}
+	queue_.push_back(frame);
+	delivered_++;
+
+	if (queue_.size() == 1)
+	{
+		uint64_t one = 1;
+		if (write(fd_, &one, sizeof(one)) != sizeof(one))
+			throw std::runtime_error("failed to signal frame subscription");
+	}
+}
+
+CompletedRequestPtr FrameSubscription::TryPop()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (queue_.empty())
+		return nullptr;
+
+	CompletedRequestPtr frame = std::move(queue_.front());
+	queue_.pop_front();
+	if (queue_.empty())
+	{
+		uint64_t count;
+		if (read(fd_, &count, sizeof(count)) != sizeof(count))
+			throw std::runtime_error("failed to reset frame subscription");
+	}
+	return frame;
+}
+
+CompletedRequestPtr FrameSubscription::Wait(int timeout_ms)
+{
+	pollfd p = { fd_, POLLIN, 0 };
+	if (poll(&p, 1, timeout_ms) <= 0)
+		return nullptr;
+	// Another thread may have taken it first.
+	return TryPop();
+}
+
+void FrameSubscription::Clear()
+{
+	std::deque<CompletedRequestPtr> frames;
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (queue_.empty())
+		return;
+
+	frames.swap(queue_);
+	uint64_t count;
+	if (read(fd_, &count, sizeof(count)) != sizeof(count))
+		throw std::runtime_error("failed to reset frame subscription");
+}
+
+uint64_t FrameSubscription::Delivered() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return delivered_;
+}
+
+uint64_t FrameSubscription::Dropped() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return dropped_;
+}
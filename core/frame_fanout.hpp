@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * frame_fanout.hpp - hand completed frames to several consumers.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <libcamera/stream.h>
+
+#include "core/completed_request.hpp"
+
+// How a consumer wants frames queued for it. A full queue always drops its oldest frame, so a
+// consumer that falls behind loses frames rather than holding on to the camera's buffers.
+struct FramePolicy
+{
+	// Only the newest frame, e.g. for a preview.
+	static FramePolicy LatestOnly() { return { 1, 1 }; }
+	// Every frame, queued up to depth, e.g. for a recorder.
+	static FramePolicy Fifo(unsigned int depth) { return { depth, 1 }; }
+	// One frame in every n, queued up to depth, e.g. for an analysis stage.
+	static FramePolicy EveryNth(unsigned int n, unsigned int depth = 1) { return { depth, n }; }
+	// One of "latest", "fifo:DEPTH" or "every:N[:DEPTH]".
+	static FramePolicy FromString(std::string const &policy);
+
+	unsigned int depth;
+	unsigned int every;
+};
+
+// One consumer's queue. Frames are the same refcounted CompletedRequests that the application
+// gets, so nothing is copied, and each buffer is requeued once every holder has let it go.
+class FrameSubscription
+{
+public:
+	FrameSubscription(libcamera::Stream *stream, FramePolicy policy);
+	~FrameSubscription();
+
+	libcamera::Stream *GetStream() const { return stream_; }
+	FramePolicy GetPolicy() const { return policy_; }
+
+	// Readable while frames are queued, so a consumer can wait on it in its own event loop.
+	int Fd() const { return fd_; }
+	// The oldest queued frame, or null if there isn't one.
+	CompletedRequestPtr TryPop();
+	// Wait up to timeout_ms (-1 for ever) for a frame, returning null if none came.
+	CompletedRequestPtr Wait(int timeout_ms = -1);
+
+	uint64_t Delivered() const;
+	uint64_t Dropped() const;
+
+	// Only for RPiCamApp to call, from the camera's completion callback.
+	void Publish(CompletedRequestPtr const &frame);
+	void Clear();
+
+private:
+	libcamera::Stream *stream_;
+	FramePolicy policy_;
+	int fd_;
+	mutable std::mutex mutex_;
+	std::deque<CompletedRequestPtr> queue_;
+	uint64_t published_;
+	uint64_t delivered_;
+	uint64_t dropped_;
+};
+
+using FrameSubscriptionPtr = std::shared_ptr<FrameSubscription>;
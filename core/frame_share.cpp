@@ -0,0 +1,497 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * frame_share.cpp - share camera buffers with other processes without copying.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/dma-buf.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+
+#include "core/frame_share.hpp"
+#include "core/logging.hpp"
+
+static constexpr char MAGIC[8] = { 'R', 'P', 'I', 'F', 'S', 'H', 'R', 'M' };
+static constexpr uint32_t VERSION = 1;
+static constexpr unsigned int RING_SIZE = 64;
+
+// Both processes use these atomics through their own mappings, so they must not need locks.
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory needs lock-free 64-bit atomics");
+
+// An entry is rewritten each time the ring wraps. tag holds the entry's ring position + 1 once
+// it's valid and is zero while it's being written, so readers can tell if it changed under them.
+struct RingEntry
+{
+	std::atomic<uint64_t> tag;
+	std::atomic<uint64_t> index;
+	std::atomic<uint64_t> sequence;
+	std::atomic<uint64_t> timestamp_ns;
+	std::atomic<uint64_t> published_ns;
+};
+
+struct SharedMemory
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t num_buffers;
+	FrameShareFormat format;
+	uint64_t buffer_size;
+	// Number of frames ever announced.
+	std::atomic<uint64_t> write_index;
+	// The ring position + 1 of the frame in each buffer, or zero once the camera has it back.
+	std::atomic<uint64_t> buffer_tag[FrameShareServer::MAX_BUFFERS];
+	// Written by the clients: how far each has read, and a bit for each buffer it's reading.
+	std::atomic<uint64_t> read_index[FrameShareServer::MAX_CLIENTS];
+	std::atomic<uint32_t> held[FrameShareServer::MAX_CLIENTS];
+	RingEntry ring[RING_SIZE];
+};
+
+// Sent to each client as it connects, along with the memory, notify, release and buffer fds.
+struct Hello
+{
+	uint32_t version;
+	uint32_t slot;
+	uint32_t num_buffers;
+	uint64_t memory_size;
+};
+
+static uint64_t monotonic_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void signal_fd(int fd)
+{
+	uint64_t one = 1;
+	// A full counter means it's readable anyway.
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		LOG(1, "FrameShare: failed to signal eventfd: " << strerror(errno));
+}
+
+static void drain_fd(int fd)
+{
+	uint64_t count;
+	while (read(fd, &count, sizeof(count)) == sizeof(count))
+		;
+}
+
+static void dma_sync(int fd, uint64_t flags)
+{
+	// Not every buffer is a dmabuf (the benchmark uses memfds), so failure here is fine.
+	dma_buf_sync sync = {};
+	sync.flags = flags | DMA_BUF_SYNC_READ;
+	ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+FrameShareServer::FrameShareServer(std::string const &socket_path, FrameShareFormat const &format,
+								   std::vector<int> const &fds, size_t buffer_size, unsigned int max_held)
+	: socket_path_(socket_path), listen_fd_(-1), memory_fd_(-1), release_fd_(-1), memory_size_(sizeof(SharedMemory)),
+	  memory_(nullptr), buffer_fds_(fds), buffer_size_(buffer_size), max_held_(max_held), reclaimed_(0),
+	  stop_fd_(-1)
+{
+	if (fds.empty() || fds.size() > MAX_BUFFERS)
+		throw std::runtime_error("FrameShare: can share between 1 and " + std::to_string(MAX_BUFFERS) + " buffers");
+	if (!max_held_ || max_held_ >= fds.size())
+		throw std::runtime_error("FrameShare: must keep at least one frame, and fewer than there are buffers");
+	free_slots_ = (uint32_t)((1ULL << MAX_CLIENTS) - 1);
+
+	memory_fd_ = memfd_create("rpicam-frame-share", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memory_fd_ < 0 || ftruncate(memory_fd_, memory_size_))
+		throw std::runtime_error("FrameShare: failed to create shared memory: " + std::string(strerror(errno)));
+	// Clients need to write to it, but mustn't be able to shrink it from under us.
+	fcntl(memory_fd_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+	void *mapping = mmap(nullptr, memory_size_, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd_, 0);
+	if (mapping == MAP_FAILED)
+		throw std::runtime_error("FrameShare: failed to map shared memory: " + std::string(strerror(errno)));
+	memory_ = new (mapping) SharedMemory();
+	memcpy(memory_->magic, MAGIC, sizeof(MAGIC));
+	memory_->version = VERSION;
+	memory_->num_buffers = fds.size();
+	memory_->format = format;
+	memory_->buffer_size = buffer_size;
+
+	release_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	stop_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (release_fd_ < 0 || stop_fd_ < 0)
+		throw std::runtime_error("FrameShare: failed to create eventfds");
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("FrameShare: socket path too long: " + socket_path);
+	strcpy(addr.sun_path, socket_path.c_str());
+	unlink(socket_path.c_str());
+	listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (listen_fd_ < 0 || bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) || listen(listen_fd_, MAX_CLIENTS))
+		throw std::runtime_error("FrameShare: failed to listen on " + socket_path + ": " + strerror(errno));
+
+	reactor_.Add(listen_fd_, [this](uint32_t) { accept(); });
+	reactor_.Add(release_fd_, [this](uint32_t) {
+		drain_fd(release_fd_);
+		std::vector<std::shared_ptr<void>> released;
+		std::lock_guard<std::mutex> lock(mutex_);
+		released = releaseLocked(false);
+		// Along with anything Publish() took back.
+		std::move(reclaimed_frames_.begin(), reclaimed_frames_.end(), std::back_inserter(released));
+		reclaimed_frames_.clear();
+	});
+	reactor_.Add(stop_fd_, [this](uint32_t) { reactor_.Stop(); });
+	thread_ = std::thread([this] { reactor_.Run(); });
+
+	LOG(1, "Sharing " << fds.size() << " buffers of " << format.width << "x" << format.height << " on "
+					  << socket_path << ", keeping up to " << max_held << " frames for clients");
+}
+
+FrameShareServer::~FrameShareServer()
+{
+	signal_fd(stop_fd_);
+	thread_.join();
+
+	for (auto const &[socket, client] : clients_)
+	{
+		close(client.socket);
+		close(client.notify_fd);
+	}
+	Clear();
+	LOG(2, "FrameShare: " << reclaimed_ << " frames reclaimed from clients");
+
+	munmap(memory_, memory_size_);
+	close(memory_fd_);
+	close(release_fd_);
+	close(stop_fd_);
+	close(listen_fd_);
+	unlink(socket_path_.c_str());
+}
+
+void FrameShareServer::accept()
+{
+	int socket = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+	if (socket < 0)
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!free_slots_)
+	{
+		LOG(1, "FrameShare: too many clients, refusing another");
+		close(socket);
+		return;
+	}
+	unsigned int slot = __builtin_ctz(free_slots_);
+	int notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (notify_fd < 0)
+	{
+		close(socket);
+		return;
+	}
+
+	// The client starts from the next frame.
+	memory_->held[slot] = 0;
+	memory_->read_index[slot] = memory_->write_index.load();
+
+	Hello hello = { VERSION, slot, (uint32_t)buffer_fds_.size(), memory_size_ };
+	std::vector<int> fds = { memory_fd_, notify_fd, release_fd_ };
+	fds.insert(fds.end(), buffer_fds_.begin(), buffer_fds_.end());
+
+	iovec iov = { &hello, sizeof(hello) };
+	std::vector<uint8_t> control(CMSG_SPACE(fds.size() * sizeof(int)));
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data();
+	msg.msg_controllen = control.size();
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+	if (sendmsg(socket, &msg, MSG_NOSIGNAL) < 0)
+	{
+		LOG(1, "FrameShare: failed to send buffers to client: " << strerror(errno));
+		close(notify_fd);
+		close(socket);
+		return;
+	}
+
+	free_slots_ &= ~(1u << slot);
+	clients_[socket] = { socket, notify_fd, slot };
+	// Clients never send anything, so this only fires when they go.
+	reactor_.Add(socket, [this, socket](uint32_t) { disconnect(socket); });
+	LOG(1, "FrameShare: client " << slot << " connected");
+}
+
+void FrameShareServer::disconnect(int socket)
+{
+	std::vector<std::shared_ptr<void>> released;
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = clients_.find(socket);
+	if (it == clients_.end())
+		return;
+
+	reactor_.Remove(socket);
+	close(socket);
+	close(it->second.notify_fd);
+	free_slots_ |= 1u << it->second.slot;
+	LOG(1, "FrameShare: client " << it->second.slot << " disconnected");
+	clients_.erase(it);
+	// Whatever it was holding can go now.
+	released = releaseLocked(false);
+}
+
+std::vector<std::shared_ptr<void>> FrameShareServer::releaseLocked(bool all)
+{
+	// Frames are returned to the caller to be dropped once the lock is released, as dropping
+	// them can requeue them to the camera.
+	std::vector<std::shared_ptr<void>> released;
+
+	auto wanted = [&](unsigned int index) {
+		uint64_t position = memory_->buffer_tag[index].load() - 1;
+		for (auto const &[socket, client] : clients_)
+		{
+			// A client sets its held bit before moving its read index past the frame, so if we
+			// see the index moved, we'll also see the bit if it's still reading.
+			if (memory_->read_index[client.slot].load() <= position ||
+				memory_->held[client.slot].load() & (1u << index))
+				return true;
+		}
+		return false;
+	};
+
+	for (auto it = held_.begin(); it != held_.end();)
+	{
+		bool over_budget = (size_t)(held_.end() - it) > max_held_;
+		if (!all && !over_budget && wanted(it->first))
+		{
+			++it;
+			continue;
+		}
+		if (!all && wanted(it->first))
+			reclaimed_++;
+		// Tell anyone still reading it that it's gone.
+		memory_->buffer_tag[it->first] = 0;
+		released.push_back(std::move(it->second));
+		it = held_.erase(it);
+	}
+	return released;
+}
+
+void FrameShareServer::Publish(unsigned int index, uint64_t sequence, uint64_t timestamp_ns, std::shared_ptr<void> hold)
+{
+	if (index >= buffer_fds_.size())
+		throw std::runtime_error("FrameShare: no buffer " + std::to_string(index));
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	// With no one to send it to, the frame can go straight back.
+	if (clients_.empty())
+		return;
+
+	uint64_t position = memory_->write_index.load(std::memory_order_relaxed);
+	RingEntry &entry = memory_->ring[position % RING_SIZE];
+	entry.tag.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	entry.index.store(index, std::memory_order_relaxed);
+	entry.sequence.store(sequence, std::memory_order_relaxed);
+	entry.timestamp_ns.store(timestamp_ns, std::memory_order_relaxed);
+	entry.published_ns.store(monotonic_ns(), std::memory_order_relaxed);
+	entry.tag.store(position + 1, std::memory_order_release);
+	memory_->buffer_tag[index] = position + 1;
+	memory_->write_index.store(position + 1);
+
+	held_.emplace_back(index, std::move(hold));
+	// Publish() runs on the camera's completion thread, where dropping the last reference to a
+	// frame would requeue its request, so our thread does that instead.
+	std::vector<std::shared_ptr<void>> released = releaseLocked(false);
+	if (!released.empty())
+	{
+		std::move(released.begin(), released.end(), std::back_inserter(reclaimed_frames_));
+		signal_fd(release_fd_);
+	}
+
+	for (auto const &[socket, client] : clients_)
+		signal_fd(client.notify_fd);
+}
+
+void FrameShareServer::Clear()
+{
+	std::vector<std::shared_ptr<void>> released;
+	std::lock_guard<std::mutex> lock(mutex_);
+	released = releaseLocked(true);
+	std::move(reclaimed_frames_.begin(), reclaimed_frames_.end(), std::back_inserter(released));
+	reclaimed_frames_.clear();
+}
+
+unsigned int FrameShareServer::NumClients() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return clients_.size();
+}
+
+uint64_t FrameShareServer::Reclaimed() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return reclaimed_;
+}
+
+FrameShareClient::FrameShareClient(std::string const &socket_path)
+	: memory_fd_(-1), notify_fd_(-1), release_fd_(-1), memory_(nullptr), lost_(0)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("FrameShare: socket path too long: " + socket_path);
+	strcpy(addr.sun_path, socket_path.c_str());
+	socket_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (socket_ < 0 || connect(socket_, (sockaddr *)&addr, sizeof(addr)))
+		throw std::runtime_error("FrameShare: failed to connect to " + socket_path + ": " + strerror(errno));
+
+	Hello hello;
+	iovec iov = { &hello, sizeof(hello) };
+	std::vector<uint8_t> control(CMSG_SPACE((3 + FrameShareServer::MAX_BUFFERS) * sizeof(int)));
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data();
+	msg.msg_controllen = control.size();
+	// The server closes the connection at once if it has no room for us.
+	if (recvmsg(socket_, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello))
+		throw std::runtime_error("FrameShare: server refused connection");
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+		throw std::runtime_error("FrameShare: server sent no buffers");
+	std::vector<int> fds((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+	memcpy(fds.data(), CMSG_DATA(cmsg), fds.size() * sizeof(int));
+	if (hello.version != VERSION || fds.size() != 3 + hello.num_buffers)
+	{
+		for (int fd : fds)
+			close(fd);
+		throw std::runtime_error("FrameShare: server speaks a different version");
+	}
+
+	memory_fd_ = fds[0];
+	notify_fd_ = fds[1];
+	release_fd_ = fds[2];
+	buffer_fds_.assign(fds.begin() + 3, fds.end());
+	slot_ = hello.slot;
+	memory_size_ = hello.memory_size;
+
+	void *mapping = mmap(nullptr, memory_size_, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd_, 0);
+	if (mapping == MAP_FAILED)
+		throw std::runtime_error("FrameShare: failed to map shared memory: " + std::string(strerror(errno)));
+	memory_ = static_cast<SharedMemory *>(mapping);
+	if (memcmp(memory_->magic, MAGIC, sizeof(MAGIC)))
+		throw std::runtime_error("FrameShare: bad shared memory");
+	format_ = memory_->format;
+	buffer_size_ = memory_->buffer_size;
+
+	for (int fd : buffer_fds_)
+	{
+		void *buffer = mmap(nullptr, buffer_size_, PROT_READ, MAP_SHARED, fd, 0);
+		if (buffer == MAP_FAILED)
+			throw std::runtime_error("FrameShare: failed to map buffer: " + std::string(strerror(errno)));
+		buffers_.push_back(static_cast<uint8_t *>(buffer));
+	}
+	read_index_ = memory_->read_index[slot_].load();
+}
+
+FrameShareClient::~FrameShareClient()
+{
+	for (uint8_t *buffer : buffers_)
+		munmap(buffer, buffer_size_);
+	for (int fd : buffer_fds_)
+		close(fd);
+	if (memory_)
+		munmap(memory_, memory_size_);
+	for (int fd : { memory_fd_, notify_fd_, release_fd_, socket_ })
+	{
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+bool FrameShareClient::next(Frame &frame, bool latest)
+{
+	while (true)
+	{
+		uint64_t write_index = memory_->write_index.load();
+		if (read_index_ >= write_index)
+			return false;
+		// Anything the ring has already overwritten is gone.
+		uint64_t behind = latest ? 1 : RING_SIZE;
+		if (write_index - read_index_ > behind)
+		{
+			lost_ += write_index - behind - read_index_;
+			read_index_ = write_index - behind;
+		}
+
+		uint64_t position = read_index_++;
+		RingEntry &entry = memory_->ring[position % RING_SIZE];
+		uint64_t tag = entry.tag.load(std::memory_order_acquire);
+		frame.index = entry.index.load(std::memory_order_relaxed);
+		frame.sequence = entry.sequence.load(std::memory_order_relaxed);
+		frame.timestamp_ns = entry.timestamp_ns.load(std::memory_order_relaxed);
+		frame.published_ns = entry.published_ns.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		bool valid = tag == position + 1 && entry.tag.load(std::memory_order_relaxed) == tag &&
+					 frame.index < buffers_.size();
+
+		// Claim the buffer before telling the server we've read past it, then make sure the
+		// server hadn't already taken it back.
+		uint32_t bit = valid ? 1u << frame.index : 0;
+		memory_->held[slot_].fetch_or(bit);
+		memory_->read_index[slot_] = read_index_;
+		if (!valid || memory_->buffer_tag[frame.index].load() != position + 1)
+		{
+			memory_->held[slot_].fetch_and(~bit);
+			signal_fd(release_fd_);
+			lost_++;
+			continue;
+		}
+
+		frame.data = buffers_[frame.index];
+		frame.size = buffer_size_;
+		frame.position = position;
+		dma_sync(buffer_fds_[frame.index], DMA_BUF_SYNC_START);
+		return true;
+	}
+}
+
+bool FrameShareClient::Acquire(Frame &frame, int timeout_ms, bool latest)
+{
+	pollfd p = { notify_fd_, POLLIN, 0 };
+	while (true)
+	{
+		// Clear the notification before looking, so that nothing announced after we look is missed.
+		drain_fd(notify_fd_);
+		if (next(frame, latest))
+			return true;
+		if (poll(&p, 1, timeout_ms) <= 0)
+			return false;
+	}
+}
+
+bool FrameShareClient::Release(Frame const &frame)
+{
+	dma_sync(buffer_fds_[frame.index], DMA_BUF_SYNC_END);
+	bool valid = memory_->buffer_tag[frame.index].load() == frame.position + 1;
+	memory_->held[slot_].fetch_and(~(1u << frame.index));
+	signal_fd(release_fd_);
+	return valid;
+}
@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * frame_share.hpp - share camera buffers with other processes without copying.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/reactor.hpp"
+
+// The server hands every client the buffers' dmabuf fds, once, over a Unix domain socket, along
+// with a shared memory region. Each frame is then announced by writing its buffer index, sequence
+// number and timestamp into a ring in that memory, and waking the clients through an eventfd each.
+//
+// Clients record in their own part of the shared memory how far through the ring they've read and
+// which buffers they're still reading, and tell the server when they let go of one. The server
+// never waits for a client: it only keeps so many frames for them, and once those run out the
+// oldest goes back to the camera whether it's been released or not. Clients check afterwards that
+// the frame they read wasn't reclaimed underneath them.
+
+struct FrameShareFormat
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t fourcc;
+};
+
+class FrameShareServer
+{
+public:
+	static constexpr unsigned int MAX_BUFFERS = 32;
+	static constexpr unsigned int MAX_CLIENTS = 16;
+
+	// The server keeps at most max_held frames for clients, including the newest.
+	FrameShareServer(std::string const &socket_path, FrameShareFormat const &format, std::vector<int> const &fds,
+					 size_t buffer_size, unsigned int max_held);
+	~FrameShareServer();
+
+	// Announce a frame in buffer index. The server keeps hold, which it lets go once no client
+	// wants the frame any more. Call from one thread only. Frames the server was keeping are only
+	// ever let go on its own thread (or in Clear()), never the one calling Publish().
+	void Publish(unsigned int index, uint64_t sequence, uint64_t timestamp_ns, std::shared_ptr<void> hold);
+	// Take back every frame, as when the camera stops.
+	void Clear();
+
+	unsigned int NumClients() const;
+	// Frames taken back before every client had finished with them.
+	uint64_t Reclaimed() const;
+
+private:
+	struct Client
+	{
+		int socket;
+		int notify_fd;
+		unsigned int slot;
+	};
+
+	void accept();
+	void disconnect(int socket);
+	std::vector<std::shared_ptr<void>> releaseLocked(bool all);
+
+	std::string socket_path_;
+	int listen_fd_;
+	int memory_fd_;
+	int release_fd_;
+	size_t memory_size_;
+	struct SharedMemory *memory_;
+	std::vector<int> buffer_fds_;
+	size_t buffer_size_;
+	unsigned int max_held_;
+
+	mutable std::mutex mutex_;
+	std::map<int, Client> clients_;
+	uint32_t free_slots_;
+	// The frames clients may still want, oldest first, with the buffer they're in.
+	std::vector<std::pair<unsigned int, std::shared_ptr<void>>> held_;
+	// Frames Publish() took back, waiting for our thread to let them go.
+	std::vector<std::shared_ptr<void>> reclaimed_frames_;
+	uint64_t reclaimed_;
+
+	Reactor reactor_;
+	int stop_fd_;
+	std::thread thread_;
+};
+
+class FrameShareClient
+{
+public:
+	struct Frame
+	{
+		unsigned int index;
+		uint64_t sequence;
+		uint64_t timestamp_ns;
+		// CLOCK_MONOTONIC time the server announced the frame.
+		uint64_t published_ns;
+		uint8_t const *data;
+		size_t size;
+		// Where the frame was in the ring, for Release() to check.
+		uint64_t position;
+	};
+
+	FrameShareClient(std::string const &socket_path);
+	~FrameShareClient();
+
+	FrameShareFormat const &Format() const { return format_; }
+	// Readable when new frames have been announced.
+	int Fd() const { return notify_fd_; }
+
+	// Take the next frame, skipping any that were overwritten or reclaimed before we got to them,
+	// or with latest, skipping straight to the newest. Returns false if there isn't one (after
+	// waiting up to timeout_ms, -1 for ever).
+	bool Acquire(Frame &frame, int timeout_ms = -1, bool latest = false);
+	// Hand the frame back. Returns false if the server had to reclaim it while we were reading,
+	// in which case whatever was read from it can't be trusted.
+	bool Release(Frame const &frame);
+
+	// Frames we never saw because we were too slow.
+	uint64_t Lost() const { return lost_; }
+
+private:
+	bool next(Frame &frame, bool latest);
+
+	int socket_;
+	int memory_fd_;
+	int notify_fd_;
+	int release_fd_;
+	unsigned int slot_;
+	size_t memory_size_;
+	struct SharedMemory *memory_;
+	FrameShareFormat format_;
+	std::vector<int> buffer_fds_;
+	std::vector<uint8_t *> buffers_;
+	size_t buffer_size_;
+	uint64_t read_index_;
+	uint64_t lost_;
+};
@@ -0,0 +1,260 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * logging.cpp - asynchronous log writer.
+ */
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/logging.hpp"
+
+namespace
+{
+
+// Each thread gets its own single producer, single consumer ring of these. A message too
+// long for one record carries on in the following ones.
+struct Record
+{
+	static constexpr unsigned int TEXT_SIZE = 116;
+
+	uint64_t sequence;
+	uint16_t length;
+	bool continued;
+	char text[TEXT_SIZE];
+};
+
+struct Ring
+{
+	static constexpr unsigned int SIZE = 1024; // must be a power of 2
+
+	std::array<Record, SIZE> records;
+	// Only the owning thread advances head, and only the writer thread advances tail.
+	std::atomic<unsigned int> head = 0;
+	std::atomic<unsigned int> tail = 0;
+	std::atomic<unsigned int> dropped = 0;
+};
+
+// A streambuf that formats into a string which keeps its capacity from one message to the
+// next, so that logging doesn't normally allocate.
+class MessageBuffer : public std::streambuf
+{
+public:
+	MessageBuffer() { text_.reserve(256); }
+	std::string &Text() { return text_; }
+
+protected:
+	int_type overflow(int_type c) override
+	{
+		if (c != traits_type::eof())
+			text_.push_back(traits_type::to_char_type(c));
+		return c;
+	}
+	std::streamsize xsputn(char const *s, std::streamsize n) override
+	{
+		text_.append(s, n);
+		return n;
+	}
+
+private:
+	std::string text_;
+};
+
+struct ThreadState
+{
+	ThreadState() : stream(&buffer) {}
+
+	MessageBuffer buffer;
+	std::ostream stream;
+	std::shared_ptr<Ring> ring;
+};
+
+class Writer
+{
+public:
+	Writer() : abort_(false), sequence_(0), thread_(&Writer::run, this) {}
+	~Writer()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+		}
+		cond_.notify_one();
+		thread_.join();
+		Drain();
+		alive = false;
+	}
+
+	void Post(ThreadState &state)
+	{
+		if (!state.ring)
+		{
+			state.ring = std::make_shared<Ring>();
+			std::lock_guard<std::mutex> lock(rings_mutex_);
+			rings_.push_back(state.ring);
+		}
+		Ring &ring = *state.ring;
+		std::string const &text = state.buffer.Text();
+
+		unsigned int n = std::max<unsigned int>(1, (text.size() + Record::TEXT_SIZE - 1) / Record::TEXT_SIZE);
+		n = std::min(n, Ring::SIZE / 4);
+		unsigned int head = ring.head.load(std::memory_order_relaxed);
+		if (head - ring.tail.load(std::memory_order_acquire) + n > Ring::SIZE)
+		{
+			// Never wait for the writer; count what we lose and say so later.
+			ring.dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		uint64_t sequence = sequence_.fetch_add(1, std::memory_order_relaxed);
+		for (unsigned int i = 0; i < n; i++)
+		{
+			Record &record = ring.records[(head + i) & (Ring::SIZE - 1)];
+			size_t offset = i * Record::TEXT_SIZE;
+			record.sequence = sequence;
+			record.length = std::min<size_t>(text.size() - std::min(offset, text.size()), Record::TEXT_SIZE);
+			record.continued = i + 1 < n;
+			memcpy(record.text, text.data() + offset, record.length);
+		}
+		ring.head.store(head + n, std::memory_order_release);
+	}
+
+	// Write out, in order, everything that has been posted. This can run on any thread.
+	void Drain()
+	{
+		std::lock_guard<std::mutex> drain_lock(drain_mutex_);
+
+		std::vector<std::shared_ptr<Ring>> rings;
+		{
+			std::lock_guard<std::mutex> lock(rings_mutex_);
+			rings = rings_;
+		}
+
+		messages_.clear();
+		unsigned int dropped = 0;
+		for (auto &ring : rings)
+		{
+			unsigned int head = ring->head.load(std::memory_order_acquire);
+			for (unsigned int tail = ring->tail.load(std::memory_order_relaxed); tail != head; tail++)
+			{
+				Record const &record = ring->records[tail & (Ring::SIZE - 1)];
+				if (messages_.empty() || messages_.back().first != record.sequence)
+					messages_.emplace_back(record.sequence, std::string());
+				messages_.back().second.append(record.text, record.length);
+			}
+			ring->tail.store(head, std::memory_order_release);
+			dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+		}
+
+		// Forget the rings of threads that have gone, once they're empty. Our copies have to go
+		// first, or no ring would ever look unowned.
+		rings.clear();
+		{
+			std::lock_guard<std::mutex> lock(rings_mutex_);
+			rings_.erase(std::remove_if(rings_.begin(), rings_.end(),
+										[](auto const &r) {
+											return r.use_count() == 1 && r->head.load() == r->tail.load();
+										}),
+						 rings_.end());
+		}
+
+		if (messages_.empty() && !dropped)
+			return;
+
+		std::sort(messages_.begin(), messages_.end(),
+				  [](auto const &a, auto const &b) { return a.first < b.first; });
+		output_.clear();
+		for (auto const &m : messages_)
+		{
+			output_ += m.second;
+			output_ += '\n';
+		}
+		if (dropped)
+			output_ += "WARNING: " + std::to_string(dropped) + " log messages dropped\n";
+		std::cerr.write(output_.data(), output_.size());
+		std::cerr.flush();
+	}
+
+	static inline std::atomic<bool> alive = true;
+
+private:
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (!abort_)
+		{
+			// Posting never wakes us, as that could cost a system call on the frame path,
+			// so just look every so often.
+			cond_.wait_for(lock, std::chrono::milliseconds(20));
+			lock.unlock();
+			Drain();
+			lock.lock();
+		}
+	}
+
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	bool abort_;
+	std::atomic<uint64_t> sequence_;
+	std::mutex rings_mutex_;
+	std::vector<std::shared_ptr<Ring>> rings_;
+	std::mutex drain_mutex_;
+	std::vector<std::pair<uint64_t, std::string>> messages_;
+	std::string output_;
+	std::thread thread_;
+};
+
+Writer &writer()
+{
+	static Writer w;
+	return w;
+}
+
+ThreadState &thread_state()
+{
+	thread_local ThreadState state;
+	return state;
+}
+
+} // namespace
+
+namespace rpicam_log
+{
+
+std::ostream &Begin()
+{
+	ThreadState &state = thread_state();
+	state.buffer.Text().clear();
+	return state.stream;
+}
+
+void Post()
+{
+	ThreadState &state = thread_state();
+	// Anything logged while the program is exiting goes straight out.
+	if (!Writer::alive)
+	{
+		std::cerr << state.buffer.Text() << std::endl;
+		return;
+	}
+	writer().Post(state);
+}
+
+void Flush()
+{
+	if (Writer::alive)
+		writer().Drain();
+}
+
+} // namespace rpicam_log
@@ -1,9 +1,46 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * logging.hpp - logging macros.
+ */
+
+#pragma once
+
+#include <iostream>
+
 #include "core/rpicam_app.hpp"
 
+// Messages above this level are compiled out altogether. The build sets it from the
+// log_max_level option.
+#ifndef RPICAM_LOG_MAX_LEVEL
+#define RPICAM_LOG_MAX_LEVEL 2
+#endif
+
+namespace rpicam_log
+{
+// A stream, private to the calling thread, to format the next message into.
+std::ostream &Begin();
+// Queue the message formatted since Begin() to be written out by the background thread.
+// This neither blocks nor takes a lock, so it's safe to use on the frame path.
+void Post();
+// Write out everything queued so far before returning.
+void Flush();
+} // namespace rpicam_log
+
 #define LOG(level, text)                                                                                               \
 	do                                                                                                                 \
 	{                                                                                                                  \
-		if (RPiCamApp::GetVerbosity() >= level)                                                                     \
-			std::cerr << text << std::endl;                                                                            \
+		if ((level) <= RPICAM_LOG_MAX_LEVEL && RPiCamApp::GetVerbosity() >= (level))                                  \
+		{                                                                                                              \
+			rpicam_log::Begin() << text;                                                                               \
+			rpicam_log::Post();                                                                                        \
+		}                                                                                                              \
+	} while (0)
+// Errors are written straight away, but only after anything that was logged before them.
+#define LOG_ERROR(text)                                                                                                \
+	do                                                                                                                 \
+	{                                                                                                                  \
+		rpicam_log::Flush();                                                                                           \
+		std::cerr << text << std::endl;                                                                                \
 	} while (0)
-#define LOG_ERROR(text) std::cerr << text << std::endl
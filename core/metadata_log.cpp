@@ -0,0 +1,127 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * metadata_log.cpp - memory mapped binary log of per-frame metadata.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+
+#include <libcamera/control_ids.h>
+
+#include "core/logging.hpp"
+#include "core/metadata_log.hpp"
+
+namespace controls = libcamera::controls;
+
+// The file is extended a long way ahead of the writer. It stays sparse until written, and the
+// frame loop only ever has to remap it every few hours.
+static constexpr size_t INITIAL_RECORDS = 1 << 20;
+
+MetadataLog::MetadataLog(std::string const &filename)
+	: filename_(filename), fd_(-1), mapping_(nullptr), capacity_(0), count_(0)
+{
+	// Without a name the log is only wanted for exporting, so it needn't outlive us.
+	if (filename.empty())
+		fd_ = open("/tmp", O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+	else
+		fd_ = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd_ < 0)
+		throw std::runtime_error("failed to open metadata log " + filename + ": " + strerror(errno));
+
+	map(INITIAL_RECORDS);
+	memcpy(mapping_, MAGIC, sizeof(MAGIC));
+	uint32_t version = VERSION, record_size = sizeof(MetadataRecord);
+	memcpy(mapping_ + 8, &version, sizeof(version));
+	memcpy(mapping_ + 12, &record_size, sizeof(record_size));
+	if (!filename.empty())
+		LOG(2, "Logging frame metadata to " << filename);
+}
+
+MetadataLog::~MetadataLog()
+{
+	uint64_t count = count_;
+	memcpy(mapping_ + 16, &count, sizeof(count));
+	munmap(mapping_, HEADER_SIZE + capacity_ * sizeof(MetadataRecord));
+	// Trim the file back to what was actually written.
+	if (ftruncate(fd_, HEADER_SIZE + count_ * sizeof(MetadataRecord)))
+		LOG_ERROR("WARNING: failed to trim metadata log " << filename_);
+	close(fd_);
+	if (!filename_.empty())
+		LOG(2, "Logged metadata for " << count_ << " frames to " << filename_);
+}
+
+void MetadataLog::map(size_t num_records)
+{
+	size_t old_size = HEADER_SIZE + capacity_ * sizeof(MetadataRecord);
+	size_t new_size = HEADER_SIZE + num_records * sizeof(MetadataRecord);
+	if (ftruncate(fd_, new_size))
+		throw std::runtime_error("failed to extend metadata log: " + std::string(strerror(errno)));
+
+	void *mapping = mapping_ ? mremap(mapping_, old_size, new_size, MREMAP_MAYMOVE)
+							 : mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+	if (mapping == MAP_FAILED)
+		throw std::runtime_error("failed to map metadata log: " + std::string(strerror(errno)));
+	mapping_ = static_cast<uint8_t *>(mapping);
+	capacity_ = num_records;
+}
+
+void MetadataLog::Append(unsigned int sequence, float framerate, libcamera::ControlList const &metadata)
+{
+	if (count_ == capacity_)
+		map(capacity_ * 2);
+
+	// The pages come zeroed from the file, so only fields that are present need writing.
+	MetadataRecord &r = reinterpret_cast<MetadataRecord *>(mapping_ + HEADER_SIZE)[count_++];
+	r.sequence = sequence;
+	r.framerate = framerate;
+
+	if (auto v = metadata.get(controls::SensorTimestamp))
+		r.sensor_timestamp = *v, r.valid |= MetadataRecord::SENSOR_TIMESTAMP;
+	if (auto v = metadata.get(controls::FrameDuration))
+		r.frame_duration = *v, r.valid |= MetadataRecord::FRAME_DURATION;
+	if (auto v = metadata.get(controls::ExposureTime))
+		r.exposure_time = *v, r.valid |= MetadataRecord::EXPOSURE_TIME;
+	if (auto v = metadata.get(controls::AnalogueGain))
+		r.analogue_gain = *v, r.valid |= MetadataRecord::ANALOGUE_GAIN;
+	if (auto v = metadata.get(controls::DigitalGain))
+		r.digital_gain = *v, r.valid |= MetadataRecord::DIGITAL_GAIN;
+	if (auto v = metadata.get(controls::ColourGains))
+	{
+		r.colour_gains[0] = (*v)[0];
+		r.colour_gains[1] = (*v)[1];
+		r.valid |= MetadataRecord::COLOUR_GAINS;
+	}
+	if (auto v = metadata.get(controls::Lux))
+		r.lux = *v, r.valid |= MetadataRecord::LUX;
+	if (auto v = metadata.get(controls::FocusFoM))
+		r.focus_fom = *v, r.valid |= MetadataRecord::FOCUS_FOM;
+}
+
+void MetadataLog::ExportTimecodes(std::string const &filename) const
+{
+	std::ofstream file(filename);
+	if (!file)
+		throw std::runtime_error("failed to open timecode file " + filename);
+
+	file << "# timecode format v2" << std::endl;
+	file << std::fixed << std::setprecision(3);
+	MetadataRecord const *records = reinterpret_cast<MetadataRecord const *>(mapping_ + HEADER_SIZE);
+	uint64_t first = 0;
+	for (size_t i = 0; i < count_; i++)
+	{
+		if (!(records[i].valid & MetadataRecord::SENSOR_TIMESTAMP))
+			continue;
+		if (!first)
+			first = records[i].sensor_timestamp;
+		file << (records[i].sensor_timestamp - first) / 1e6 << "\n";
+	}
+	LOG(2, "Wrote timecodes to " << filename);
+}
@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * metadata_log.hpp - memory mapped binary log of per-frame metadata.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <libcamera/controls.h>
+
+// One frame, in a fixed 64 byte little-endian layout so the file can be read without this code
+// (utils/timestamp.py knows it). Fields that the metadata didn't have are zero, and their bit in
+// valid is clear.
+struct MetadataRecord
+{
+	enum Field
+	{
+		SENSOR_TIMESTAMP = 1,
+		FRAME_DURATION = 2,
+		EXPOSURE_TIME = 4,
+		ANALOGUE_GAIN = 8,
+		DIGITAL_GAIN = 16,
+		COLOUR_GAINS = 32,
+		LUX = 64,
+		FOCUS_FOM = 128,
+	};
+
+	uint32_t sequence;
+	uint32_t valid;
+	uint64_t sensor_timestamp; // ns
+	int64_t frame_duration; // us
+	int32_t exposure_time; // us
+	float analogue_gain;
+	float digital_gain;
+	float colour_gains[2];
+	float lux;
+	int32_t focus_fom;
+	float framerate;
+	uint8_t reserved[8];
+};
+static_assert(sizeof(MetadataRecord) == 64, "MetadataRecord layout changed");
+
+class MetadataLog
+{
+public:
+	// The file starts with a 64 byte header: the magic "RPIMDLOG", then the version, record
+	// size and, once the log is closed, record count as uint32, uint32 and uint64.
+	static constexpr char MAGIC[8] = { 'R', 'P', 'I', 'M', 'D', 'L', 'O', 'G' };
+	static constexpr uint32_t VERSION = 1;
+	static constexpr size_t HEADER_SIZE = 64;
+
+	// An empty filename makes an anonymous log that disappears when closed.
+	MetadataLog(std::string const &filename);
+	~MetadataLog();
+
+	// Copy what we want from one frame's metadata straight into the next record of the mapping.
+	// Only ever call this from one thread at a time.
+	void Append(unsigned int sequence, float framerate, libcamera::ControlList const &metadata);
+
+	// Write the sensor timestamps in the "timecode format v2" text that mkvmerge and
+	// utils/timestamp.py read: milliseconds since the first frame, one frame per line.
+	void ExportTimecodes(std::string const &filename) const;
+
+private:
+	void map(size_t num_records);
+
+	std::string filename_;
+	int fd_;
+	uint8_t *mapping_;
+	size_t capacity_;
+	size_t count_;
+};
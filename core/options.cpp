@@ -12,6 +12,7 @@
 #include <linux/v4l2-controls.h>
 #include <linux/videodev2.h>
 #include <map>
+#include <sstream>
 #include <string>
 #include <sys/ioctl.h>
 
@@ -21,6 +22,10 @@
 
 #include "core/version.hpp"
 #include "core/options.hpp"
+#include "core/perf_counters.hpp"
+#include "core/tracing.hpp"
+
+#include "preview/preview.hpp"
 
 namespace fs = std::filesystem;
 
@@ -84,6 +89,13 @@ Options::Options()
 			"Set the output image width (0 = use default value)")
 		("height", value<unsigned int>(&height)->default_value(0),
 			"Set the output image height (0 = use default value)")
+		("lores-width", value<unsigned int>(&lores_width)->default_value(0),
+			"Set the width of the low resolution stream (0 = size it to the display)")
+		("lores-height", value<unsigned int>(&lores_height)->default_value(0),
+			"Set the height of the low resolution stream (0 = size it to the display)")
+		("lores-preview", value<bool>(&lores_preview)->default_value(false)->implicit_value(true),
+			"Add a low resolution stream for the preview, so that the main stream can be any size without "
+			"changing the cost of displaying it")
 		("shutter", value<std::string>(&shutter_)->default_value("0"),
 			"Set a fixed shutter speed. If no units are provided default to us")
 		("analoggain", value<float>(&gain)->default_value(0),
@@ -115,6 +127,9 @@ Options::Options()
 		("tuning-file", value<std::string>(&tuning_file)->default_value("-"),
 			"Name of camera tuning file to use, omit this option for libcamera default behaviour")
 		("buffer-count", value<unsigned int>(&buffer_count)->default_value(0), "Number of in-flight requests (and buffers) configured for video, raw, and still.")
+		("buffer-pool", value<std::string>(&buffer_pool)->default_value(""),
+			"Make the main stream's buffers big enough for WIDTHxHEIGHT YUV420 frames, so that reconfiguring to "
+			"any size up to that reuses them instead of allocating more")
 		("autofocus-mode", value<std::string>(&afMode)->default_value("default"),
 			"Control to set the mode of the AF (autofocus) algorithm.(manual, auto, continuous)")
 		("autofocus-range", value<std::string>(&afRange)->default_value("normal"),
@@ -129,6 +144,77 @@ Options::Options()
 			"Manual flicker correction period"
 			"\nSet to 10000us to cancel 50Hz flicker."
 			"\nSet to 8333us to cancel 60Hz flicker.\n")
+		("info-text", value<std::string>(&info_text)->default_value(""),
+			"Sets the information string shown on top of the preview, empty for none. Use these values:"
+			"\n\t%frame (the sequence number of the frame)"
+			"\n\t%fps (the instantaneous frame rate)"
+			"\n\t%exp (the shutter speed used to capture the image, in microseconds)"
+			"\n\t%ag (the analogue gain applied to the image)"
+			"\n\t%dg (the digital gain applied to the image)"
+			"\n\t%rg (the red colour gain)"
+			"\n\t%bg (the blue colour gain)"
+			"\n\t%lux (the estimated scene illuminance)")
+		("analysis-overlay", value<std::string>(&analysis_overlay)->default_value("none"),
+			"Sets the analysis aid drawn over the EGL preview (none, peaking, zebra, falsecolour). "
+			"Send SIGUSR1 to cycle through them while running")
+		("preview-backend", value<std::string>(&preview_backend)->default_value("egl"),
+			"Sets how the preview is drawn: egl (with the GPU) or drm (directly on display planes). rpicam-vid "
+			"switches between them while running on SIGUSR2 or the 'p' key")
+		("egl-offscreen", value<std::string>(&egl_offscreen)->default_value("")->implicit_value("1920x1080@60"),
+			"Draw the EGL preview into offscreen buffers instead of a display, given as WIDTHxHEIGHT@REFRESH. "
+			"A refresh of 0 means draw as fast as possible. Draw and swap costs are reported when it finishes")
+		("egl-import", value<std::string>(&egl_import)->default_value("auto"),
+			"Sets how the EGL preview gets camera frames to the GPU: dmabuf (zero-copy import), planes (zero-copy "
+			"import of each plane, converted to RGB by our own shader), upload (copy into textures) or auto "
+			"(import, falling back to upload where that fails)")
+		("async-flip", value<bool>(&async_flip)->default_value(false)->implicit_value(true),
+			"Show preview frames without waiting for vblank where the display driver allows it, trading "
+			"tearing for up to a frame less latency")
+		("direct-preview", value<bool>(&direct_preview)->default_value(false)->implicit_value(true),
+			"Hand completed frames straight to the preview thread from the camera's completion callback, rather "
+			"than via the application's event loop, saving a thread handoff per frame")
+		("daemon", value<std::string>(&daemon)->default_value(""),
+			"Keep the camera configured and the display set up, but only run the preview between \"start\" and "
+			"\"stop\" commands sent to this Unix domain socket (see utils/rpicam_ctl.py)")
+		("share-socket", value<std::string>(&share_socket)->default_value(""),
+			"Share the main stream's frames, without copying, with other processes that connect to this Unix "
+			"domain socket (see rpicam-frame-client)")
+		("share-frames", value<unsigned int>(&share_frames)->default_value(1),
+			"Most frames to keep for --share-socket clients. Clients slower than this lose frames rather than "
+			"hold up the camera, and more may need a larger --buffer-count")
+		("subscribe", value<std::string>(&subscribe)->default_value(""),
+			"Attach test consumers to the video stream, to exercise frame subscriptions: a comma separated list "
+			"of latest, fifo:DEPTH or every:N[:DEPTH], each optionally followed by @MS to spend that long on "
+			"every frame (rpicam-vid only)")
+		("trace", value<std::string>(&trace)->default_value("")->implicit_value("rpicam-trace.json"),
+			"Trace frame events to the kernel's trace_marker, or to this Chrome/Perfetto JSON file if tracefs "
+			"isn't writable")
+		("perf-counters", value<bool>(&perf_counters)->default_value(false)->implicit_value(true),
+			"Count CPU cycles, instructions, cache misses and context switches for each stage of the frame path, "
+			"reported every second")
+		("metadata-log", value<std::string>(&metadata_log)->default_value(""),
+			"Append each frame's metadata to this file as fixed size binary records, for analysing long runs")
+		("save-pts", value<std::string>(&save_pts)->default_value(""),
+			"Save the frames' sensor timestamps to this file, in timecode format v2, when the camera closes")
+		("ae-seed", value<std::string>(&ae_seed)->default_value(""),
+			"File in which to remember each camera's converged exposure and colour gains, so that the next "
+			"run can start from them instead of from scratch")
+		("mode", value<std::string>(&mode)->default_value(""),
+			"Sets the sensor mode: \"fast\" for the lowest latency mode that meets --mode-min and --mode-fov, "
+			"or W:H[:bit-depth] to pick one. Empty leaves the choice to libcamera")
+		("mode-min", value<std::string>(&mode_min)->default_value(""),
+			"Smallest sensor mode output, as WxH, that --mode fast may choose. Empty uses the stream size")
+		("mode-fov", value<float>(&mode_fov)->default_value(1.0),
+			"Fraction of the sensor's full field of view, in each direction, that --mode fast must keep")
+		("match-display", value<bool>(&match_display)->default_value(false)->implicit_value(true),
+			"Size the camera stream to the preview display, rather than scaling a larger image down to it")
+		("fill-display", value<bool>(&fill_display)->default_value(false)->implicit_value(true),
+			"Crop the camera image to the display's aspect ratio so that it fills the screen without letterboxing")
+		("drm-device", value<std::string>(&drm_device)->default_value(""),
+			"Sets the DRM device for the preview: a device node (e.g. /dev/dri/card1), a driver name (e.g. vc4, vkms), "
+			"or \"render\" for the first one that can also render. Empty picks the first one with a display connected")
+		("drm-connector", value<std::string>(&drm_connector)->default_value(""),
+			"Sets the connector to show the preview on, e.g. HDMI-A-2. Empty picks the first connected one")
 		;
 	// clang-format on
 
@@ -209,6 +295,10 @@ bool Options::Parse(int argc, char *argv[])
 	// Set the verbosity
 	RPiCamApp::verbosity = verbose;
 
+	if (!trace.empty())
+		rpicam_trace::Open(trace);
+	rpicam_perf::enabled = perf_counters;
+
 	if (sscanf(afWindow.c_str(), "%f,%f,%f,%f", &afWindow_x, &afWindow_y, &afWindow_width, &afWindow_height) != 4)
 		afWindow_x = afWindow_y = afWindow_width = afWindow_height = 0; // don't set auto focus windows
 
@@ -271,6 +361,69 @@ bool Options::Parse(int argc, char *argv[])
 		throw std::runtime_error("Invalid AWB mode: " + awb);
 	awb_index = awb_table[awb];
 
+	std::map<std::string, Preview::AnalysisOverlay> analysis_overlay_table =
+		{ { "none", Preview::AnalysisOverlay::None },
+			{ "peaking", Preview::AnalysisOverlay::FocusPeaking },
+			{ "zebra", Preview::AnalysisOverlay::Zebra },
+			{ "falsecolour", Preview::AnalysisOverlay::FalseColour },
+			{ "falsecolor", Preview::AnalysisOverlay::FalseColour } };
+	if (analysis_overlay_table.count(analysis_overlay) == 0)
+		throw std::runtime_error("Invalid analysis overlay: " + analysis_overlay);
+	analysis_overlay_index = static_cast<int>(analysis_overlay_table[analysis_overlay]);
+
+	if (preview_backend != "egl" && preview_backend != "drm")
+		throw std::runtime_error("Invalid preview backend: " + preview_backend);
+	useGlesPreview = preview_backend == "egl";
+
+	if (egl_import != "auto" && egl_import != "dmabuf" && egl_import != "planes" && egl_import != "upload")
+		throw std::runtime_error("Invalid EGL import mode: " + egl_import);
+
+	offscreen_width = offscreen_height = offscreen_refresh = 0;
+	if (!egl_offscreen.empty())
+	{
+		if (sscanf(egl_offscreen.c_str(), "%ux%u@%u", &offscreen_width, &offscreen_height, &offscreen_refresh) != 3 ||
+			!offscreen_width || !offscreen_height)
+			throw std::runtime_error("Invalid offscreen mode: " + egl_offscreen);
+		if (!useGlesPreview)
+			throw std::runtime_error("Offscreen rendering needs the egl preview backend");
+	}
+
+	mode_width = mode_height = mode_depth = 0;
+	if (!mode.empty() && mode != "fast")
+	{
+		int n = sscanf(mode.c_str(), "%u:%u:%u", &mode_width, &mode_height, &mode_depth);
+		if (n < 2 || !mode_width || !mode_height)
+			throw std::runtime_error("Invalid sensor mode: " + mode);
+	}
+
+	buffer_pool_size = 0;
+	subscribers.clear();
+	std::stringstream subscribe_list(subscribe);
+	for (std::string item; std::getline(subscribe_list, item, ',');)
+	{
+		size_t at = item.find('@');
+		unsigned int work_ms = 0;
+		char end;
+		if (at != std::string::npos && sscanf(item.c_str() + at + 1, "%u%c", &work_ms, &end) != 1)
+			throw std::runtime_error("Invalid subscriber work time: " + item);
+		subscribers.push_back({ item, FramePolicy::FromString(item.substr(0, at)), work_ms });
+	}
+
+	if (!buffer_pool.empty())
+	{
+		unsigned int w, h;
+		if (sscanf(buffer_pool.c_str(), "%ux%u", &w, &h) != 2 || !w || !h)
+			throw std::runtime_error("Invalid buffer pool size: " + buffer_pool);
+		// Allow for the ISP rounding the stride and height up.
+		buffer_pool_size = ((w + 63) & ~63) * ((h + 15) & ~15) * 3 / 2;
+	}
+
+	mode_min_width = mode_min_height = 0;
+	if (!mode_min.empty() && sscanf(mode_min.c_str(), "%ux%u", &mode_min_width, &mode_min_height) != 2)
+		throw std::runtime_error("Invalid minimum sensor mode size: " + mode_min);
+	if (mode_fov <= 0 || mode_fov > 1)
+		throw std::runtime_error("Sensor mode field of view must be greater than 0 and at most 1");
+
 	if (sscanf(awbgains.c_str(), "%f,%f", &awb_gain_r, &awb_gain_b) != 2)
 		throw std::runtime_error("Invalid AWB gains");
 
@@ -303,6 +456,8 @@ void Options::Print() const
 
 	std::cerr << "    width: " << width << std::endl;
 	std::cerr << "    height: " << height << std::endl;
+	if (lores_preview)
+		std::cerr << "    lores: " << lores_width << "x" << lores_height << " (preview)" << std::endl;
 
 	std::cerr << "    roi: all" << std::endl;
 
@@ -345,4 +500,41 @@ void Options::Print() const
 
 	if (buffer_count > 0)
 		std::cerr << "    buffer-count: " << buffer_count << std::endl;
+	if (!buffer_pool.empty())
+		std::cerr << "    buffer-pool: " << buffer_pool << std::endl;
+	if (!info_text.empty())
+		std::cerr << "    info-text: " << info_text << std::endl;
+	std::cerr << "    analysis-overlay: " << analysis_overlay << std::endl;
+	std::cerr << "    preview-backend: " << preview_backend << std::endl;
+	if (!egl_offscreen.empty())
+		std::cerr << "    egl-offscreen: " << egl_offscreen << std::endl;
+	std::cerr << "    egl-import: " << egl_import << std::endl;
+	std::cerr << "    async-flip: " << async_flip << std::endl;
+	std::cerr << "    direct-preview: " << direct_preview << std::endl;
+	if (!daemon.empty())
+		std::cerr << "    daemon: " << daemon << std::endl;
+	if (!share_socket.empty())
+		std::cerr << "    share-socket: " << share_socket << ", share-frames: " << share_frames << std::endl;
+	if (!subscribe.empty())
+		std::cerr << "    subscribe: " << subscribe << std::endl;
+	if (!trace.empty())
+		std::cerr << "    trace: " << trace << std::endl;
+	std::cerr << "    perf-counters: " << perf_counters << std::endl;
+	if (!metadata_log.empty())
+		std::cerr << "    metadata-log: " << metadata_log << std::endl;
+	if (!save_pts.empty())
+		std::cerr << "    save-pts: " << save_pts << std::endl;
+	if (!ae_seed.empty())
+		std::cerr << "    ae-seed: " << ae_seed << std::endl;
+	if (!mode.empty())
+		std::cerr << "    mode: " << mode << std::endl;
+	if (mode == "fast")
+		std::cerr << "    mode-min: " << (mode_min.empty() ? "(stream size)" : mode_min) << " mode-fov: " << mode_fov
+				  << std::endl;
+	std::cerr << "    match-display: " << match_display << std::endl;
+	std::cerr << "    fill-display: " << fill_display << std::endl;
+	if (!drm_device.empty())
+		std::cerr << "    drm-device: " << drm_device << std::endl;
+	if (!drm_connector.empty())
+		std::cerr << "    drm-connector: " << drm_connector << std::endl;
 }
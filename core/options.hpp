@@ -10,6 +10,7 @@
 #include <chrono>
 #include <fstream>
 #include <optional>
+#include <vector>
 
 #include <boost/program_options.hpp>
 
@@ -18,6 +19,7 @@
 #include <libcamera/control_ids.h>
 #include <libcamera/transform.h>
 
+#include "core/frame_fanout.hpp"
 #include "core/logging.hpp"
 
 static constexpr double DEFAULT_FRAMERATE = 30.0;
@@ -93,6 +95,9 @@ struct Options
 	std::string config_file;
 	unsigned int width;
 	unsigned int height;
+	unsigned int lores_width;
+	unsigned int lores_height;
+	bool lores_preview;
 	TimeVal<std::chrono::microseconds> shutter;
 	float gain;
 	std::string metering;
@@ -114,6 +119,8 @@ struct Options
 	std::string tuning_file;
 	unsigned int camera;
 	unsigned int buffer_count;
+	std::string buffer_pool;
+	size_t buffer_pool_size;
 	std::string afMode;
 	int afMode_index;
 	std::string afRange;
@@ -127,6 +134,46 @@ struct Options
 	bool af_on_capture;
 	TimeVal<std::chrono::microseconds> flicker_period;
 	bool useGlesPreview;
+	std::string preview_backend;
+	std::string egl_offscreen;
+	std::string egl_import;
+	bool async_flip;
+	bool direct_preview;
+	std::string share_socket;
+	std::string daemon;
+	unsigned int share_frames;
+	std::string subscribe;
+	// Parsed from --subscribe.
+	struct Subscriber
+	{
+		std::string name;
+		FramePolicy policy;
+		unsigned int work_ms;
+	};
+	std::vector<Subscriber> subscribers;
+	std::string ae_seed;
+	std::string trace;
+	bool perf_counters;
+	std::string metadata_log;
+	std::string save_pts;
+	std::string mode;
+	std::string mode_min;
+	float mode_fov;
+	unsigned int mode_width;
+	unsigned int mode_height;
+	unsigned int mode_depth;
+	unsigned int mode_min_width;
+	unsigned int mode_min_height;
+	bool match_display;
+	bool fill_display;
+	unsigned int offscreen_width;
+	unsigned int offscreen_height;
+	unsigned int offscreen_refresh;
+	std::string drm_device;
+	std::string drm_connector;
+	std::string info_text;
+	std::string analysis_overlay;
+	int analysis_overlay_index;
 
 	virtual bool Parse(int argc, char *argv[]);
 	virtual void Print() const;
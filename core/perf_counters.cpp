@@ -0,0 +1,232 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * perf_counters.cpp - per pipeline stage CPU performance counters.
+ */
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "core/logging.hpp"
+#include "core/perf_counters.hpp"
+
+using namespace rpicam_perf;
+
+namespace
+{
+
+struct CounterInfo
+{
+	char const *name;
+	uint32_t type;
+	uint64_t config;
+};
+
+const CounterInfo counter_info[NUM_COUNTERS] = {
+	{ "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+std::mutex stages_mutex;
+std::vector<Stage *> stages;
+std::atomic<int64_t> last_report_ns = 0;
+std::once_flag warn_once;
+
+int64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+// One group of counters per thread, read with a single system call. The task clock, a software
+// event that's nearly always allowed, leads the group so that missing hardware counters (in a VM,
+// or without a PMU driver) only lose those counters.
+class ThreadCounters
+{
+public:
+	ThreadCounters() : leader_(-1), num_open_(0)
+	{
+		for (unsigned int i = 0; i < NUM_COUNTERS; i++)
+			index_[i] = -1, fds_[i] = -1;
+
+		// Counting the kernel's work (DMA syncs, ioctls) needs perf_event_paranoid <= 1, so try that first.
+		for (bool exclude_kernel : { false, true })
+		{
+			open(exclude_kernel);
+			if (leader_ >= 0)
+				break;
+		}
+		int error = errno;
+
+		std::call_once(warn_once, [this, error]() {
+			if (leader_ < 0)
+				LOG(1, "WARNING: perf counters unavailable (" << strerror(error)
+															  << "), check /proc/sys/kernel/perf_event_paranoid");
+			else
+			{
+				std::stringstream s;
+				for (unsigned int i = 0; i < NUM_COUNTERS; i++)
+					s << " " << counter_info[i].name << (index_[i] < 0 ? " (unavailable)" : "");
+				LOG(1, "Perf counters:" << s.str() << (kernel_ ? "" : ", user space only"));
+			}
+		});
+	}
+	~ThreadCounters()
+	{
+		for (int fd : fds_)
+			if (fd >= 0)
+				close(fd);
+	}
+
+	bool Read(uint64_t *values)
+	{
+		if (leader_ < 0)
+			return false;
+		struct
+		{
+			uint64_t nr;
+			uint64_t values[NUM_COUNTERS];
+		} data;
+		if (read(leader_, &data, sizeof(data)) < (ssize_t)sizeof(uint64_t))
+			return false;
+		for (unsigned int i = 0; i < NUM_COUNTERS; i++)
+			values[i] = index_[i] >= 0 ? data.values[index_[i]] : 0;
+		return true;
+	}
+
+	bool Valid(unsigned int counter) const { return index_[counter] >= 0; }
+
+private:
+	void open(bool exclude_kernel)
+	{
+		for (unsigned int i = 0; i < NUM_COUNTERS; i++)
+		{
+			perf_event_attr attr = {};
+			attr.size = sizeof(attr);
+			attr.type = counter_info[i].type;
+			attr.config = counter_info[i].config;
+			attr.read_format = PERF_FORMAT_GROUP;
+			attr.exclude_kernel = exclude_kernel;
+			attr.exclude_hv = 1;
+			attr.disabled = leader_ < 0;
+			int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader_, PERF_FLAG_FD_CLOEXEC);
+			if (fd < 0)
+			{
+				if (leader_ < 0)
+					return;
+				continue;
+			}
+			if (leader_ < 0)
+				leader_ = fd;
+			fds_[i] = fd;
+			index_[i] = num_open_++;
+		}
+		kernel_ = !exclude_kernel;
+		ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+
+	int leader_;
+	int fds_[NUM_COUNTERS];
+	int index_[NUM_COUNTERS];
+	unsigned int num_open_;
+	bool kernel_ = false;
+};
+
+ThreadCounters &thread_counters()
+{
+	thread_local ThreadCounters counters;
+	return counters;
+}
+
+} // namespace
+
+Stage::Stage(char const *name) : name_(name), calls_(0)
+{
+	for (unsigned int i = 0; i < NUM_COUNTERS; i++)
+		totals_[i] = 0, valid_[i] = false;
+	std::lock_guard<std::mutex> lock(stages_mutex);
+	stages.push_back(this);
+}
+
+void Stage::Add(uint64_t const *deltas, bool const *valid)
+{
+	calls_.fetch_add(1, std::memory_order_relaxed);
+	for (unsigned int i = 0; i < NUM_COUNTERS; i++)
+	{
+		totals_[i].fetch_add(deltas[i], std::memory_order_relaxed);
+		if (valid[i])
+			valid_[i].store(true, std::memory_order_relaxed);
+	}
+}
+
+void Stage::Report(double seconds)
+{
+	uint64_t calls = calls_.exchange(0, std::memory_order_relaxed);
+	uint64_t totals[NUM_COUNTERS];
+	for (unsigned int i = 0; i < NUM_COUNTERS; i++)
+		totals[i] = totals_[i].exchange(0, std::memory_order_relaxed);
+	if (!calls)
+		return;
+
+	std::stringstream s;
+	s << std::fixed << std::setprecision(1);
+	s << "perf " << name_ << ": " << calls / seconds << "/s, per call";
+	if (valid_[TASK_CLOCK])
+		s << " " << totals[TASK_CLOCK] / 1000.0 / calls << "us cpu";
+	if (valid_[CYCLES])
+		s << " " << totals[CYCLES] / calls << " cycles";
+	if (valid_[INSTRUCTIONS])
+		s << " " << totals[INSTRUCTIONS] / calls << " instructions";
+	if (valid_[CYCLES] && valid_[INSTRUCTIONS] && totals[CYCLES])
+		s << " (IPC " << (double)totals[INSTRUCTIONS] / totals[CYCLES] << ")";
+	if (valid_[CACHE_MISSES])
+		s << " " << (double)totals[CACHE_MISSES] / calls << " cache misses";
+	if (valid_[CONTEXT_SWITCHES])
+		s << " " << (double)totals[CONTEXT_SWITCHES] / calls << " context switches";
+	LOG(1, s.str());
+}
+
+void Scope::begin(Stage &stage)
+{
+	if (thread_counters().Read(start_))
+		stage_ = &stage;
+}
+
+void Scope::end()
+{
+	ThreadCounters &counters = thread_counters();
+	uint64_t end[NUM_COUNTERS], deltas[NUM_COUNTERS];
+	bool valid[NUM_COUNTERS];
+	if (!counters.Read(end))
+		return;
+	for (unsigned int i = 0; i < NUM_COUNTERS; i++)
+	{
+		deltas[i] = end[i] - start_[i];
+		valid[i] = counters.Valid(i);
+	}
+	stage_->Add(deltas, valid);
+
+	// Whichever thread notices that a second has gone by reports for everyone.
+	int64_t now = now_ns(), last = last_report_ns.load(std::memory_order_relaxed);
+	if (!last)
+		last_report_ns.compare_exchange_strong(last, now);
+	else if (now - last >= 1000000000 && last_report_ns.compare_exchange_strong(last, now))
+	{
+		std::lock_guard<std::mutex> lock(stages_mutex);
+		for (Stage *stage : stages)
+			stage->Report((now - last) / 1e9);
+	}
+}
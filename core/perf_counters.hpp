@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * perf_counters.hpp - per pipeline stage CPU performance counters.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace rpicam_perf
+{
+enum Counter
+{
+	TASK_CLOCK,
+	CYCLES,
+	INSTRUCTIONS,
+	CACHE_MISSES,
+	CONTEXT_SWITCHES,
+	NUM_COUNTERS
+};
+
+// Set before any threads start; everything checks this first so the counters cost one
+// predictable branch when they're off.
+inline bool enabled = false;
+
+// Totals for one stage, reported and reset once a second.
+class Stage
+{
+public:
+	Stage(char const *name);
+
+	void Add(uint64_t const *deltas, bool const *valid);
+	void Report(double seconds);
+
+private:
+	char const *name_;
+	std::atomic<uint64_t> calls_;
+	std::atomic<uint64_t> totals_[NUM_COUNTERS];
+	std::atomic<bool> valid_[NUM_COUNTERS];
+};
+
+// Counts what the calling thread does between construction and destruction. The counters
+// are the thread's own, so anything else running on the CPU isn't included.
+class Scope
+{
+public:
+	Scope(Stage &stage) : stage_(nullptr)
+	{
+		if (enabled)
+			begin(stage);
+	}
+	~Scope()
+	{
+		if (stage_)
+			end();
+	}
+
+private:
+	void begin(Stage &stage);
+	void end();
+
+	Stage *stage_;
+	uint64_t start_[NUM_COUNTERS];
+};
+} // namespace rpicam_perf
+
+#define PERF_CONCAT_(a, b) a##b
+#define PERF_CONCAT(a, b) PERF_CONCAT_(a, b)
+#define PERF_SCOPE(name)                                                                                               \
+	static rpicam_perf::Stage PERF_CONCAT(perf_stage_, __LINE__)(name);                                               \
+	rpicam_perf::Scope PERF_CONCAT(perf_scope_, __LINE__)(PERF_CONCAT(perf_stage_, __LINE__))
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * reactor.cpp - single threaded epoll event loop.
+ */
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "core/reactor.hpp"
+
+Reactor::Reactor() : stop_(false)
+{
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0)
+		throw std::runtime_error("epoll_create1 failed: " + std::string(strerror(errno)));
+}
+
+Reactor::~Reactor()
+{
+	close(epoll_fd_);
+}
+
+void Reactor::Add(int fd, Handler handler, uint32_t events, bool oneshot)
+{
+	epoll_event ev = {};
+	ev.events = (events ? events : EPOLLIN) | (oneshot ? (uint32_t)EPOLLONESHOT : 0);
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev))
+		throw std::runtime_error("failed to watch fd " + std::to_string(fd) + ": " + strerror(errno));
+	watches_[fd] = { std::move(handler), oneshot };
+}
+
+void Reactor::Remove(int fd)
+{
+	if (watches_.erase(fd))
+		epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void Reactor::Run()
+{
+	stop_ = false;
+	while (!stop_)
+		RunOnce(-1);
+}
+
+unsigned int Reactor::RunOnce(int timeout_ms)
+{
+	epoll_event events[16];
+	int n = epoll_wait(epoll_fd_, events, 16, timeout_ms);
+	if (n < 0)
+	{
+		if (errno == EINTR)
+			return 0;
+		throw std::runtime_error("epoll_wait failed: " + std::string(strerror(errno)));
+	}
+
+	unsigned int handled = 0;
+	for (int i = 0; i < n && !stop_; i++)
+	{
+		// An earlier handler may have removed this one.
+		auto it = watches_.find(events[i].data.fd);
+		if (it == watches_.end())
+			continue;
+		// Copy it, as the handler is allowed to remove itself.
+		Handler handler = it->second.handler;
+		if (it->second.oneshot)
+			Remove(events[i].data.fd);
+		handler(events[i].events);
+		handled++;
+	}
+	return handled;
+}
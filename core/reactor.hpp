@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * reactor.hpp - single threaded epoll event loop.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+
+// Runs handlers, on the thread that calls Run(), as the file descriptors they watch become
+// ready. Handlers may add and remove descriptors, including their own, and may call Stop().
+class Reactor
+{
+public:
+	using Handler = std::function<void(uint32_t events)>;
+
+	Reactor();
+	~Reactor();
+
+	// Watch fd for the given epoll events (EPOLLIN by default). A oneshot watch removes itself
+	// after it first fires, which suits things like fence fds that only ever signal once.
+	void Add(int fd, Handler handler, uint32_t events = 0, bool oneshot = false);
+	void Remove(int fd);
+
+	// Dispatch events until Stop() is called.
+	void Run();
+	// Dispatch whatever is ready within timeout_ms (-1 waits forever). Returns the number of
+	// handlers run.
+	unsigned int RunOnce(int timeout_ms);
+	void Stop() { stop_ = true; }
+
+private:
+	struct Watch
+	{
+		Handler handler;
+		bool oneshot;
+	};
+
+	int epoll_fd_;
+	std::map<int, Watch> watches_;
+	bool stop_;
+};
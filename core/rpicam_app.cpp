@@ -7,10 +7,16 @@
 
 #include "preview/preview.hpp"
 
+#include "core/frame_info.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/options.hpp"
+#include "core/perf_counters.hpp"
+#include "core/reactor.hpp"
+#include "core/tracing.hpp"
 
+#include <algorithm>
 #include <cmath>
+#include <exception>
 #include <fcntl.h>
 #include <stdlib.h>
 
@@ -78,6 +84,13 @@ RPiCamApp::~RPiCamApp()
 		LOG(2, "Closing RPiCam application"
 				   << "(frames displayed " << preview_frames_displayed_ << ", dropped " << preview_frames_dropped_
 				   << ")");
+	if (!options_->help && preview_)
+	{
+		LOG(1, "Frames dropped: " << GetFrameDrops().ToString());
+		LOG(1, preview_dispatch_stats_.ToString() << (options_->direct_preview ? " (direct)" : " (via event loop)"));
+		if (reconfigure_gap_stats_.Count())
+			LOG(1, reconfigure_gap_stats_.ToString());
+	}
 	StopCamera();
 	Teardown();
 	CloseCamera();
@@ -107,6 +120,7 @@ void RPiCamApp::OpenCamera()
 {
 	// Make a preview window.
 	preview_ = std::unique_ptr<Preview>(make_preview(options_.get()));
+	analysis_overlay_ = static_cast<Preview::AnalysisOverlay>(options_->analysis_overlay_index);
 	preview_->SetDoneCallback(std::bind(&RPiCamApp::previewDoneCallback, this, std::placeholders::_1));
 
 	LOG(2, "Opening camera...");
@@ -132,9 +146,14 @@ void RPiCamApp::OpenCamera()
 
 	LOG(2, "Acquired camera " << cam_id);
 
+	// The log covers the whole time the camera is open, across any restarts.
+	if (!options_->metadata_log.empty() || !options_->save_pts.empty())
+		metadata_log_ = std::make_unique<MetadataLog>(options_->metadata_log);
+
 	// We're going to make a list of all the available sensor modes, but we only populate
-	// the framerate field if the user has requested a framerate (as this requires us actually
-	// to configure the sensor, which is otherwise best avoided).
+	// the framerate and crop fields if the user has requested a framerate or wants us to
+	// choose the mode (as this requires us actually to configure the sensor, which is
+	// otherwise best avoided).
 
 	std::unique_ptr<CameraConfiguration> config = camera_->generateConfiguration({ libcamera::StreamRole::Raw });
 	const libcamera::StreamFormats &formats = config->at(0).formats();
@@ -152,7 +171,8 @@ void RPiCamApp::OpenCamera()
 		for (const auto &size : formats.sizes(pix))
 		{
 			double framerate = 0;
-			if (options_->framerate)
+			Rectangle crop;
+			if (options_->framerate || options_->mode == "fast")
 			{
 				SensorMode sensorMode(size, pix, 0);
 				config->at(0).size = size;
@@ -164,8 +184,9 @@ void RPiCamApp::OpenCamera()
 				camera_->configure(config.get());
 				auto fd_ctrl = camera_->controls().find(&controls::FrameDurationLimits);
 				framerate = 1.0e6 / fd_ctrl->second.min().get<int64_t>();
+				crop = camera_->controls().at(&controls::ScalerCrop).max().get<Rectangle>();
 			}
-			sensor_modes_.emplace_back(size, pix, framerate);
+			sensor_modes_.emplace_back(size, pix, framerate, crop);
 		}
 	}
 
@@ -180,6 +201,10 @@ void RPiCamApp::CloseCamera()
 {
 	preview_.reset();
 
+	if (metadata_log_ && !options_->save_pts.empty())
+		metadata_log_->ExportTimecodes(options_->save_pts);
+	metadata_log_.reset();
+
 	if (camera_acquired_)
 		camera_->release();
 	camera_acquired_ = false;
@@ -196,7 +221,20 @@ void RPiCamApp::ConfigureVideo(libcamera::ColorSpace colorSpace)
 {
 	LOG(2, "Configuring video...");
 
+	configureVideoStreams(colorSpace);
+	startPreview();
+	if (!options_->share_socket.empty())
+		startFrameShare();
+
+	// The requests will be made when StartCamera() is called.
+	LOG(2, "Video setup complete");
+}
+
+void RPiCamApp::configureVideoStreams(std::optional<libcamera::ColorSpace> const &colorSpace)
+{
 	StreamRoles stream_roles = { StreamRole::VideoRecording };
+	if (options_->lores_preview)
+		stream_roles.push_back(StreamRole::Viewfinder);
 
 	configuration_ = camera_->generateConfiguration(stream_roles);
 	if (!configuration_)
@@ -213,57 +251,243 @@ void RPiCamApp::ConfigureVideo(libcamera::ColorSpace colorSpace)
 	if (options_->height)
 		cfg.size.height = options_->height;
 
+	// With a lores stream it's that one, not the main stream, that gets sized to the display.
+	Size display_size = displayMatchedSize();
+	if (options_->match_display && !options_->lores_preview && !display_size.isNull())
+		cfg.size = display_size;
+
 	cfg.colorSpace = colorSpace;
 
+	std::optional<SensorMode> sensor_mode = chooseSensorMode(cfg.size);
+	if (sensor_mode)
+	{
+		configuration_->sensorConfig = libcamera::SensorConfiguration();
+		configuration_->sensorConfig->outputSize = sensor_mode->size;
+		configuration_->sensorConfig->bitDepth = sensor_mode->depth();
+	}
+
+	if (options_->lores_preview)
+	{
+		// The ISP scales the lores output down from the same crop as the main one, and
+		// can't make it any larger.
+		StreamConfiguration &lores_cfg = configuration_->at(1);
+		if (options_->lores_width && options_->lores_height)
+			lores_cfg.size = Size(options_->lores_width, options_->lores_height);
+		else if (!display_size.isNull())
+			lores_cfg.size = display_size;
+		else
+			lores_cfg.size = Size(640, 480);
+		lores_cfg.size = lores_cfg.size.boundedTo(cfg.size).alignedDownTo(2, 2);
+		lores_cfg.pixelFormat = lores_format_;
+		lores_cfg.bufferCount = cfg.bufferCount;
+		lores_cfg.colorSpace = colorSpace;
+	}
+
 	configuration_->orientation = libcamera::Orientation::Rotate0;
 
 	configureDenoise(options_->denoise == "auto" ? "cdn_fast" : options_->denoise);
 	setupCapture();
 
 	stream_ = configuration_->at(0).stream();
+	if (options_->lores_preview)
+		lores_stream_ = configuration_->at(1).stream();
+
+	Size preview_size = GetPreviewStream()->configuration().size;
+	double fps = options_->framerate.value_or(DEFAULT_FRAMERATE);
+	double mbps = preview_size.width * preview_size.height * 1.5 * fps / 1e6;
+	LOG(1, "Previewing " << (lores_stream_ ? "lores" : "main") << " stream " << preview_size.toString() << ", "
+						 << mbps << "MB/s written by the ISP and read for display");
+}
 
-	LOG(2, "Video setup complete");
+bool RPiCamApp::Reconfigure(unsigned int width, unsigned int height, float framerate)
+{
+	if (!configuration_)
+		throw std::runtime_error("can only reconfigure a configured camera");
+
+	// A size left out stays as it is. Compare with the stream itself, as --match-display may have
+	// sized it and left the options at zero.
+	Size current = stream_->configuration().size;
+	width = width ? width : current.width;
+	height = height ? height : current.height;
+
+	// Within the sensor mode's limits the frame rate is only a control. The mode was chosen for
+	// the size, so a frame rate it can't reach would need a different mode that restarting with
+	// the same size wouldn't pick either.
+	if (width == current.width && height == current.height)
+	{
+		if (framerate > 0)
+		{
+			options_->framerate = framerate;
+			int64_t frame_time = 1000000 / framerate; // in us
+			libcamera::ControlInfo const &limits = camera_->controls().at(&controls::FrameDurationLimits);
+			if (frame_time < limits.min().get<int64_t>() || frame_time > limits.max().get<int64_t>())
+				LOG(1, "WARNING: the sensor mode can only run at " << 1e6 / limits.max().get<int64_t>() << " to "
+																 << 1e6 / limits.min().get<int64_t>() << "fps");
+			ControlList controls;
+			controls.set(controls::FrameDurationLimits, libcamera::Span<const int64_t, 2>({ frame_time, frame_time }));
+			SetControls(controls);
+			LOG(1, "Frame rate set to " << framerate << "fps without stopping the camera");
+		}
+		return false;
+	}
+
+	auto start = DurationStats::Clock::now();
+	bool was_running = camera_started_;
+	StopCamera();
+	PreviewItem discarded;
+	std::exception_ptr failure;
+	{
+		// The preview thread may still be showing a frame it took before the camera stopped, so
+		// wait for it to finish before that frame's buffer goes.
+		std::lock_guard<std::mutex> show_lock(preview_show_mutex_);
+		// Anything waiting for the preview is from the old configuration. Whatever is on the
+		// screen stays there, and its buffer won't be handed to the new configuration.
+		{
+			std::lock_guard<std::mutex> lock(preview_item_mutex_);
+			discarded = std::move(preview_item_);
+			preview_item_ = PreviewItem();
+		}
+		// Sharing clients were given the old buffers, so have to connect again.
+		frame_share_.reset();
+
+		std::optional<libcamera::ColorSpace> colour_space = configuration_->at(0).colorSpace;
+		auto release = [this]() {
+			mapped_buffers_.clear();
+			frame_buffers_.clear();
+			configuration_.reset();
+			stream_ = nullptr;
+			lores_stream_ = nullptr;
+		};
+		release();
+
+		unsigned int old_width = options_->width, old_height = options_->height;
+		std::optional<float> old_framerate = options_->framerate;
+		bool old_match_display = options_->match_display;
+		options_->width = width;
+		options_->height = height;
+		// An explicit size takes over from sizing the main stream to the display.
+		if (options_->match_display && !options_->lores_preview)
+		{
+			LOG(1, "Reconfigure size " << width << "x" << height << " replaces --match-display");
+			options_->match_display = false;
+		}
+		if (framerate > 0)
+			options_->framerate = framerate;
+		try
+		{
+			configureVideoStreams(colour_space);
+		}
+		catch (std::exception const &e)
+		{
+			// Go back to the configuration we had, so that the camera can carry on as it was.
+			LOG(1, "Reconfigure failed (" << e.what() << "), restoring " << current.toString());
+			release();
+			options_->width = old_width;
+			options_->height = old_height;
+			options_->framerate = old_framerate;
+			options_->match_display = old_match_display;
+			configureVideoStreams(colour_space);
+			failure = std::current_exception();
+		}
+	}
+	if (!options_->share_socket.empty())
+		startFrameShare();
+
+	if (was_running)
+	{
+		preview_reconfigured_ = !failure;
+		StartCamera();
+	}
+	if (failure)
+		std::rethrow_exception(failure);
+	std::chrono::duration<double, std::milli> ms = DurationStats::Clock::now() - start;
+	LOG(1, "Reconfigured to " << stream_->configuration().size.toString() << " in " << ms.count() << "ms");
+	return was_running;
 }
 
 void RPiCamApp::Teardown()
 {
 	stopPreview();
 
+	// Subscriptions are to streams that are about to go.
+	while (!subscriptions_.empty())
+		Unsubscribe(FrameSubscriptionPtr(subscriptions_.back()));
+	frame_share_.reset();
+
 	if (!options_->help)
 		LOG(2, "Tearing down requests, buffers and configuration");
 
-	for (auto &iter : mapped_buffers_)
-	{
-		// assert(iter.first->planes().size() == iter.second.size());
-		// for (unsigned i = 0; i < iter.first->planes().size(); i++)
-		for (auto &span : iter.second)
-			munmap(span.data(), span.size());
-	}
 	mapped_buffers_.clear();
+	for (PooledBuffer &buffer : buffer_pool_)
+		munmap(buffer.memory, buffer.size);
+	buffer_pool_.clear();
 
 	configuration_.reset();
 
 	frame_buffers_.clear();
 
 	stream_ = nullptr;
+	lores_stream_ = nullptr;
+}
+
+void RPiCamApp::saveAeSeed(AeSeed seed) const
+{
+	// Values the user fixed only look converged, so aren't worth starting the next run from. The
+	// file holds both parts together, so the stored values stand in for a fixed one.
+	if (!ae_auto_ && !awb_auto_)
+		return;
+	if (!ae_auto_ || !awb_auto_)
+	{
+		std::optional<AeSeed> stored = ae_seed_load(options_->ae_seed, CameraId());
+		if (!stored)
+			return;
+		if (!ae_auto_)
+		{
+			seed.exposure_time = stored->exposure_time;
+			seed.analogue_gain = stored->analogue_gain;
+		}
+		else
+			seed.colour_gains = stored->colour_gains;
+	}
+	ae_seed_save(options_->ae_seed, CameraId(), seed);
 }
 
 void RPiCamApp::StartCamera()
 {
 	// This makes all the Request objects that we shall need.
 	makeRequests();
+	preview_first_frame_ = true;
 
 	// Build a list of initial controls that we must set in the camera before starting it.
 	// We don't overwrite anything the application may have set before calling us.
 	if (!controls_.get(controls::ScalerCrop) && !controls_.get(controls::rpi::ScalerCrops))
 	{
-		const Rectangle default_crop = camera_->controls().at(&controls::ScalerCrop).def().get<Rectangle>();
+		Rectangle default_crop = camera_->controls().at(&controls::ScalerCrop).def().get<Rectangle>();
+
+		// Filling the display means cropping the sensor image to the display's aspect ratio,
+		// centred, so the ISP never processes pixels that would fall off the screen.
+		unsigned int display_width, display_height;
+		{
+			std::lock_guard<std::mutex> lock(preview_switch_mutex_);
+			preview_->DisplaySize(display_width, display_height);
+		}
+		if (options_->fill_display && display_width && display_height)
+		{
+			Size size = default_crop.size().boundedToAspectRatio(Size(display_width, display_height));
+			default_crop = size.centeredTo(default_crop.center());
+		}
 
 		std::vector<Rectangle> crops;
 		crops.push_back(default_crop);
 
 		LOG(2, "Using crop (main) " << crops.back().toString());
 
+		if (lores_stream_)
+		{
+			crops.push_back(default_crop);
+			LOG(2, "Using crop (lores) " << crops.back().toString());
+		}
+
 		if (options_->GetPlatform() == Platform::VC4)
 			controls_.set(controls::ScalerCrop, crops[0]);
 		else
@@ -375,10 +599,49 @@ void RPiCamApp::StartCamera()
 		controls_.set(controls::AeFlickerPeriod, options_->flicker_period.get<std::chrono::microseconds>());
 	}
 
+	// Start from where AE/AWB last converged, rather than from their defaults, for anything the
+	// user hasn't fixed. The values are applied at start so they cover the very first frames, and
+	// the first request hands control straight back to the algorithms, which then only have to
+	// track any change in the scene.
+	ae_seeded_ = false;
+	ae_auto_ = !controls_.get(controls::ExposureTime) && !controls_.get(controls::AnalogueGain);
+	awb_auto_ = !controls_.get(controls::ColourGains);
+	std::optional<AeSeed> seed;
+	if (!options_->ae_seed.empty())
+		seed = ae_seed_load(options_->ae_seed, CameraId());
+	if (seed)
+	{
+		ControlList &release = requests_.front()->controls();
+		if (ae_auto_)
+		{
+			controls_.set(controls::ExposureTime, seed->exposure_time);
+			controls_.set(controls::AnalogueGain, seed->analogue_gain);
+			release.set(controls::ExposureTime, 0);
+			release.set(controls::AnalogueGain, 0.0f);
+			ae_seeded_ = true;
+		}
+		if (awb_auto_)
+		{
+			controls_.set(controls::ColourGains,
+						  libcamera::Span<const float, 2>({ seed->colour_gains[0], seed->colour_gains[1] }));
+			release.set(controls::ColourGains, libcamera::Span<const float, 2>({ 0.0f, 0.0f }));
+			ae_seeded_ = true;
+		}
+		if (ae_seeded_)
+			LOG(2, "Seeding AE/AWB with exposure " << seed->exposure_time << "us gain " << seed->analogue_gain
+												   << " colour gains " << seed->colour_gains[0] << ","
+												   << seed->colour_gains[1]);
+	}
+	convergence_.Reset();
+
 	if (camera_->start(&controls_))
 		throw std::runtime_error("failed to start camera");
 	controls_.clear();
 	camera_started_ = true;
+	last_timestamp_ = 0;
+	last_buffer_sequence_.reset();
+	starved_ = false;
+	requests_in_flight_ = requests_.size();
 
 	camera_->requestCompleted.connect(this, &RPiCamApp::requestComplete);
 
@@ -393,16 +656,21 @@ void RPiCamApp::StartCamera()
 
 void RPiCamApp::StopCamera()
 {
+	bool started;
 	{
-		// We don't want QueueRequest to run asynchronously while we stop the camera.
+		// Once this is clear, queueRequest() won't queue anything more, so we needn't hold the lock
+		// while the camera stops. Frames let go on the completion thread (by subscriptions, say)
+		// would otherwise block on it while camera_->stop() waits for that thread.
 		std::lock_guard<std::mutex> lock(camera_stop_mutex_);
-		if (camera_started_)
-		{
-			if (camera_->stop())
-				throw std::runtime_error("failed to stop camera");
+		started = camera_started_.exchange(false);
+	}
+	if (started)
+	{
+		if (camera_->stop())
+			throw std::runtime_error("failed to stop camera");
 
-			camera_started_ = false;
-		}
+		if (!options_->ae_seed.empty() && convergence_.Seed())
+			saveAeSeed(*convergence_.Seed());
 	}
 
 	if (camera_)
@@ -413,6 +681,13 @@ void RPiCamApp::StopCamera()
 	completed_requests_.clear();
 
 	msg_queue_.Clear();
+	{
+		std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+		for (auto &subscription : subscriptions_)
+			subscription->Clear();
+	}
+	if (frame_share_)
+		frame_share_->Clear();
 
 	requests_.clear();
 
@@ -427,12 +702,24 @@ RPiCamApp::Msg RPiCamApp::Wait()
 	return msg_queue_.Wait();
 }
 
+std::optional<RPiCamApp::Msg> RPiCamApp::TryWait()
+{
+	return msg_queue_.TryWait();
+}
+
+int RPiCamApp::GetMessageFd() const
+{
+	return msg_queue_.Fd();
+}
+
 void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 {
+	TRACE_SCOPE("queueRequest");
+	PERF_SCOPE("queueRequest");
 	BufferMap buffers(std::move(completed_request->buffers));
 
-	// This function may run asynchronously so needs protection from the
-	// camera stopping at the same time.
+	// This function may run asynchronously, on any thread that lets go of a frame, so needs
+	// protection from the camera stopping at the same time.
 	std::lock_guard<std::mutex> stop_lock(camera_stop_mutex_);
 
 	// An application could be holding a CompletedRequest while it stops and re-starts
@@ -481,6 +768,7 @@ void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 
 	if (camera_->queueRequest(request) < 0)
 		throw std::runtime_error("failed to queue request");
+	requests_in_flight_++;
 }
 
 void RPiCamApp::PostMessage(MsgType &t, MsgPayload &p)
@@ -493,6 +781,16 @@ libcamera::Stream *RPiCamApp::GetStream() const
 	return stream_;
 }
 
+libcamera::Stream *RPiCamApp::GetLoresStream() const
+{
+	return lores_stream_;
+}
+
+libcamera::Stream *RPiCamApp::GetPreviewStream() const
+{
+	return lores_stream_ ? lores_stream_ : stream_;
+}
+
 const libcamera::CameraManager *RPiCamApp::GetCameraManager() const
 {
 	return camera_manager_.get();
@@ -500,12 +798,88 @@ const libcamera::CameraManager *RPiCamApp::GetCameraManager() const
 
 void RPiCamApp::ShowPreview(CompletedRequestPtr &completed_request, Stream *stream)
 {
-	std::lock_guard<std::mutex> lock(preview_item_mutex_);
-	if (!preview_item_.stream)
+	{
+		std::lock_guard<std::mutex> lock(preview_item_mutex_);
+		if (preview_item_.stream)
+		{
+			preview_frames_dropped_++;
+			(preview_in_show_ ? drops_slow_show_ : drops_mailbox_)++;
+			return;
+		}
 		preview_item_ = PreviewItem(completed_request, stream); // copy the shared_ptr here
-	else
-		preview_frames_dropped_++;
-	preview_cond_var_.notify_one();
+	}
+	wakePreview();
+}
+
+void RPiCamApp::HidePreview()
+{
+	// Anything still waiting to be shown is older than the request to hide.
+	PreviewItem discarded;
+	{
+		std::lock_guard<std::mutex> lock(preview_item_mutex_);
+		discarded = std::move(preview_item_);
+		preview_item_ = PreviewItem();
+		preview_hide_ = true;
+	}
+	wakePreview();
+}
+
+bool RPiCamApp::SwitchPreview()
+{
+	if (!options_->egl_offscreen.empty())
+	{
+		LOG(1, "The offscreen preview can't be switched");
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> lock(preview_item_mutex_);
+		if (preview_switching_)
+		{
+			LOG(1, "Preview switch already in progress");
+			return false;
+		}
+	}
+
+	// Building the new preview (opening EGL, compiling shaders and so on) is the slow part, so do
+	// it here while the old one carries on. It shares the old one's DRM device, because only one
+	// file can be DRM master, and the preview thread only has to import the buffers and hand over.
+	auto start = DurationStats::Clock::now();
+	options_->useGlesPreview = !options_->useGlesPreview;
+	options_->preview_backend = options_->useGlesPreview ? "egl" : "drm";
+	Preview *preview;
+	{
+		std::lock_guard<std::mutex> lock(preview_switch_mutex_);
+		preview = make_preview(options_.get(), preview_->DrmFd());
+	}
+	if (!preview)
+	{
+		options_->useGlesPreview = !options_->useGlesPreview;
+		options_->preview_backend = options_->useGlesPreview ? "egl" : "drm";
+		LOG(1, "Could not switch preview, staying with " << options_->preview_backend);
+		return false;
+	}
+	std::unique_ptr<Preview> next(preview);
+	next->SetDoneCallback(std::bind(&RPiCamApp::previewDoneCallback, this, std::placeholders::_1));
+
+	std::vector<PreparedBuffer> prepare;
+	Stream *stream = preview_stream_;
+	if (stream && frame_buffers_.count(stream))
+	{
+		StreamInfo info = GetStreamInfo(stream);
+		for (auto const &buffer : frame_buffers_[stream])
+			prepare.push_back({ buffer->planes()[0].fd.get(), mapped_buffers_[buffer.get()][0], info });
+	}
+	std::chrono::duration<double, std::milli> elapsed = DurationStats::Clock::now() - start;
+	LOG(1, "Made " << options_->preview_backend << " preview in " << elapsed.count()
+				   << "ms, switching at the next frame");
+
+	{
+		std::lock_guard<std::mutex> lock(preview_item_mutex_);
+		preview_next_ = std::move(next);
+		preview_prepare_ = std::move(prepare);
+		preview_switching_ = true;
+	}
+	return true;
 }
 
 void RPiCamApp::SetControls(const ControlList &controls)
@@ -519,6 +893,109 @@ void RPiCamApp::SetControls(const ControlList &controls)
 		controls_.set(c.first, c.second);
 }
 
+void RPiCamApp::countUpstreamDrops(CompletedRequest const *completed_request, uint64_t timestamp)
+{
+	// The buffer sequence numbers come from the CSI-2 receiver, so skip for any frame that the
+	// sensor sent but that never reached us. The sensor may also skip frames without anything
+	// counting them, which shows up as a gap in the timestamps.
+	uint32_t sequence = completed_request->buffers.begin()->second->metadata().sequence;
+	uint64_t lost = 0;
+	if (last_buffer_sequence_ && sequence > *last_buffer_sequence_ + 1)
+		lost = sequence - *last_buffer_sequence_ - 1;
+	auto frame_duration = completed_request->metadata.get(controls::FrameDuration);
+	if (last_timestamp_ && frame_duration && *frame_duration > 0 && timestamp > last_timestamp_)
+	{
+		uint64_t periods = ((timestamp - last_timestamp_) / 1000 + *frame_duration / 2) / *frame_duration;
+		if (periods > 1)
+			lost = std::max(lost, periods - 1);
+	}
+	last_buffer_sequence_ = sequence;
+
+	if (!lost)
+		return;
+	(starved_ ? drops_no_request_ : drops_upstream_) += lost;
+	LOG(2, "Lost " << lost << " frame(s) before sequence " << sequence
+				   << (starved_ ? ", the camera had no requests" : ", in the sensor or ISP"));
+}
+
+FrameSubscriptionPtr RPiCamApp::Subscribe(Stream *stream, FramePolicy policy)
+{
+	// A consumer can have a full queue and one more frame in hand.
+	std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+	checkBufferBudget(stream, policy.depth + 1);
+
+	auto subscription = std::make_shared<FrameSubscription>(stream, policy);
+	subscriptions_.push_back(subscription);
+	LOG(2, "Frame subscription " << subscriptions_.size() << ": depth " << policy.depth << ", every "
+								 << policy.every << " frames");
+	return subscription;
+}
+
+// Call with subscriptions_mutex_ held.
+void RPiCamApp::checkBufferBudget(Stream *stream, unsigned int extra) const
+{
+	auto buffers = frame_buffers_.find(stream);
+	if (buffers == frame_buffers_.end())
+		throw std::runtime_error("can only share frames from a configured stream");
+
+	// With the preview holding up to three frames (queued, on screen and waiting to flip), two
+	// must still be left for the camera to fill or frames will start to be lost.
+	constexpr unsigned int preview_held = 3, camera_needs = 2;
+	unsigned int held = preview_held + extra;
+	for (auto const &subscription : subscriptions_)
+		held += subscription->GetPolicy().depth + 1;
+	if (frame_share_)
+		held += options_->share_frames;
+	if (held + camera_needs > buffers->second.size())
+		throw std::runtime_error("the preview, subscribers and sharing clients could hold " + std::to_string(held) +
+								 " of the " + std::to_string(buffers->second.size()) +
+								 " buffers, keep fewer frames or increase --buffer-count");
+}
+
+void RPiCamApp::startFrameShare()
+{
+	Stream *stream = GetStream();
+	{
+		std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+		checkBufferBudget(stream, options_->share_frames);
+	}
+
+	std::vector<int> fds;
+	for (auto const &buffer : frame_buffers_[stream])
+		fds.push_back(buffer->planes()[0].fd.get());
+	StreamInfo info = GetStreamInfo(stream);
+	FrameShareFormat format = { info.width, info.height, info.stride, info.pixel_format.fourcc() };
+	frame_share_ = std::make_unique<FrameShareServer>(options_->share_socket, format, fds,
+													  stream->configuration().frameSize, options_->share_frames);
+}
+
+void RPiCamApp::Unsubscribe(FrameSubscriptionPtr const &subscription)
+{
+	std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+	auto it = std::find(subscriptions_.begin(), subscriptions_.end(), subscription);
+	if (it == subscriptions_.end())
+		return;
+	LOG(2, "Frame subscription ended: " << (*it)->Delivered() << " frames delivered, " << (*it)->Dropped()
+										<< " dropped");
+	(*it)->Clear();
+	subscriptions_.erase(it);
+}
+
+RPiCamApp::FrameDrops RPiCamApp::GetFrameDrops() const
+{
+	std::lock_guard<std::mutex> lock(preview_switch_mutex_);
+	return { drops_upstream_, drops_no_request_, drops_mailbox_, drops_slow_show_,
+			 retired_missed_vblanks_ + (preview_ ? preview_->MissedVblanks() : 0) };
+}
+
+std::string RPiCamApp::FrameDrops::ToString() const
+{
+	std::stringstream s;
+	s << "upstream " << upstream << ", no free request " << no_request << ", mailbox overwrite " << mailbox
+	  << ", slow Show " << slow_show << ", missed vblank " << missed_vblank;
+	return s.str();
+}
+
 StreamInfo RPiCamApp::GetStreamInfo(Stream const *stream) const
 {
 	StreamConfiguration const &cfg = stream->configuration();
@@ -551,39 +1028,70 @@ void RPiCamApp::setupCapture()
 	for (auto const &[id, info] : camera_->controls())
 		LOG(2, "    " << id->name() << " : " << info.toString());
 
-	// Next allocate all the buffers we need, mmap them and store them on a free list.
+	// Next find buffers for every stream, taking the smallest that will do from the pool and
+	// allocating (and mmapping) more when there aren't any. Buffers the preview still holds, as
+	// when reconfiguring, mustn't be written until it lets them go.
+	std::vector<bool> taken(buffer_pool_.size());
+	{
+		std::lock_guard<std::mutex> lock(preview_mutex_);
+		for (unsigned int i = 0; i < buffer_pool_.size(); i++)
+			taken[i] = preview_completed_requests_.count(buffer_pool_[i].fd.get());
+	}
+	unsigned int reused = 0;
 
 	for (StreamConfiguration &config : *configuration_)
 	{
 		Stream *stream = config.stream();
 		std::vector<std::unique_ptr<FrameBuffer>> fb;
+		// Main stream buffers are made big enough for --buffer-pool, so that reconfiguring up to
+		// that size needs no new ones.
+		size_t alloc_size = config.frameSize;
+		if (&config == &configuration_->at(0))
+			alloc_size = std::max<size_t>(alloc_size, options_->buffer_pool_size);
 
 		for (unsigned int i = 0; i < config.bufferCount; i++)
 		{
-			std::string name("rpicam-apps" + std::to_string(i));
-			libcamera::UniqueFD fd = dma_heap_.alloc(name.c_str(), config.frameSize);
+			int best = -1;
+			for (unsigned int j = 0; j < buffer_pool_.size(); j++)
+			{
+				if (!taken[j] && buffer_pool_[j].size >= config.frameSize &&
+					(best < 0 || buffer_pool_[j].size < buffer_pool_[best].size))
+					best = j;
+			}
 
-			if (!fd.isValid())
-				throw std::runtime_error("failed to allocate capture buffers for stream");
+			if (best >= 0)
+				reused++;
+			else
+			{
+				std::string name("rpicam-apps" + std::to_string(buffer_pool_.size()));
+				libcamera::UniqueFD fd = dma_heap_.alloc(name.c_str(), alloc_size);
+
+				if (!fd.isValid())
+					throw std::runtime_error("failed to allocate capture buffers for stream");
+
+				void *memory = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+				if (memory == MAP_FAILED)
+					throw std::runtime_error("failed to map capture buffer");
+				buffer_pool_.push_back({ libcamera::SharedFD(std::move(fd)), alloc_size,
+										 static_cast<uint8_t *>(memory) });
+				taken.push_back(false);
+				best = buffer_pool_.size() - 1;
+			}
+			taken[best] = true;
 
 			std::vector<FrameBuffer::Plane> plane(1);
-			plane[0].fd = libcamera::SharedFD(std::move(fd));
+			plane[0].fd = buffer_pool_[best].fd;
 			plane[0].offset = 0;
 			plane[0].length = config.frameSize;
 
 			fb.push_back(std::make_unique<FrameBuffer>(plane));
-			void *memory = mmap(NULL, config.frameSize, PROT_READ | PROT_WRITE, MAP_SHARED, plane[0].fd.get(), 0);
 			mapped_buffers_[fb.back().get()].push_back(
-						libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), config.frameSize));
+						libcamera::Span<uint8_t>(buffer_pool_[best].memory, config.frameSize));
 		}
 
 		frame_buffers_[stream] = std::move(fb);
 	}
-	LOG(2, "Buffers allocated and mapped");
-
-	startPreview();
-
-	// The requests will be made when StartCamera() is called.
+	LOG(2, "Buffers ready: " << reused << " reused, " << buffer_pool_.size() << " in the pool");
 }
 
 void RPiCamApp::makeRequests()
@@ -627,6 +1135,9 @@ void RPiCamApp::makeRequests()
 
 void RPiCamApp::requestComplete(Request *request)
 {
+	TRACE_SCOPE("requestComplete");
+	PERF_SCOPE("requestComplete");
+	unsigned int in_flight = --requests_in_flight_;
 	if (request->status() == Request::RequestCancelled)
 	{
 		// If the request is cancelled while the camera is still running, it indicates
@@ -650,13 +1161,53 @@ void RPiCamApp::requestComplete(Request *request)
 			throw std::runtime_error("failed to sync dma buf on request complete");
 	}
 
-	CompletedRequest *r = new CompletedRequest(request);
+	CompletedRequest *r = new CompletedRequest(sequence_++, request);
 	CompletedRequestPtr payload(r, [this](CompletedRequest *cr) { this->queueRequest(cr); });
 	{
 		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
 		completed_requests_.insert(r);
 	}
 
+	// We calculate the instantaneous framerate in case anyone wants it.
+	// Use the sensor timestamp if possible as it ought to be less glitchy than
+	// the buffer timestamps.
+	auto ts = payload->metadata.get(controls::SensorTimestamp);
+	uint64_t timestamp = ts ? *ts : payload->buffers.begin()->second->metadata().timestamp;
+	if (last_timestamp_ == 0 || last_timestamp_ == timestamp)
+		payload->framerate = 0;
+	else
+		payload->framerate = 1e9 / (timestamp - last_timestamp_);
+	countUpstreamDrops(r, timestamp);
+	last_timestamp_ = timestamp;
+	// With nothing queued the pipeline has nowhere to put the next frames, so if any go
+	// missing before the next completion, that's why.
+	starved_ = in_flight == 0;
+
+	if (metadata_log_)
+		metadata_log_->Append(r->sequence, payload->framerate, payload->metadata);
+
+	if (convergence_.Update(payload->metadata, timestamp))
+		LOG(1, "AE/AWB converged after " << convergence_.Frames() << " frames (" << convergence_.Ms() << "ms), "
+										 << (ae_seeded_ ? "seeded" : "not seeded"));
+
+	// The event loop still gets every frame, but needn't pass it on to the preview.
+	if (options_->direct_preview)
+		ShowPreview(payload, GetPreviewStream());
+
+	{
+		std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+		for (auto &subscription : subscriptions_)
+			subscription->Publish(payload);
+	}
+
+	if (frame_share_)
+	{
+		auto const &buffers = frame_buffers_.at(stream_);
+		FrameBuffer *buffer = payload->buffers.at(stream_);
+		auto it = std::find_if(buffers.begin(), buffers.end(), [buffer](auto const &b) { return b.get() == buffer; });
+		frame_share_->Publish(it - buffers.begin(), r->sequence, timestamp, payload);
+	}
+
 	this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(payload)));
 }
 
@@ -672,6 +1223,9 @@ void RPiCamApp::previewDoneCallback(int fd)
 void RPiCamApp::startPreview()
 {
 	preview_abort_ = false;
+	preview_event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (preview_event_fd_ < 0)
+		throw std::runtime_error("failed to create preview eventfd");
 	preview_thread_ = std::thread(&RPiCamApp::previewThread, this);
 }
 
@@ -683,50 +1237,271 @@ void RPiCamApp::stopPreview()
 	{
 		std::lock_guard<std::mutex> lock(preview_item_mutex_);
 		preview_abort_ = true;
-		preview_cond_var_.notify_one();
 	}
+	wakePreview();
 	preview_thread_.join();
+	close(preview_event_fd_);
+	preview_event_fd_ = -1;
 	preview_item_ = PreviewItem();
+	preview_next_.reset();
+	preview_prepare_.clear();
+	preview_switching_ = false;
 	preview_completed_requests_.clear();
 }
 
+void RPiCamApp::wakePreview()
+{
+	uint64_t one = 1;
+	if (write(preview_event_fd_, &one, sizeof(one)) != sizeof(one))
+		throw std::runtime_error("failed to wake preview thread");
+}
+
 void RPiCamApp::previewThread()
 {
-	while (true)
-	{
+	Preview::AnalysisOverlay analysis_overlay = Preview::AnalysisOverlay::None;
+
+	// New frames and display events (page flips completing) are all handled here, so the
+	// display releases buffers as soon as it's done with them, not when the next frame comes.
+	Reactor reactor;
+	int display_fd = -1;
+	auto watch_display = [&]() {
+		display_fd = preview_->EventFd();
+		if (display_fd >= 0)
+			reactor.Add(display_fd, [this](uint32_t) { preview_->HandleEvents(); });
+	};
+	reactor.Add(preview_event_fd_, [&](uint32_t) {
+		uint64_t count;
+		if (read(preview_event_fd_, &count, sizeof(count)) < 0)
+			return;
+
+		// Held until the frame is shown, so that Reconfigure() can't free its buffer meanwhile.
+		std::lock_guard<std::mutex> show_lock(preview_show_mutex_);
 		PreviewItem item;
-		while (!item.stream)
+		bool hide;
+		std::unique_ptr<Preview> next;
+		std::vector<PreparedBuffer> prepare;
 		{
-			std::unique_lock<std::mutex> lock(preview_item_mutex_);
+			std::lock_guard<std::mutex> lock(preview_item_mutex_);
 			if (preview_abort_)
 			{
-				preview_->Reset();
+				reactor.Stop();
 				return;
 			}
-			else if (preview_item_.stream)
-				item = std::move(preview_item_); // re-use existing shared_ptr reference
-			else
-				preview_cond_var_.wait(lock);
+			item = std::move(preview_item_);
+			hide = std::exchange(preview_hide_, false);
+			// Switch backends only when there's a frame to put up straight away.
+			if (item.stream && preview_next_)
+			{
+				next = std::move(preview_next_);
+				prepare = std::move(preview_prepare_);
+			}
+			// The buffer counts as the preview's from the moment it leaves the mailbox, so that
+			// setupCapture() never sees it in neither place.
+			if (item.stream)
+			{
+				std::lock_guard<std::mutex> preview_lock(preview_mutex_);
+				int fd = item.completed_request->buffers[item.stream]->planes()[0].fd.get();
+				preview_completed_requests_[fd] = item.completed_request;
+			}
 		}
+		if (hide)
+			preview_->Hide();
+		if (next)
+		{
+			reactor.Remove(display_fd);
+			auto hidden = previewSwitch(std::move(next), prepare, analysis_overlay);
+			watch_display();
+			previewShow(item, analysis_overlay);
+			std::chrono::duration<double, std::milli> blank = DurationStats::Clock::now() - hidden;
+			LOG(1, "Switched to " << options_->preview_backend << " preview, display blank for " << blank.count()
+								  << "ms");
+			std::lock_guard<std::mutex> lock(preview_item_mutex_);
+			preview_switching_ = false;
+		}
+		else if (item.stream)
+			previewShow(item, analysis_overlay);
+	});
+	watch_display();
 
-		if (item.stream->configuration().pixelFormat != libcamera::formats::YUV420)
-			throw std::runtime_error("Preview windows only support YUV420");
+	reactor.Run();
+	preview_->Reset();
+}
 
-		StreamInfo info = GetStreamInfo(item.stream);
-		FrameBuffer *buffer = item.completed_request->buffers[item.stream];
-		BufferReadSync r(this, buffer);
-		libcamera::Span span = r.Get()[0];
+DurationStats::Clock::time_point RPiCamApp::previewSwitch(std::unique_ptr<Preview> next,
+														  std::vector<PreparedBuffer> const &prepare,
+														  Preview::AnalysisOverlay analysis_overlay)
+{
+	// Import everything into the new preview while the old one still has the last frame up.
+	auto start = DurationStats::Clock::now();
+	for (PreparedBuffer const &buffer : prepare)
+		next->Prepare(buffer.fd, buffer.span, buffer.info);
+	next->SetAnalysisOverlay(analysis_overlay);
+	auto hidden = DurationStats::Clock::now();
+	std::chrono::duration<double, std::milli> elapsed = hidden - start;
+	LOG(2, "Prepared " << prepare.size() << " buffers in " << elapsed.count() << "ms");
+
+	// The old preview hands its buffers back and waits out any flip before the new one shows
+	// anything, so the two never both have events pending on the DRM device they share. The
+	// screen is blank from here until the new one's first frame.
+	preview_->Hide();
+	preview_->Reset();
+	retired_missed_vblanks_ += preview_->MissedVblanks();
+	std::unique_ptr<Preview> old;
+	{
+		std::lock_guard<std::mutex> lock(preview_switch_mutex_);
+		old = std::exchange(preview_, std::move(next));
+	}
+	// The old preview goes here, out of the lock.
+	return hidden;
+}
+
+void RPiCamApp::previewShow(PreviewItem &item, Preview::AnalysisOverlay &analysis_overlay)
+{
+	TRACE_SCOPE("preview frame");
+	PERF_SCOPE("preview frame");
+	preview_dispatch_stats_.Add(item.completed_request->completed);
+
+	if (item.stream->configuration().pixelFormat != libcamera::formats::YUV420)
+		throw std::runtime_error("Preview windows only support YUV420");
+
+	StreamInfo info = GetStreamInfo(item.stream);
+	FrameBuffer *buffer = item.completed_request->buffers[item.stream];
+	BufferReadSync r(this, buffer);
+	libcamera::Span span = r.Get()[0];
 
-		int fd = buffer->planes()[0].fd.get();
+	if (analysis_overlay != analysis_overlay_)
+	{
+		analysis_overlay = analysis_overlay_;
+		preview_->SetAnalysisOverlay(analysis_overlay);
+	}
+
+	// The preview only rasterises the text again when it actually changes.
+	if (!options_->info_text.empty())
+		preview_->SetInfoText(FrameInfo(item.completed_request).ToString(options_->info_text));
+
+	int fd = buffer->planes()[0].fd.get();
+	preview_stream_ = item.stream;
+	preview_frames_displayed_++;
+	PERF_SCOPE("Show");
+	preview_in_show_ = true;
+	preview_->Show(fd, span, info);
+	preview_in_show_ = false;
+
+	auto now = std::chrono::steady_clock::now();
+	if (preview_first_frame_.exchange(false))
+	{
+		// The last frame before a reconfigure stayed up until now.
+		if (preview_reconfigured_.exchange(false))
 		{
-			std::lock_guard<std::mutex> lock(preview_mutex_);
-			// the reference to the shared_ptr moves to the map here
-			preview_completed_requests_[fd] = std::move(item.completed_request);
+			reconfigure_gap_ = std::chrono::duration_cast<std::chrono::nanoseconds>(now - preview_last_shown_);
+			reconfigure_gap_stats_.Add(reconfigure_gap_.load());
+			LOG(1, "Preview gap on reconfigure " << reconfigure_gap_.load().count() / 1e6 << "ms");
 		}
+		msg_queue_.Post(Msg(MsgType::PreviewStarted));
+	}
+	preview_last_shown_ = now;
+}
+
+libcamera::Size RPiCamApp::displayMatchedSize() const
+{
+	// Have the ISP produce only the pixels that will be displayed, instead of scaling them
+	// down again in the display engine or GPU. Returns a null size if the display isn't known.
+	std::lock_guard<std::mutex> lock(preview_switch_mutex_);
+	unsigned int display_width, display_height;
+	preview_->DisplaySize(display_width, display_height);
+	if (!display_width || !display_height)
+		return Size();
+
+	Size size(display_width, display_height);
+	if (!options_->fill_display)
+	{
+		// Letterboxed, so match the aspect ratio of what the sensor sees.
+		Rectangle crop = camera_->controls().at(&controls::ScalerCrop).def().get<Rectangle>();
+		size = size.boundedToAspectRatio(crop.size());
+	}
+	unsigned int max_width, max_height;
+	preview_->MaxImageSize(max_width, max_height);
+	return size.boundedTo(Size(max_width, max_height)).alignedDownTo(2, 2);
+}
+
+std::optional<RPiCamApp::SensorMode> RPiCamApp::chooseSensorMode(Size const &stream_size) const
+{
+	if (options_->mode.empty())
+		return {};
+
+	if (options_->mode != "fast")
+	{
+		for (SensorMode const &mode : sensor_modes_)
+		{
+			if (mode.size.width == options_->mode_width && mode.size.height == options_->mode_height &&
+				(!options_->mode_depth || mode.depth() == options_->mode_depth))
+			{
+				LOG(1, "Using sensor mode " << mode.ToString());
+				return mode;
+			}
+		}
+		throw std::runtime_error("no sensor mode matches " + options_->mode);
+	}
+
+	// Latency is bounded below by the frame duration, and the readout can't take any longer
+	// than that either, so we want the mode with the shortest frame duration that is still
+	// big enough and sees enough of the scene. Binned modes naturally come out on top here
+	// as they read out fewer lines without giving up any of the field of view.
+	Size min_size = options_->mode_min_width ? Size(options_->mode_min_width, options_->mode_min_height) : stream_size;
+	Rectangle full;
+	for (SensorMode const &mode : sensor_modes_)
+	{
+		if (mode.crop.width * mode.crop.height > full.width * full.height)
+			full = mode.crop;
+	}
+	if (full.width == 0 || full.height == 0)
+		throw std::runtime_error("no sensor mode field of view information");
+
+	LOG(1, "Choosing the fastest sensor mode of at least " << min_size.toString() << " that keeps "
+														   << options_->mode_fov * 100 << "% of the "
+														   << full.size().toString() << " field of view:");
+
+	SensorMode const *best = nullptr;
+	for (SensorMode const &mode : sensor_modes_)
+	{
+		double fov = std::min((double)mode.crop.width / full.width, (double)mode.crop.height / full.height);
+		double binning = mode.size.width ? (double)mode.crop.width / mode.size.width : 0;
+		// Modes within 1% of each other count as equally fast, and then the one with fewer pixels
+		// to send over CSI-2 and through the ISP wins.
+		auto faster = [](SensorMode const &a, SensorMode const &b)
+		{
+			if (a.fps > b.fps * 1.01 || b.fps > a.fps * 1.01)
+				return a.fps > b.fps;
+			return a.size.width * a.size.height * a.depth() < b.size.width * b.size.height * b.depth();
+		};
+
+		char const *verdict;
+		if (mode.size.width < min_size.width || mode.size.height < min_size.height)
+			verdict = "too small";
+		else if (fov < options_->mode_fov - 0.01)
+			verdict = "field of view too narrow";
+		else if (!mode.fps)
+			verdict = "frame rate unknown";
+		else if (!best || faster(mode, *best))
+		{
+			verdict = "fastest so far";
+			best = &mode;
+		}
+		else
+			verdict = "slower";
 
-		preview_frames_displayed_++;
-		preview_->Show(fd, span, info);
+		LOG(1, "    " << mode.ToString() << " frame/readout <= " << (mode.fps ? 1000 / mode.fps : 0) << "ms, fov "
+					  << fov * 100 << "%, binning " << binning << ": " << verdict);
 	}
+
+	if (!best)
+		throw std::runtime_error("no sensor mode meets the size and field of view requirements");
+
+	LOG(1, "Using sensor mode " << best->ToString());
+	if (options_->framerate && options_->framerate.value() > best->fps)
+		LOG(1, "WARNING: the fastest mode can't reach the requested " << options_->framerate.value() << "fps");
+
+	return *best;
 }
 
 void RPiCamApp::configureDenoise(const std::string &denoise_mode)
@@ -7,12 +7,18 @@
 
 #pragma once
 
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <set>
 #include <sstream>
@@ -30,9 +36,14 @@
 #include <libcamera/logging.h>
 #include <libcamera/property_ids.h>
 
+#include "core/ae_seed.hpp"
 #include "core/buffer_sync.hpp"
 #include "core/completed_request.hpp"
 #include "core/dma_heaps.hpp"
+#include "core/duration_stats.hpp"
+#include "core/frame_fanout.hpp"
+#include "core/frame_share.hpp"
+#include "core/metadata_log.hpp"
 #include "core/stream_info.hpp"
 #include "core/options.hpp"
 #include "preview/preview.hpp"
@@ -61,7 +72,9 @@ public:
 	{
 		RequestComplete,
 		Timeout,
-		Quit
+		Quit,
+		// The first frame since StartCamera() has been handed to the display.
+		PreviewStarted
 	};
 	typedef std::variant<CompletedRequestPtr> MsgPayload;
 	struct Msg
@@ -80,8 +93,9 @@ public:
 			: size({}), format({}), fps(0)
 		{
 		}
-		SensorMode(libcamera::Size _size, libcamera::PixelFormat _format, double _fps)
-			: size(_size), format(_format), fps(_fps)
+		SensorMode(libcamera::Size _size, libcamera::PixelFormat _format, double _fps,
+				   libcamera::Rectangle _crop = {})
+			: size(_size), format(_format), fps(_fps), crop(_crop)
 		{
 		}
 		unsigned int depth() const
@@ -99,6 +113,8 @@ public:
 		libcamera::Size size;
 		libcamera::PixelFormat format;
 		double fps;
+		// The area of the sensor that the mode reads out, so its field of view.
+		libcamera::Rectangle crop;
 		std::string ToString() const
 		{
 			std::stringstream ss;
@@ -118,6 +134,17 @@ public:
 	static constexpr unsigned int FLAG_STILL_TRIPLE_BUFFER = 64; // triple-buffer stream
 	static constexpr unsigned int FLAG_STILL_BUFFER_MASK = 96; // mask for buffer flags
 
+	// Frames lost, by where they were lost.
+	struct FrameDrops
+	{
+		uint64_t upstream; // by the sensor or ISP, seen as gaps in the sequence numbers or timestamps
+		uint64_t no_request; // the same, but while the camera had no requests to fill
+		uint64_t mailbox; // the preview thread hadn't taken the last frame yet
+		uint64_t slow_show; // the same, because the preview was still busy in Show
+		uint64_t missed_vblank; // the preview discarded a frame because the last flip was still pending
+		std::string ToString() const;
+	};
+
 	static constexpr unsigned int FLAG_VIDEO_NONE = 0;
 	static constexpr unsigned int FLAG_VIDEO_RAW = 1; // request raw image stream
 	static constexpr unsigned int FLAG_VIDEO_JPEG_COLOURSPACE = 2; // force JPEG colour space
@@ -133,15 +160,34 @@ public:
 	void CloseCamera();
 
 	void ConfigureVideo(libcamera::ColorSpace colorSpace);
+	// Change the video size and/or frame rate (zero leaves either as it is) without tearing
+	// everything down. A frame rate the current sensor mode can reach is simply applied to the next
+	// requests. Otherwise the camera is stopped and configured again, but the preview thread and
+	// display stay up, showing the last frame until the first new one replaces it, and buffers that
+	// are big enough are reused. Returns true if the camera was restarted, in which case a
+	// PreviewStarted message follows, after which ReconfigureGap() says how long the old frame was
+	// left on the screen. If the new configuration can't be made, the old one is put back (and the
+	// camera restarted if it was running) before the error is thrown. A new size for a main stream
+	// sized by --match-display takes the place of the display's size.
+	bool Reconfigure(unsigned int width, unsigned int height, float framerate);
+	std::chrono::nanoseconds ReconfigureGap() const { return reconfigure_gap_.load(); }
 
 	void Teardown();
 	void StartCamera();
 	void StopCamera();
+	bool CameraRunning() const { return camera_started_; }
 
 	Msg Wait();
+	// Returns at once, with nothing if no message is waiting.
+	std::optional<Msg> TryWait();
+	// Readable whenever a message is waiting, for applications with their own event loop.
+	int GetMessageFd() const;
 	void PostMessage(MsgType &t, MsgPayload &p);
 
 	Stream *GetStream() const;
+	Stream *GetLoresStream() const;
+	// The lores stream when there is one, otherwise the main stream.
+	Stream *GetPreviewStream() const;
 
 	const CameraManager *GetCameraManager() const;
 	std::vector<std::shared_ptr<libcamera::Camera>> GetCameras()
@@ -150,6 +196,24 @@ public:
 	}
 
 	void ShowPreview(CompletedRequestPtr &completed_request, Stream *stream);
+	// Take the preview off the screen, as when the camera is stopped for a while. The display
+	// stays set up, so the next frame shown brings it straight back.
+	void HidePreview();
+	// Bring up the other preview backend (DRM or EGL) on the same display, and hand over to it at
+	// the next frame, once it has imported all the buffers. Returns false if it couldn't be made,
+	// or a switch is still pending, in which case the current preview carries on.
+	bool SwitchPreview();
+	// Change the analysis overlay, applied from the next previewed frame.
+	void SetAnalysisOverlay(Preview::AnalysisOverlay overlay) { analysis_overlay_ = overlay; }
+	Preview::AnalysisOverlay GetAnalysisOverlay() const { return analysis_overlay_; }
+
+	FrameDrops GetFrameDrops() const;
+
+	// Get every completed frame for the stream, queued according to the policy, in addition to
+	// the messages from Wait(). Subscribe after configuring the camera. Throws if the queues
+	// could hold so many buffers that the camera might run out.
+	FrameSubscriptionPtr Subscribe(Stream *stream, FramePolicy policy);
+	void Unsubscribe(FrameSubscriptionPtr const &subscription);
 
 	void SetControls(const ControlList &controls);
 	StreamInfo GetStreamInfo(Stream const *stream) const;
@@ -179,21 +243,45 @@ protected:
 	std::unique_ptr<Options> options_;
 
 private:
+	// The eventfd counts the messages in the queue, so it can be waited on with poll or epoll
+	// alongside anything else.
 	template <typename T>
 	class MessageQueue
 	{
 	public:
+		MessageQueue() : fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE))
+		{
+			if (fd_ < 0)
+				throw std::runtime_error("failed to create message queue eventfd");
+		}
+		~MessageQueue() { close(fd_); }
 		template <typename U>
 		void Post(U &&msg)
 		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			queue_.push(std::forward<U>(msg));
-			cond_.notify_one();
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				queue_.push(std::forward<U>(msg));
+			}
+			uint64_t one = 1;
+			if (write(fd_, &one, sizeof(one)) != sizeof(one))
+				throw std::runtime_error("failed to signal message queue");
 		}
 		T Wait()
 		{
+			pollfd p = { fd_, POLLIN, 0 };
+			while (true)
+			{
+				if (std::optional<T> msg = TryWait())
+					return std::move(*msg);
+				poll(&p, 1, -1);
+			}
+		}
+		std::optional<T> TryWait()
+		{
+			uint64_t count;
+			if (read(fd_, &count, sizeof(count)) != sizeof(count))
+				return {};
 			std::unique_lock<std::mutex> lock(mutex_);
-			cond_.wait(lock, [this] { return !queue_.empty(); });
 			T msg = std::move(queue_.front());
 			queue_.pop();
 			return msg;
@@ -201,13 +289,16 @@ private:
 		void Clear()
 		{
 			std::unique_lock<std::mutex> lock(mutex_);
-			queue_ = {};
+			uint64_t count;
+			while (read(fd_, &count, sizeof(count)) == sizeof(count))
+				queue_.pop();
 		}
+		int Fd() const { return fd_; }
 
 	private:
 		std::queue<T> queue_;
 		std::mutex mutex_;
-		std::condition_variable cond_;
+		int fd_;
 	};
 	struct PreviewItem
 	{
@@ -223,8 +314,16 @@ private:
 		CompletedRequestPtr completed_request;
 		Stream *stream;
 	};
+	// A buffer for a new preview to import before it takes over.
+	struct PreparedBuffer
+	{
+		int fd;
+		libcamera::Span<uint8_t> span;
+		StreamInfo info;
+	};
 
 	void initCameraManager();
+	void configureVideoStreams(std::optional<libcamera::ColorSpace> const &colorSpace);
 	void setupCapture();
 	void makeRequests();
 	void queueRequest(CompletedRequest *completed_request);
@@ -233,7 +332,18 @@ private:
 	void startPreview();
 	void stopPreview();
 	void previewThread();
+	void startFrameShare();
+	void checkBufferBudget(Stream *stream, unsigned int extra) const;
+	void previewShow(PreviewItem &item, Preview::AnalysisOverlay &analysis_overlay);
+	DurationStats::Clock::time_point previewSwitch(std::unique_ptr<Preview> next,
+												   std::vector<PreparedBuffer> const &prepare,
+												   Preview::AnalysisOverlay analysis_overlay);
+	void wakePreview();
+	void saveAeSeed(AeSeed seed) const;
 	void configureDenoise(const std::string &denoise_mode);
+	Size displayMatchedSize() const;
+	void countUpstreamDrops(CompletedRequest const *completed_request, uint64_t timestamp);
+	std::optional<SensorMode> chooseSensorMode(Size const &stream_size) const;
 
 	std::unique_ptr<CameraManager> camera_manager_;
 	std::shared_ptr<Camera> camera_;
@@ -241,29 +351,81 @@ private:
 	std::unique_ptr<CameraConfiguration> configuration_;
 	std::map<FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mapped_buffers_;
 	Stream * stream_ = nullptr;
+	Stream *lores_stream_ = nullptr;
 	DmaHeap dma_heap_;
 	std::map<Stream *, std::vector<std::unique_ptr<FrameBuffer>>> frame_buffers_;
+	// Every buffer ever allocated, mapped, whichever configuration it was made for. Each
+	// configuration takes the smallest that are big enough and not still on the screen.
+	struct PooledBuffer
+	{
+		libcamera::SharedFD fd;
+		size_t size;
+		uint8_t *memory;
+	};
+	std::vector<PooledBuffer> buffer_pool_;
 	std::vector<std::unique_ptr<Request>> requests_;
 	std::mutex completed_requests_mutex_;
 	std::set<CompletedRequest *> completed_requests_;
-	bool camera_started_ = false;
+	std::atomic<bool> camera_started_ = false;
 	std::mutex camera_stop_mutex_;
+	unsigned int sequence_ = 0;
+	uint64_t last_timestamp_ = 0;
+	// Frame drop accounting.
+	std::atomic<unsigned int> requests_in_flight_ = 0;
+	bool starved_ = false;
+	std::optional<uint32_t> last_buffer_sequence_;
+	std::atomic<uint64_t> drops_upstream_ = 0;
+	std::atomic<uint64_t> drops_no_request_ = 0;
+	std::atomic<uint64_t> drops_mailbox_ = 0;
+	std::atomic<uint64_t> drops_slow_show_ = 0;
+	std::atomic<bool> preview_in_show_ = false;
+	std::mutex subscriptions_mutex_;
+	std::vector<FrameSubscriptionPtr> subscriptions_;
+	std::unique_ptr<FrameShareServer> frame_share_;
 	MessageQueue<Msg> msg_queue_;
 	std::vector<SensorMode> sensor_modes_;
 	// Related to the preview window.
 	std::unique_ptr<Preview> preview_;
+	// The preview thread replaces preview_ when switching backends, so other threads lock this.
+	mutable std::mutex preview_switch_mutex_;
+	// A preview waiting to take over, and the buffers it should import first.
+	std::unique_ptr<Preview> preview_next_;
+	std::vector<PreparedBuffer> preview_prepare_;
+	bool preview_switching_ = false;
+	std::atomic<uint64_t> retired_missed_vblanks_ = 0;
+	// The stream the preview last showed, whose buffers a new preview imports.
+	std::atomic<Stream *> preview_stream_ = nullptr;
 	std::map<int, CompletedRequestPtr> preview_completed_requests_;
 	std::mutex preview_mutex_;
 	std::mutex preview_item_mutex_;
+	// Held by the preview thread from taking an item until it has been shown.
+	std::mutex preview_show_mutex_;
 	PreviewItem preview_item_;
-	std::condition_variable preview_cond_var_;
+	int preview_event_fd_ = -1;
 	bool preview_abort_ = false;
+	bool preview_hide_ = false;
+	std::atomic<bool> preview_first_frame_ = false;
+	// When the last frame was shown, and whether the next first frame follows a Reconfigure().
+	std::chrono::steady_clock::time_point preview_last_shown_;
+	std::atomic<bool> preview_reconfigured_ = false;
+	std::atomic<std::chrono::nanoseconds> reconfigure_gap_ = std::chrono::nanoseconds(0);
+	DurationStats reconfigure_gap_stats_ { "Preview gap on reconfigure" };
 	uint32_t preview_frames_displayed_ = 0;
 	uint32_t preview_frames_dropped_ = 0;
+	// Time from a request completing to the preview thread starting to show it.
+	DurationStats preview_dispatch_stats_ { "Request completion to preview" };
 	std::thread preview_thread_;
+	std::atomic<Preview::AnalysisOverlay> analysis_overlay_ = Preview::AnalysisOverlay::None;
 	// For setting camera controls.
 	std::mutex control_mutex_;
 	ControlList controls_;
+	std::unique_ptr<MetadataLog> metadata_log_;
+	// Startup AE/AWB convergence.
+	ConvergenceMonitor convergence_;
+	bool ae_seeded_ = false;
+	// Whether AE and AWB were left to the algorithms, and so what's worth saving as a seed.
+	bool ae_auto_ = false;
+	bool awb_auto_ = false;
 	// Other:
 	libcamera::PixelFormat lores_format_ = libcamera::formats::YUV420;
 };
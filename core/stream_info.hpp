@@ -14,6 +14,12 @@
 struct StreamInfo
 {
 	StreamInfo() : width(0), height(0), stride(0) {}
+	// Whether an image in one format is laid out in memory the same as in the other.
+	bool SameLayout(StreamInfo const &other) const
+	{
+		return width == other.width && height == other.height && stride == other.stride &&
+			   pixel_format == other.pixel_format;
+	}
 	unsigned int width;
 	unsigned int height;
 	unsigned int stride;
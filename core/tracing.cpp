@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * tracing.cpp - begin/end markers for ftrace or Chrome/Perfetto JSON traces.
+ */
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "core/tracing.hpp"
+
+namespace
+{
+
+int marker_fd = -1;
+FILE *json_file = nullptr;
+bool json_first = true;
+std::mutex json_mutex;
+int pid;
+
+int thread_id()
+{
+	thread_local int tid = syscall(SYS_gettid);
+	return tid;
+}
+
+// The Perfetto/systrace "atrace" text format, which Perfetto and trace-cmd both understand.
+void marker_event(char phase, char const *name)
+{
+	char buf[128];
+	int n = phase == 'E' ? snprintf(buf, sizeof(buf), "E|%d", pid)
+						 : snprintf(buf, sizeof(buf), "%c|%d|%s", phase, pid, name);
+	// One write per marker, which the kernel timestamps and records atomically. There's
+	// nothing useful to do if it fails.
+	[[maybe_unused]] ssize_t ret = write(marker_fd, buf, std::min<int>(n, sizeof(buf) - 1));
+}
+
+void json_event(char phase, char const *name)
+{
+	// CLOCK_MONOTONIC, the same clock as the V4L2 buffer and DRM vblank timestamps.
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	double us = ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+
+	std::lock_guard<std::mutex> lock(json_mutex);
+	fprintf(json_file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d%s}", json_first ? "" : ",\n",
+			name, phase, us, pid, thread_id(), phase == 'i' ? ",\"s\":\"t\"" : "");
+	json_first = false;
+}
+
+// Make sure the JSON is complete however the program exits normally.
+struct Closer
+{
+	~Closer() { rpicam_trace::Close(); }
+} closer;
+
+} // namespace
+
+namespace rpicam_trace
+{
+
+void Open(std::string const &json_filename)
+{
+	Close();
+	pid = getpid();
+
+	for (char const *path : { "/sys/kernel/tracing/trace_marker", "/sys/kernel/debug/tracing/trace_marker" })
+	{
+		marker_fd = open(path, O_WRONLY | O_CLOEXEC);
+		if (marker_fd >= 0)
+		{
+			LOG(1, "Tracing to " << path);
+			enabled = true;
+			return;
+		}
+	}
+
+	json_file = fopen(json_filename.c_str(), "w");
+	if (!json_file)
+		throw std::runtime_error("failed to open trace file " + json_filename);
+	fprintf(json_file, "[\n");
+	json_first = true;
+	LOG(1, "tracefs not writable, tracing to " << json_filename);
+	enabled = true;
+}
+
+void Close()
+{
+	enabled = false;
+	if (marker_fd >= 0)
+	{
+		close(marker_fd);
+		marker_fd = -1;
+	}
+	if (json_file)
+	{
+		std::lock_guard<std::mutex> lock(json_mutex);
+		fprintf(json_file, "\n]\n");
+		fclose(json_file);
+		json_file = nullptr;
+	}
+}
+
+static void event(char phase, char const *name)
+{
+	if (marker_fd >= 0)
+		marker_event(phase, name);
+	else if (json_file)
+		json_event(phase, name);
+}
+
+void Begin(char const *name)
+{
+	event('B', name);
+}
+
+void End(char const *name)
+{
+	event('E', name);
+}
+
+void Instant(char const *name)
+{
+	event(marker_fd >= 0 ? 'I' : 'i', name);
+}
+
+} // namespace rpicam_trace
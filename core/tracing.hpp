@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * tracing.hpp - begin/end markers for ftrace or Chrome/Perfetto JSON traces.
+ */
+
+#pragma once
+
+#include <string>
+
+namespace rpicam_trace
+{
+// Everything checks this first, so tracing costs one well predicted branch when it's off.
+inline bool enabled = false;
+
+// Write markers to the kernel's trace_marker, so that they line up with scheduling, DRM and
+// V4L2 events in the same trace. If tracefs isn't writable, write a Chrome/Perfetto JSON
+// trace to json_file instead.
+void Open(std::string const &json_file);
+void Close();
+
+void Begin(char const *name);
+void End(char const *name);
+// A zero-length event, for things like flip completions.
+void Instant(char const *name);
+
+// Marks the lifetime of the object as one slice. The name must be a string literal.
+class Scope
+{
+public:
+	Scope(char const *name) : name_(enabled ? name : nullptr)
+	{
+		if (name_)
+			Begin(name_);
+	}
+	~Scope()
+	{
+		if (name_)
+			End(name_);
+	}
+
+private:
+	char const *name_;
+};
+} // namespace rpicam_trace
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) rpicam_trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_INSTANT(name)                                                                                            \
+	do                                                                                                                 \
+	{                                                                                                                  \
+		if (rpicam_trace::enabled)                                                                                     \
+			rpicam_trace::Instant(name);                                                                               \
+	} while (0)
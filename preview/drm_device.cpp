@@ -0,0 +1,135 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * drm_device.cpp - find and open a DRM device for the preview window.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
+
+#include <xf86drm.h>
+
+#include "core/logging.hpp"
+
+#include "drm_device.hpp"
+
+// Enough for any machine we know of; drmGetDevices2 just truncates the list beyond this.
+static constexpr int MAX_DRM_DEVICES = 64;
+
+std::string drm_connector_name(drmModeConnector const *connector)
+{
+	char const *type = drmModeGetConnectorTypeName(connector->connector_type);
+	return std::string(type ? type : "Unknown") + "-" + std::to_string(connector->connector_type_id);
+}
+
+std::vector<DrmDeviceInfo> drm_devices()
+{
+	std::vector<DrmDeviceInfo> result;
+	drmDevicePtr devices[MAX_DRM_DEVICES];
+	int num_devices = drmGetDevices2(0, devices, MAX_DRM_DEVICES);
+	if (num_devices < 0)
+		throw std::runtime_error("drmGetDevices2 failed: " + std::string(strerror(-num_devices)));
+
+	for (int i = 0; i < num_devices; i++)
+	{
+		if (!(devices[i]->available_nodes & (1 << DRM_NODE_PRIMARY)))
+			continue;
+
+		DrmDeviceInfo info;
+		info.node = devices[i]->nodes[DRM_NODE_PRIMARY];
+		if (devices[i]->available_nodes & (1 << DRM_NODE_RENDER))
+			info.render_node = devices[i]->nodes[DRM_NODE_RENDER];
+
+		int fd = open(info.node.c_str(), O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+		{
+			LOG(2, "DRM device " << info.node << ": cannot open: " << strerror(errno));
+			continue;
+		}
+
+		drmVersionPtr version = drmGetVersion(fd);
+		if (version)
+		{
+			info.driver = std::string(version->name, version->name_len);
+			drmFreeVersion(version);
+		}
+
+		// Render-only devices (such as v3d) also have a primary node, but no connectors.
+		drmModeRes *res = drmModeGetResources(fd);
+		if (res)
+		{
+			for (int j = 0; j < res->count_connectors; j++)
+			{
+				drmModeConnector *con = drmModeGetConnector(fd, res->connectors[j]);
+				if (!con)
+					continue;
+				if (con->connection == DRM_MODE_CONNECTED)
+					info.connectors.push_back(drm_connector_name(con));
+				drmModeFreeConnector(con);
+			}
+			drmModeFreeResources(res);
+		}
+		close(fd);
+
+		result.push_back(info);
+	}
+
+	drmFreeDevices(devices, num_devices);
+	return result;
+}
+
+int drm_open_device(std::string const &device, std::string const &connector, bool prefer_render)
+{
+	std::vector<DrmDeviceInfo> devices = drm_devices();
+	for (auto const &d : devices)
+	{
+		std::string connectors;
+		for (auto const &c : d.connectors)
+			connectors += " " + c;
+		LOG(2, "DRM device " << d.node << ": driver " << d.driver << (d.render_node.empty() ? "" : ", can render")
+							 << ", connected:" << (connectors.empty() ? " none" : connectors));
+	}
+
+	auto matches = [&device, &connector](DrmDeviceInfo const &d, bool need_render)
+	{
+		if (d.connectors.empty())
+			return false;
+		if (!connector.empty() &&
+			std::find(d.connectors.begin(), d.connectors.end(), connector) == d.connectors.end())
+			return false;
+		if (need_render && d.render_node.empty())
+			return false;
+		if (device.empty() || device == "render")
+			return true;
+		return device[0] == '/' ? d.node == device : d.driver == device;
+	};
+
+	bool need_render = device == "render";
+	auto it = devices.end();
+	if (prefer_render || need_render)
+		it = std::find_if(devices.begin(), devices.end(), [&](DrmDeviceInfo const &d) { return matches(d, true); });
+	if (it == devices.end() && !need_render)
+		it = std::find_if(devices.begin(), devices.end(), [&](DrmDeviceInfo const &d) { return matches(d, false); });
+	if (it == devices.end())
+		throw std::runtime_error("no DRM device found with a connected display matching device \"" + device +
+								 "\" and connector \"" + connector + "\"");
+
+	int fd = open(it->node.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error("failed to open " + it->node + ": " + std::string(strerror(errno)));
+	LOG(2, "Using DRM device " << it->node << " (" << it->driver << ")");
+
+	return fd;
+}
+
+int drm_share_device(int fd)
+{
+	int shared = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (shared < 0)
+		throw std::runtime_error("failed to share DRM device: " + std::string(strerror(errno)));
+	return shared;
+}
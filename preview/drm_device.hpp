@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * drm_device.hpp - find and open a DRM device for the preview window.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <xf86drmMode.h>
+
+struct DrmDeviceInfo
+{
+	std::string node; // the primary (KMS) node, e.g. /dev/dri/card1
+	std::string render_node; // empty when the device has no render node
+	std::string driver;
+	std::vector<std::string> connectors; // the connected connectors, e.g. HDMI-A-1
+};
+
+// Every device that has a primary node, in the order libdrm reports them.
+std::vector<DrmDeviceInfo> drm_devices();
+
+// The name the kernel uses for a connector, such as "HDMI-A-1" or "Virtual-1".
+std::string drm_connector_name(drmModeConnector const *connector);
+
+// Open the primary node of the device to display on. The device string may be
+// - empty, for the first device with something connected (preferring ones that can render, if asked),
+// - a device node path, such as /dev/dri/card1,
+// - "render", for the first device with something connected and a render node,
+// - or a driver name, such as vc4 or vkms.
+// A non-empty connector name further restricts the choice to the device that has it connected.
+int drm_open_device(std::string const &device, std::string const &connector, bool prefer_render = false);
+
+// Another file descriptor for a device that's already open. It shares the original's DRM master
+// status, so a second preview can drive the same display.
+int drm_share_device(int fd);
@@ -5,21 +5,43 @@
  * drm_preview.cpp - DRM-based preview window.
  */
 
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <poll.h>
+#include <sys/mman.h>
+
 #include <drm.h>
 #include <drm_fourcc.h>
 #include <drm_mode.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "core/duration_stats.hpp"
 #include "core/options.hpp"
+#include "core/tracing.hpp"
 
+#include "drm_device.hpp"
+#include "osd_font.hpp"
 #include "preview.hpp"
+#include "yuv_convert.hpp"
 
 class DrmPreview : public Preview
 {
 public:
-	DrmPreview(Options const *options);
+	DrmPreview(Options const *options, int drm_fd);
 	~DrmPreview();
+	// Show the text on an overlay plane above the camera image. The overlay is
+	// only redrawn when the text changes, and with atomic flips it goes in the
+	// next frame's commit.
+	virtual void SetInfoText(const std::string &text) override;
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override;
@@ -32,6 +54,17 @@ public:
 		w = max_image_width_;
 		h = max_image_height_;
 	}
+	virtual void DisplaySize(unsigned int &w, unsigned int &h) const override
+	{
+		w = width_;
+		h = height_;
+	}
+	virtual uint64_t MissedVblanks() const override { return flips_dropped_; }
+	virtual int EventFd() const override { return async_flip_ ? drmfd_ : -1; }
+	virtual void HandleEvents() override { handleFlipEvents(0); }
+	virtual void Hide() override;
+	virtual void Prepare(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override;
+	virtual int DrmFd() const override { return drmfd_; }
 
 private:
 	struct Buffer
@@ -43,14 +76,71 @@ private:
 		uint32_t bo_handle;
 		unsigned int fb_handle;
 	};
+	// A mapped dumb buffer, used for the info text overlay and for RGB conversion.
+	struct DumbBuffer
+	{
+		DumbBuffer() : bo_handle(0), fb_handle(0), pitch(0), size(0), mem(nullptr) {}
+		uint32_t bo_handle;
+		uint32_t fb_handle;
+		uint32_t pitch;
+		size_t size;
+		uint8_t *mem;
+	};
 	void makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer);
+	void destroyBuffer(Buffer &buffer);
+	Buffer &importBuffer(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info);
 	void findCrtc();
 	void findPlane();
+	void findOverlayPlane(std::vector<std::pair<uint32_t, bool>> const &candidates);
+	void makeDumbBuffer(unsigned int width, unsigned int height, uint32_t fourcc, DumbBuffer &buffer);
+	void destroyDumbBuffer(DumbBuffer &buffer);
+	void makeOverlayBuffers();
+	void destroyOverlayBuffers();
+	void renderOverlay(DumbBuffer &buffer, std::string const &text);
+	void hideOverlay();
+	void showRgb(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info);
+	void setupAsyncFlip();
+	void commitPlane(uint32_t fb_handle, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+					 unsigned int src_w, unsigned int src_h);
+	void handleFlipEvents(int timeout_ms);
+	static void flipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *data);
 	int drmfd_;
+	std::string connector_name_;
 	int conId_;
 	uint32_t crtcId_;
 	int crtcIdx_;
 	uint32_t planeId_;
+	uint32_t overlayPlaneId_;
+	DumbBuffer overlay_buffers_[2];
+	unsigned int overlay_back_;
+	unsigned int overlay_width_;
+	unsigned int overlay_height_;
+	unsigned int overlay_scale_;
+	std::string info_text_;
+	DurationStats overlay_stats_;
+	// Without a YUV420 plane we convert each frame into one of these instead.
+	bool rgb_fallback_;
+	DumbBuffer rgb_buffers_[2];
+	unsigned int rgb_back_;
+	// The image size last converted into each buffer, as the letterbox bars change with it.
+	std::pair<unsigned int, unsigned int> rgb_sizes_[2];
+	std::unique_ptr<YuvToRgb> yuv_to_rgb_;
+	YuvCoefficients yuv_coeffs_;
+	DurationStats rgb_stats_;
+	DurationStats flip_stats_;
+	// In the opt-in low latency mode, flips are non-blocking atomic commits that can tear if the
+	// driver allows, and a frame arriving while a flip is still pending is dropped, not queued.
+	bool async_flip_;
+	uint32_t async_flags_;
+	std::map<std::string, uint32_t> plane_props_;
+	// With atomic commits, a redrawn overlay goes on the screen in the next frame's commit.
+	std::map<std::string, uint32_t> overlay_props_;
+	uint32_t overlay_pending_fb_;
+	bool overlay_committed_;
+	uint32_t committed_geometry_[6];
+	bool flip_pending_;
+	int pending_fd_;
+	std::atomic<uint64_t> flips_dropped_;
 	unsigned int out_fourcc_;
 	unsigned int x_;
 	unsigned int y_;
@@ -67,6 +157,11 @@ private:
 
 #define ERRSTR strerror(errno)
 
+static constexpr unsigned int OVERLAY_MAX_LINES = 4;
+static constexpr uint32_t OVERLAY_FOREGROUND = 0xffffffff;
+// Pre-multiplied alpha, so this is a half-transparent black.
+static constexpr uint32_t OVERLAY_BACKGROUND = 0x80000000;
+
 void DrmPreview::findCrtc()
 {
 	int i;
@@ -85,7 +180,8 @@ void DrmPreview::findCrtc()
 
 	if (!conId_)
 	{
-		LOG(2, "No connector ID specified.  Choosing default from list:");
+		LOG(2, "No connector ID specified.  Choosing " << (connector_name_.empty() ? "default" : connector_name_)
+													   << " from list:");
 
 		for (i = 0; i < res->count_connectors; i++)
 		{
@@ -102,20 +198,21 @@ void DrmPreview::findCrtc()
 				}
 			}
 
-			if (!conId_ && crtc)
+			if (!conId_ && crtc && (connector_name_.empty() || drm_connector_name(con) == connector_name_))
 			{
 				conId_ = con->connector_id;
 				crtcId_ = crtc->crtc_id;
 			}
 
-			if (crtc)
+			// With more than one display, it's the size of the one we're using that matters.
+			if (crtc && conId_ == (int)con->connector_id)
 			{
 				screen_width_ = crtc->width;
 				screen_height_ = crtc->height;
 			}
 
-			LOG(2, "Connector " << con->connector_id << " (crtc " << (crtc ? crtc->crtc_id : 0) << "): type "
-								<< con->connector_type << ", " << (crtc ? crtc->width : 0) << "x"
+			LOG(2, "Connector " << con->connector_id << " (crtc " << (crtc ? crtc->crtc_id : 0) << "): "
+								<< drm_connector_name(con) << ", " << (crtc ? crtc->width : 0) << "x"
 								<< (crtc ? crtc->height : 0) << (conId_ == (int)con->connector_id ? " (chosen)" : ""));
 
 			if (con->encoder_id)
@@ -185,12 +282,60 @@ void DrmPreview::findCrtc()
 	drmModeFreeResources(res);
 }
 
+// Search the properties of a DRM object for the named one, returning its id, current value and range.
+struct DrmProperty
+{
+	DrmProperty() : id(0), value(0), min(0), max(0), immutable(true) {}
+	uint32_t id;
+	uint64_t value;
+	uint64_t min;
+	uint64_t max;
+	bool immutable;
+};
+
+static bool drm_get_property(int fd, uint32_t object_id, uint32_t object_type, char const *name, DrmProperty &result)
+{
+	drmModeObjectPropertiesPtr properties = drmModeObjectGetProperties(fd, object_id, object_type);
+	if (!properties)
+		return false;
+
+	bool found = false;
+	for (unsigned int i = 0; i < properties->count_props && !found; i++)
+	{
+		drmModePropertyPtr prop = drmModeGetProperty(fd, properties->props[i]);
+		if (!prop)
+			continue;
+
+		if (!strcmp(prop->name, name))
+		{
+			found = true;
+			result.id = prop->prop_id;
+			result.value = properties->prop_values[i];
+			result.immutable = prop->flags & DRM_MODE_PROP_IMMUTABLE;
+			if (drm_property_type_is(prop, DRM_MODE_PROP_RANGE) && prop->count_values == 2)
+			{
+				result.min = prop->values[0];
+				result.max = prop->values[1];
+			}
+		}
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(properties);
+	return found;
+}
+
 void DrmPreview::findPlane()
 {
 	drmModePlaneResPtr planes;
 	drmModePlanePtr plane;
 	unsigned int i;
 	unsigned int j;
+	// Planes that could carry the info text overlay, and whether each was listed after the video plane.
+	std::vector<std::pair<uint32_t, bool>> overlay_candidates;
+
+	planeId_ = 0;
+	overlayPlaneId_ = 0;
 
 	planes = drmModeGetPlaneResources(drmfd_);
 	if (!planes)
@@ -210,24 +355,30 @@ void DrmPreview::findPlane()
 				continue;
 			}
 
-			for (j = 0; j < plane->count_formats; ++j)
+			// With universal planes we also see cursor planes, which are no use to us.
+			DrmProperty type;
+			if (drm_get_property(drmfd_, plane->plane_id, DRM_MODE_OBJECT_PLANE, "type", type) &&
+				type.value == DRM_PLANE_TYPE_CURSOR)
 			{
-				if (plane->formats[j] == out_fourcc_)
-				{
-					break;
-				}
+				drmModeFreePlane(plane);
+				continue;
 			}
 
-			if (j == plane->count_formats)
+			bool has_video = false, has_argb = false;
+			for (j = 0; j < plane->count_formats; ++j)
 			{
-				drmModeFreePlane(plane);
-				continue;
+				if (plane->formats[j] == out_fourcc_)
+					has_video = true;
+				if (plane->formats[j] == DRM_FORMAT_ARGB8888)
+					has_argb = true;
 			}
 
-			planeId_ = plane->plane_id;
+			if (!planeId_ && has_video)
+				planeId_ = plane->plane_id;
+			else if (has_argb)
+				overlay_candidates.emplace_back(plane->plane_id, planeId_ != 0);
 
 			drmModeFreePlane(plane);
-			break;
 		}
 	}
 	catch (std::exception const &e)
@@ -237,16 +388,66 @@ void DrmPreview::findPlane()
 	}
 
 	drmModeFreePlaneResources(planes);
+
+	if (planeId_)
+		findOverlayPlane(overlay_candidates);
 }
 
-DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1), first_time_(true)
+// The overlay plane must be stacked above the video plane. Where the driver exposes "zpos" we
+// use it, moving a candidate plane up if its zpos is mutable. Without it we rely on the usual
+// convention that planes are stacked in the order they are listed.
+void DrmPreview::findOverlayPlane(std::vector<std::pair<uint32_t, bool>> const &candidates)
 {
-	drmfd_ = drmOpen("vc4", NULL);
-	if (drmfd_ < 0)
+	DrmProperty video_zpos;
+	bool have_zpos = drm_get_property(drmfd_, planeId_, DRM_MODE_OBJECT_PLANE, "zpos", video_zpos);
+	uint32_t settable = 0;
+
+	for (auto const &[plane_id, listed_after] : candidates)
+	{
+		DrmProperty zpos;
+		if (!have_zpos || !drm_get_property(drmfd_, plane_id, DRM_MODE_OBJECT_PLANE, "zpos", zpos))
+		{
+			if (listed_after)
+			{
+				overlayPlaneId_ = plane_id;
+				break;
+			}
+		}
+		else if (zpos.value > video_zpos.value)
+		{
+			overlayPlaneId_ = plane_id;
+			break;
+		}
+		else if (!settable && !zpos.immutable && zpos.max > video_zpos.value)
+			settable = plane_id;
+	}
+
+	if (!overlayPlaneId_ && settable)
 	{
-		throw std::runtime_error("drmOpen failed: " + std::string(ERRSTR));
+		DrmProperty zpos;
+		drm_get_property(drmfd_, settable, DRM_MODE_OBJECT_PLANE, "zpos", zpos);
+		if (drmModeObjectSetProperty(drmfd_, settable, DRM_MODE_OBJECT_PLANE, zpos.id, video_zpos.value + 1) == 0)
+			overlayPlaneId_ = settable;
+		else
+			LOG(1, "DrmPreview: failed to raise zpos of plane " << settable);
 	}
 
+	if (overlayPlaneId_)
+		LOG(2, "DrmPreview: using plane " << overlayPlaneId_ << " for info text, video on plane " << planeId_);
+	else
+		LOG(2, "DrmPreview: no ARGB plane above the video plane, info text unavailable");
+}
+
+DrmPreview::DrmPreview(Options const *options, int drm_fd)
+	: Preview(options), overlay_back_(0), overlay_stats_("DrmPreview overlay updates"), rgb_fallback_(false),
+	  rgb_back_(0), rgb_stats_("DrmPreview RGB conversions"),
+	  flip_stats_(options->async_flip ? "DrmPreview async plane flips" : "DrmPreview plane flips"),
+	  async_flip_(options->async_flip), async_flags_(0), overlay_pending_fb_(0), overlay_committed_(false),
+	  committed_geometry_(), flip_pending_(false), pending_fd_(-1), flips_dropped_(0), last_fd_(-1), first_time_(true)
+{
+	drmfd_ = drm_fd >= 0 ? drm_share_device(drm_fd) : drm_open_device(options->drm_device, options->drm_connector);
+	connector_name_ = options->drm_connector;
+
 	try
 	{
 		if (!drmIsMaster(drmfd_))
@@ -258,6 +459,24 @@ DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1),
 		findCrtc();
 		out_fourcc_ = DRM_FORMAT_YUV420;
 		findPlane();
+
+		// Many simpler KMS drivers have no YUV planes at all. Then we look again, including
+		// primary planes this time, for one that takes XRGB8888 and convert every frame.
+		if (!planeId_)
+		{
+			drmSetClientCap(drmfd_, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+			out_fourcc_ = DRM_FORMAT_XRGB8888;
+			findPlane();
+			if (!planeId_)
+				throw std::runtime_error("DrmPreview: no plane supports YUV420 or XRGB8888");
+			rgb_fallback_ = true;
+			yuv_to_rgb_ = std::make_unique<YuvToRgb>();
+			LOG(1, "DrmPreview: no YUV420 plane, converting to XRGB8888 with the " << yuv_to_rgb_->KernelName()
+					<< " kernel on " << yuv_to_rgb_->NumThreads() << " threads");
+		}
+
+		if (async_flip_)
+			setupAsyncFlip();
 	}
 	catch (std::exception const &e)
 	{
@@ -268,10 +487,27 @@ DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1),
 	x_ = y_ = 0;
 	width_ = screen_width_;
 	height_ = screen_height_;
+
+	// Scale the 8 pixel font up so that it stays legible on large screens.
+	overlay_scale_ = std::max(1u, height_ / 360);
+	overlay_width_ = width_;
+	overlay_height_ = (OVERLAY_MAX_LINES * OSD_FONT_HEIGHT + 4) * overlay_scale_;
 }
 
 DrmPreview::~DrmPreview()
 {
+	if (overlay_stats_.Count())
+		LOG(2, overlay_stats_.ToString());
+	if (rgb_stats_.Count())
+		LOG(2, rgb_stats_.ToString());
+	if (flip_stats_.Count())
+		LOG(2, flip_stats_.ToString());
+	if (async_flip_)
+		LOG(2, "DrmPreview: " << (async_flags_ ? "async" : "vsynced") << " non-blocking flips, " << flips_dropped_
+							  << " frames dropped while a flip was pending");
+	destroyOverlayBuffers();
+	for (DumbBuffer &buffer : rgb_buffers_)
+		destroyDumbBuffer(buffer);
 	close(drmfd_);
 }
 
@@ -353,8 +589,206 @@ static void setup_colour_space(int fd, int plane_id, std::optional<libcamera::Co
 	drm_set_property(fd, plane_id, "COLOR_RANGE", range);
 }
 
+// Expand a row of 1-bit pixels (most significant bit first) into ARGB pixels.
+static void blit_mask_row(uint8_t const *mask, unsigned int width, uint32_t fg, uint32_t bg, uint32_t *dst)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	static const uint32_t sel[8] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+	const uint32x4_t sel_lo = vld1q_u32(sel), sel_hi = vld1q_u32(sel + 4);
+	const uint32x4_t fg4 = vdupq_n_u32(fg), bg4 = vdupq_n_u32(bg);
+	for (; x + 8 <= width; x += 8)
+	{
+		const uint32x4_t bits = vdupq_n_u32(mask[x / 8]);
+		vst1q_u32(dst + x, vbslq_u32(vtstq_u32(bits, sel_lo), fg4, bg4));
+		vst1q_u32(dst + x + 4, vbslq_u32(vtstq_u32(bits, sel_hi), fg4, bg4));
+	}
+#elif defined(__SSE2__)
+	const __m128i sel_lo = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10), sel_hi = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+	const __m128i fg4 = _mm_set1_epi32(fg), bg4 = _mm_set1_epi32(bg);
+	for (; x + 8 <= width; x += 8)
+	{
+		const __m128i bits = _mm_set1_epi32(mask[x / 8]);
+		__m128i m = _mm_cmpeq_epi32(_mm_and_si128(bits, sel_lo), sel_lo);
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_or_si128(_mm_and_si128(m, fg4), _mm_andnot_si128(m, bg4)));
+		m = _mm_cmpeq_epi32(_mm_and_si128(bits, sel_hi), sel_hi);
+		_mm_storeu_si128((__m128i *)(dst + x + 4), _mm_or_si128(_mm_and_si128(m, fg4), _mm_andnot_si128(m, bg4)));
+	}
+#endif
+	for (; x < width; x++)
+		dst[x] = (mask[x / 8] & (0x80 >> (x % 8))) ? fg : bg;
+}
+
+static void set_mask_bits(std::vector<uint8_t> &mask, unsigned int start, unsigned int count)
+{
+	for (unsigned int x = start; x < start + count; x++)
+		mask[x / 8] |= 0x80 >> (x % 8);
+}
+
+void DrmPreview::makeDumbBuffer(unsigned int width, unsigned int height, uint32_t fourcc, DumbBuffer &buffer)
+{
+	drm_mode_create_dumb create = {};
+	create.width = width;
+	create.height = height;
+	create.bpp = 32;
+	if (drmIoctl(drmfd_, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0)
+		throw std::runtime_error("DRM_IOCTL_MODE_CREATE_DUMB failed: " + std::string(ERRSTR));
+	buffer.bo_handle = create.handle;
+	buffer.pitch = create.pitch;
+	buffer.size = create.size;
+
+	uint32_t offsets[4] = { 0 };
+	uint32_t pitches[4] = { buffer.pitch };
+	uint32_t bo_handles[4] = { buffer.bo_handle };
+	if (drmModeAddFB2(drmfd_, width, height, fourcc, bo_handles, pitches, offsets, &buffer.fb_handle, 0))
+		throw std::runtime_error("drmModeAddFB2 failed for dumb buffer: " + std::string(ERRSTR));
+
+	drm_mode_map_dumb map = {};
+	map.handle = buffer.bo_handle;
+	if (drmIoctl(drmfd_, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0)
+		throw std::runtime_error("DRM_IOCTL_MODE_MAP_DUMB failed: " + std::string(ERRSTR));
+	void *mem = mmap(NULL, buffer.size, PROT_READ | PROT_WRITE, MAP_SHARED, drmfd_, map.offset);
+	if (mem == MAP_FAILED)
+		throw std::runtime_error("failed to mmap dumb buffer: " + std::string(ERRSTR));
+	buffer.mem = static_cast<uint8_t *>(mem);
+}
+
+void DrmPreview::destroyDumbBuffer(DumbBuffer &buffer)
+{
+	if (buffer.mem)
+		munmap(buffer.mem, buffer.size);
+	if (buffer.fb_handle)
+		drmModeRmFB(drmfd_, buffer.fb_handle);
+	if (buffer.bo_handle)
+	{
+		drm_mode_destroy_dumb destroy = {};
+		destroy.handle = buffer.bo_handle;
+		drmIoctl(drmfd_, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	}
+	buffer = DumbBuffer();
+}
+
+void DrmPreview::makeOverlayBuffers()
+{
+	for (DumbBuffer &buffer : overlay_buffers_)
+		makeDumbBuffer(overlay_width_, overlay_height_, DRM_FORMAT_ARGB8888, buffer);
+}
+
+void DrmPreview::destroyOverlayBuffers()
+{
+	for (DumbBuffer &buffer : overlay_buffers_)
+		destroyDumbBuffer(buffer);
+}
+
+// Draw the text in the top left corner on a half-transparent box, leaving the rest of the
+// buffer fully transparent. Each glyph row is expanded once into a cached scratch row and
+// then copied out, as the dumb buffer mapping is often write-combined.
+void DrmPreview::renderOverlay(DumbBuffer &buffer, std::string const &text)
+{
+	const unsigned int scale = overlay_scale_, pad = 2 * scale;
+	const unsigned int cell_width = OSD_FONT_WIDTH * scale;
+	const unsigned int max_chars = (overlay_width_ - 2 * pad) / cell_width;
+
+	std::vector<std::string> lines;
+	std::stringstream ss(text);
+	for (std::string line; lines.size() < OVERLAY_MAX_LINES && std::getline(ss, line);)
+		lines.push_back(line.substr(0, max_chars));
+
+	unsigned int chars = 0;
+	for (auto const &line : lines)
+		chars = std::max<unsigned int>(chars, line.size());
+
+	memset(buffer.mem, 0, buffer.size);
+	if (!chars)
+		return;
+
+	const unsigned int box_width = chars * cell_width + 2 * pad;
+	const unsigned int box_height = lines.size() * OSD_FONT_HEIGHT * scale + 2 * pad;
+	std::vector<uint32_t> row(box_width, OVERLAY_BACKGROUND);
+	std::vector<uint8_t> mask((box_width + 7) / 8);
+
+	for (unsigned int y = 0; y < pad; y++)
+	{
+		memcpy(buffer.mem + y * buffer.pitch, row.data(), box_width * 4);
+		memcpy(buffer.mem + (box_height - 1 - y) * buffer.pitch, row.data(), box_width * 4);
+	}
+
+	for (unsigned int l = 0; l < lines.size(); l++)
+	{
+		for (unsigned int r = 0; r < OSD_FONT_HEIGHT; r++)
+		{
+			std::fill(mask.begin(), mask.end(), 0);
+			for (unsigned int c = 0; c < lines[l].size(); c++)
+			{
+				uint8_t bits = osd_glyph(lines[l][c])[r];
+				for (unsigned int x = 0; bits; x++, bits <<= 1)
+				{
+					if (bits & 0x80)
+						set_mask_bits(mask, pad + c * cell_width + x * scale, scale);
+				}
+			}
+			blit_mask_row(mask.data(), box_width, OVERLAY_FOREGROUND, OVERLAY_BACKGROUND, row.data());
+
+			unsigned int y = pad + (l * OSD_FONT_HEIGHT + r) * scale;
+			for (unsigned int s = 0; s < scale; s++)
+				memcpy(buffer.mem + (y + s) * buffer.pitch, row.data(), box_width * 4);
+		}
+	}
+}
+
+void DrmPreview::SetInfoText(const std::string &text)
+{
+	if (!overlayPlaneId_ || text == info_text_)
+		return;
+
+	auto start = DurationStats::Clock::now();
+	if (async_flip_)
+	{
+		// The buffer we'd draw into may be in a flip that hasn't landed yet. The frame will be
+		// dropped anyway, so leave the text for the next one.
+		handleFlipEvents(0);
+		if (flip_pending_)
+			return;
+	}
+
+	try
+	{
+		if (!overlay_buffers_[0].mem)
+			makeOverlayBuffers();
+
+		DumbBuffer &buffer = overlay_buffers_[overlay_back_];
+		renderOverlay(buffer, text);
+		if (async_flip_)
+			overlay_pending_fb_ = buffer.fb_handle;
+		else if (drmModeSetPlane(drmfd_, overlayPlaneId_, crtcId_, buffer.fb_handle, 0, x_, y_, overlay_width_,
+								 overlay_height_, 0, 0, overlay_width_ << 16, overlay_height_ << 16))
+		{
+			// Another commit on the CRTC is still in progress, so try again with the next frame.
+			if (errno == EBUSY)
+				return;
+			throw std::runtime_error("drmModeSetPlane failed for overlay: " + std::string(ERRSTR));
+		}
+	}
+	catch (std::exception const &e)
+	{
+		// The info text is a nicety, so don't let it stop the preview.
+		LOG(1, "DrmPreview: disabling info text - " << e.what());
+		destroyOverlayBuffers();
+		overlayPlaneId_ = 0;
+		return;
+	}
+
+	// An atomic commit swaps the overlay buffers once it has taken this one.
+	if (!async_flip_)
+		overlay_back_ ^= 1;
+	info_text_ = text;
+	overlay_stats_.Add(start);
+}
+
 void DrmPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer)
 {
+	TRACE_SCOPE("DrmPreview::makeBuffer");
+
 	if (first_time_)
 	{
 		first_time_ = false;
@@ -378,11 +812,66 @@ void DrmPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer
 		throw std::runtime_error("drmModeAddFB2 failed: " + std::string(ERRSTR));
 }
 
-void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
+void DrmPreview::destroyBuffer(Buffer &buffer)
+{
+	drmModeRmFB(drmfd_, buffer.fb_handle);
+	// Apparently a "bo_handle" is a "gem" thing, and it needs closing. It feels like there
+	// ought be an API to match "drmPrimeFDToHandle" for this, but I can only find an ioctl.
+	drm_gem_close gem_close = {};
+	gem_close.handle = buffer.bo_handle;
+	if (drmIoctl(drmfd_, DRM_IOCTL_GEM_CLOSE, &gem_close) < 0)
+		// I have no idea what this would mean, so complain and try to carry on...
+		LOG(1, "DRM_IOCTL_GEM_CLOSE failed");
+	buffer = Buffer();
+}
+
+DrmPreview::Buffer &DrmPreview::importBuffer(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
 {
 	Buffer &buffer = buffers_[fd];
+	// After the camera is reconfigured, the same buffers may come back holding a different format.
+	if (buffer.fd != -1 && !buffer.info.SameLayout(info))
+		destroyBuffer(buffer);
 	if (buffer.fd == -1)
 		makeBuffer(fd, span.size(), info, buffer);
+	return buffer;
+}
+
+void DrmPreview::Prepare(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
+{
+	// Converted frames have nothing to import.
+	if (!rgb_fallback_)
+		importBuffer(fd, span, info);
+}
+
+// Convert the frame into the back buffer, letterboxed as the YUV plane would be, and then
+// flip to it. The camera buffer isn't needed once it's converted so goes straight back.
+void DrmPreview::showRgb(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
+{
+	auto start = DurationStats::Clock::now();
+
+	// Don't convert a frame only to drop it because the back buffer is still on its way to the screen.
+	if (async_flip_)
+	{
+		handleFlipEvents(0);
+		if (flip_pending_)
+		{
+			flips_dropped_++;
+			done_callback_(fd);
+			return;
+		}
+	}
+
+	if (first_time_)
+	{
+		first_time_ = false;
+		yuv_coeffs_ = yuv_coefficients(info.colour_space);
+		for (DumbBuffer &buffer : rgb_buffers_)
+		{
+			if (!buffer.mem)
+				makeDumbBuffer(width_, height_, DRM_FORMAT_XRGB8888, buffer);
+		}
+		rgb_sizes_[0] = rgb_sizes_[1] = {};
+	}
 
 	unsigned int x_off = 0, y_off = 0;
 	unsigned int w = width_, h = height_;
@@ -391,9 +880,207 @@ void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 	else
 		w = height_ * info.width / info.height, x_off = (width_ - w) / 2;
 
-	if (drmModeSetPlane(drmfd_, planeId_, crtcId_, buffer.fb_handle, 0, x_off + x_, y_off + y_, w, h, 0, 0,
-						buffer.info.width << 16, buffer.info.height << 16))
+	DumbBuffer &buffer = rgb_buffers_[rgb_back_];
+	// After a change of size (or aspect ratio), the old image would show in the bars.
+	if (rgb_sizes_[rgb_back_] != std::make_pair(info.width, info.height))
+	{
+		memset(buffer.mem, 0, buffer.size);
+		rgb_sizes_[rgb_back_] = { info.width, info.height };
+	}
+	yuv_to_rgb_->Convert(span.data(), info.width, info.height, info.stride, yuv_coeffs_,
+						 buffer.mem + y_off * buffer.pitch + x_off * 4, w, h, buffer.pitch);
+	done_callback_(fd);
+
+	if (async_flip_)
+		commitPlane(buffer.fb_handle, x_, y_, width_, height_, width_, height_);
+	else if (drmModeSetPlane(drmfd_, planeId_, crtcId_, buffer.fb_handle, 0, x_, y_, width_, height_, 0, 0,
+							 width_ << 16, height_ << 16))
 		throw std::runtime_error("drmModeSetPlane failed: " + std::string(ERRSTR));
+	rgb_back_ ^= 1;
+	rgb_stats_.Add(start);
+}
+
+// Atomic commits are needed for non-blocking flips. Drivers often refuse async (tearing) flips
+// on anything but the primary plane, in which case we find out on the first commit.
+void DrmPreview::setupAsyncFlip()
+{
+	if (drmSetClientCap(drmfd_, DRM_CLIENT_CAP_ATOMIC, 1))
+	{
+		LOG(1, "DrmPreview: no atomic modesetting, async flips unavailable");
+		async_flip_ = false;
+		return;
+	}
+
+	uint64_t cap = 0;
+	if (drmGetCap(drmfd_, DRM_CAP_ASYNC_PAGE_FLIP, &cap) == 0 && cap)
+		async_flags_ = DRM_MODE_PAGE_FLIP_ASYNC;
+	else
+		LOG(1, "DrmPreview: driver has no async page flips, flips will still wait for vblank");
+
+	for (char const *name : { "FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H", "CRTC_X", "CRTC_Y", "CRTC_W",
+							  "CRTC_H" })
+	{
+		DrmProperty prop;
+		if (!drm_get_property(drmfd_, planeId_, DRM_MODE_OBJECT_PLANE, name, prop))
+			throw std::runtime_error("DrmPreview: plane " + std::to_string(planeId_) + " has no " + name);
+		plane_props_[name] = prop.id;
+		if (overlayPlaneId_ && drm_get_property(drmfd_, overlayPlaneId_, DRM_MODE_OBJECT_PLANE, name, prop))
+			overlay_props_[name] = prop.id;
+	}
+	if (overlayPlaneId_ && overlay_props_.size() != plane_props_.size())
+	{
+		LOG(1, "DrmPreview: overlay plane " << overlayPlaneId_ << " can't be set atomically, no info text");
+		overlayPlaneId_ = 0;
+	}
+}
+
+// Async commits may only change the framebuffer, so the geometry goes in a normal non-blocking
+// commit whenever it changes.
+void DrmPreview::commitPlane(uint32_t fb_handle, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+							 unsigned int src_w, unsigned int src_h)
+{
+	TRACE_SCOPE("DrmPreview flip");
+	const uint32_t geometry[6] = { x, y, w, h, src_w, src_h };
+	bool same_geometry = std::equal(std::begin(geometry), std::end(geometry), std::begin(committed_geometry_));
+
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	drmModeAtomicAddProperty(req, planeId_, plane_props_["FB_ID"], fb_handle);
+	if (!same_geometry)
+	{
+		drmModeAtomicAddProperty(req, planeId_, plane_props_["CRTC_ID"], crtcId_);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_["SRC_X"], 0);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_["SRC_Y"], 0);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_["SRC_W"], src_w << 16);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_["SRC_H"], src_h << 16);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_["CRTC_X"], x);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_["CRTC_Y"], y);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_["CRTC_W"], w);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_["CRTC_H"], h);
+	}
+
+	// New info text rides along with the frame rather than costing a commit of its own.
+	int overlay_cursor = drmModeAtomicGetCursor(req);
+	bool overlay = overlay_pending_fb_ != 0;
+	if (overlay)
+	{
+		drmModeAtomicAddProperty(req, overlayPlaneId_, overlay_props_["FB_ID"], overlay_pending_fb_);
+		if (!overlay_committed_)
+		{
+			drmModeAtomicAddProperty(req, overlayPlaneId_, overlay_props_["CRTC_ID"], crtcId_);
+			drmModeAtomicAddProperty(req, overlayPlaneId_, overlay_props_["SRC_X"], 0);
+			drmModeAtomicAddProperty(req, overlayPlaneId_, overlay_props_["SRC_Y"], 0);
+			drmModeAtomicAddProperty(req, overlayPlaneId_, overlay_props_["SRC_W"], overlay_width_ << 16);
+			drmModeAtomicAddProperty(req, overlayPlaneId_, overlay_props_["SRC_H"], overlay_height_ << 16);
+			drmModeAtomicAddProperty(req, overlayPlaneId_, overlay_props_["CRTC_X"], x_);
+			drmModeAtomicAddProperty(req, overlayPlaneId_, overlay_props_["CRTC_Y"], y_);
+			drmModeAtomicAddProperty(req, overlayPlaneId_, overlay_props_["CRTC_W"], overlay_width_);
+			drmModeAtomicAddProperty(req, overlayPlaneId_, overlay_props_["CRTC_H"], overlay_height_);
+		}
+	}
+
+	// Async flips can only change the one plane's framebuffer.
+	bool async = same_geometry && !overlay;
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+	int ret = drmModeAtomicCommit(drmfd_, req, flags | (async ? async_flags_ : 0), this);
+	if (ret == -EINVAL && async && async_flags_)
+	{
+		LOG(1, "DrmPreview: plane " << planeId_ << " refuses async flips, flips will wait for vblank");
+		async_flags_ = 0;
+		ret = drmModeAtomicCommit(drmfd_, req, flags, this);
+	}
+	if (ret == -EINVAL && overlay)
+	{
+		// Show the frame without the text. If the overlay never made it to the screen, it isn't
+		// going to, otherwise the text is simply drawn again for the next frame.
+		LOG(1, "DrmPreview: overlay plane " << overlayPlaneId_ << " refused in atomic commit");
+		drmModeAtomicSetCursor(req, overlay_cursor);
+		overlay = false;
+		overlay_pending_fb_ = 0;
+		info_text_.clear();
+		if (!overlay_committed_)
+			overlayPlaneId_ = 0;
+		ret = drmModeAtomicCommit(drmfd_, req, flags | (same_geometry ? async_flags_ : 0), this);
+	}
+	drmModeAtomicFree(req);
+	if (ret)
+		throw std::runtime_error("drmModeAtomicCommit failed: " + std::string(strerror(-ret)));
+
+	std::copy(std::begin(geometry), std::end(geometry), committed_geometry_);
+	flip_pending_ = true;
+	if (overlay)
+	{
+		overlay_back_ ^= 1;
+		overlay_pending_fb_ = 0;
+		overlay_committed_ = true;
+	}
+}
+
+void DrmPreview::flipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *data)
+{
+	DrmPreview *preview = static_cast<DrmPreview *>(data);
+	TRACE_INSTANT("DrmPreview flip done");
+	preview->flip_pending_ = false;
+	// The previous frame is off the screen now, so can go back.
+	if (preview->last_fd_ >= 0)
+		preview->done_callback_(preview->last_fd_);
+	preview->last_fd_ = preview->pending_fd_;
+	preview->pending_fd_ = -1;
+}
+
+void DrmPreview::handleFlipEvents(int timeout_ms)
+{
+	pollfd pfd = { drmfd_, POLLIN, 0 };
+	while (flip_pending_ && poll(&pfd, 1, timeout_ms) > 0)
+	{
+		drmEventContext ctx = {};
+		ctx.version = 2;
+		ctx.page_flip_handler = flipHandler;
+		drmHandleEvent(drmfd_, &ctx);
+	}
+}
+
+void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
+{
+	TRACE_SCOPE("DrmPreview::Show");
+
+	if (rgb_fallback_)
+	{
+		showRgb(fd, span, info);
+		return;
+	}
+
+	Buffer &buffer = importBuffer(fd, span, info);
+
+	unsigned int x_off = 0, y_off = 0;
+	unsigned int w = width_, h = height_;
+	if (info.width * height_ > width_ * info.height)
+		h = width_ * info.height / info.width, y_off = (height_ - h) / 2;
+	else
+		w = height_ * info.width / info.height, x_off = (width_ - w) / 2;
+
+	auto flip_start = DurationStats::Clock::now();
+	if (async_flip_)
+	{
+		handleFlipEvents(0);
+		if (flip_pending_)
+		{
+			flips_dropped_++;
+			done_callback_(fd);
+			return;
+		}
+		commitPlane(buffer.fb_handle, x_off + x_, y_off + y_, w, h, buffer.info.width, buffer.info.height);
+		pending_fd_ = fd;
+		flip_stats_.Add(flip_start);
+		return;
+	}
+
+	{
+		TRACE_SCOPE("DrmPreview flip");
+		if (drmModeSetPlane(drmfd_, planeId_, crtcId_, buffer.fb_handle, 0, x_off + x_, y_off + y_, w, h, 0, 0,
+							buffer.info.width << 16, buffer.info.height << 16))
+			throw std::runtime_error("drmModeSetPlane failed: " + std::string(ERRSTR));
+	}
+	flip_stats_.Add(flip_start);
 	if (last_fd_ >= 0)
 		done_callback_(last_fd_);
 	last_fd_ = fd;
@@ -401,23 +1088,50 @@ void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 
 void DrmPreview::Reset()
 {
+	// Let any flip in progress finish before its framebuffer goes away.
+	if (flip_pending_)
+		handleFlipEvents(100);
+	flip_pending_ = false;
+	pending_fd_ = -1;
+
 	for (auto &it : buffers_)
-	{
-		drmModeRmFB(drmfd_, it.second.fb_handle);
-		// Apparently a "bo_handle" is a "gem" thing, and it needs closing. It feels like there
-		// ought be an API to match "drmPrimeFDToHandle" for this, but I can only find an ioctl.
-		drm_gem_close gem_close = {};
-		gem_close.handle = it.second.bo_handle;
-		if (drmIoctl(drmfd_, DRM_IOCTL_GEM_CLOSE, &gem_close) < 0)
-			// I have no idea what this would mean, so complain and try to carry on...
-			LOG(1, "DRM_IOCTL_GEM_CLOSE failed");
-	}
+		destroyBuffer(it.second);
 	buffers_.clear();
 	last_fd_ = -1;
 	first_time_ = true;
+
+	hideOverlay();
+}
+
+void DrmPreview::hideOverlay()
+{
+	if (overlayPlaneId_ && (!info_text_.empty() || overlay_committed_))
+		drmModeSetPlane(drmfd_, overlayPlaneId_, crtcId_, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	info_text_.clear();
+	overlay_pending_fb_ = 0;
+	overlay_committed_ = false;
+}
+
+void DrmPreview::Hide()
+{
+	// Let any flip in progress land first, so that its buffer is handed back with the rest.
+	if (flip_pending_)
+		handleFlipEvents(100);
+	if (pending_fd_ >= 0)
+		done_callback_(pending_fd_);
+	flip_pending_ = false;
+	pending_fd_ = -1;
+
+	drmModeSetPlane(drmfd_, planeId_, crtcId_, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	// The next atomic commit has to set the whole plane up again, and the text is drawn afresh.
+	std::fill(std::begin(committed_geometry_), std::end(committed_geometry_), 0);
+	hideOverlay();
+	if (last_fd_ >= 0)
+		done_callback_(last_fd_);
+	last_fd_ = -1;
 }
 
-Preview *make_drm_preview(Options const *options)
+Preview *make_drm_preview(Options const *options, int drm_fd)
 {
-	return new DrmPreview(options);
+	return new DrmPreview(options, drm_fd);
 }
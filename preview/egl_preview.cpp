@@ -5,14 +5,25 @@
  * egl_preview.cpp - X/EGL-based preview window.
  */
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <map>
+#include <poll.h>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 // Include libcamera stuff before X11, as X11 #defines both Status and None
 // which upsets the libcamera headers.
 
+#include "core/duration_stats.hpp"
 #include "core/options.hpp"
+#include "core/tracing.hpp"
 
+#include "drm_device.hpp"
+#include "osd_font.hpp"
 #include "preview.hpp"
 
 #include <libdrm/drm_fourcc.h>
@@ -30,9 +41,15 @@
 class EglPreview : public Preview
 {
 public:
-	EglPreview(Options const *options);
+	EglPreview(Options const *options, int drm_fd);
 	~EglPreview();
 
+	// Draw the text over the camera image, in the same pass. The vertices are only
+	// rebuilt when the text changes.
+	virtual void SetInfoText(const std::string &text) override;
+	// Switch to another of the precompiled analysis shaders.
+	virtual void SetAnalysisOverlay(AnalysisOverlay overlay) override;
+
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override;
@@ -47,23 +64,70 @@ public:
 		w = max_image_width_;
 		h = max_image_height_;
 	}
+	virtual void DisplaySize(unsigned int &w, unsigned int &h) const override
+	{
+		w = mode.hdisplay;
+		h = mode.vdisplay;
+	}
+	virtual int EventFd() const override { return async_flip_ && !offscreen_ ? device : -1; }
+	virtual void HandleEvents() override { waitForFlip(0); }
+	virtual void Hide() override;
+	virtual void Prepare(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override;
+	virtual int DrmFd() const override { return offscreen_ ? -1 : device; }
 
 private:
 	struct Buffer
 	{
-		Buffer() : fd(-1) {}
+		Buffer() : fd(-1), texture(0), plane_textures() {}
 		int fd;
 		size_t size;
 		StreamInfo info;
 		GLuint texture;
+		GLuint plane_textures[3]; // when each plane is imported on its own
+	};
+
+	// The camera image is sampled either from an imported dma-buf as one external texture, or from
+	// three planar textures that we fill ourselves.
+	enum Sampler
+	{
+		EXTERNAL_SAMPLER,
+		PLANAR_SAMPLER,
+		NUM_SAMPLERS
+	};
+
+	// One ring slot of the texture upload path: a pixel unpack buffer holding a whole frame,
+	// the Y, U and V textures it's copied into, and a fence for when the GPU is done with them.
+	struct UploadSlot
+	{
+		GLuint pbo;
+		GLuint textures[3];
+		GLsync fence;
+		uint8_t *mem; // when persistently mapped
 	};
 
-	void makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer);
-	drmModeConnector *getConnector(drmModeRes *resources);
+	bool makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer);
+	void destroyBuffer(Buffer &buffer);
+	void setupGl(StreamInfo const &info);
+	void importBuffer(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info);
+	void setPlanarUniforms(StreamInfo const &info, float crop);
+	void makeUploadSlots(StreamInfo const &info);
+	void destroyUploadSlots();
+	void uploadFrame(libcamera::Span<uint8_t> span, StreamInfo const &info);
+	void kmsSetup(Options const *options, int drm_fd);
+	void offscreenSetup(Options const *options);
+	drmModeConnector *getConnector(drmModeRes *resources, std::string const &name);
 	drmModeEncoder *findEncoder(drmModeConnector *connector);
 	void gbmClean();
 	void gl_setup(int width, int height);
-	void gbmSwapBuffers();
+	void gl_cleanup();
+	void updateInfoText();
+	void gbmSwapBuffers(EGLint *rects, EGLint num_rects);
+	int bufferAge();
+	void beginGpuTimer();
+	void endGpuTimer();
+	void offscreenSwapBuffers();
+	void waitForFlip(int timeout_ms);
+	static void flipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *data);
 
 	EGLDisplay egl_display_;
 	EGLContext egl_context_;
@@ -71,6 +135,66 @@ private:
 	std::map<int, Buffer> buffers_; // map the DMABUF's fd to the Buffer
 	int last_fd_;
 	bool first_time_;
+	// The format gl_setup() was last given, which the programs and geometry depend on.
+	StreamInfo setup_info_;
+	// One camera program for each analysis overlay, and the location of its "pos" attribute.
+	GLint programs_[NUM_SAMPLERS][static_cast<int>(AnalysisOverlay::Count)];
+	GLint program_pos_[NUM_SAMPLERS][static_cast<int>(AnalysisOverlay::Count)];
+	AnalysisOverlay analysis_overlay_;
+	GLuint quad_vbo_;
+	// Only the camera image and the text change from frame to frame, so the letterbox bars are
+	// cleared only when the geometry changes, and the swap is told what was damaged. Rectangles
+	// are x, y, width, height from the bottom left, as EGL wants them.
+	EGLint image_rect_[4];
+	EGLint text_rect_[4]; // everywhere the text has been since the geometry last changed
+	uint64_t frame_count_;
+	uint64_t geometry_frame_;
+	bool buffer_age_;
+	bool partial_update_;
+	bool swap_with_damage_;
+	// The GPU time for each frame, from timer queries where the driver has them.
+	bool gpu_timers_;
+	GLuint gpu_queries_[4];
+	bool gpu_query_pending_[4];
+	bool gpu_query_active_;
+	DurationStats gpu_stats_;
+	// The info text is drawn from a glyph atlas texture.
+	GLint text_program_;
+	GLint text_pos_;
+	GLint text_uv_;
+	GLuint text_atlas_;
+	GLuint text_vbo_;
+	GLsizei text_vertex_count_;
+	std::string info_text_;
+	bool info_text_dirty_;
+	DurationStats info_text_stats_;
+	DurationStats draw_stats_;
+	DurationStats swap_stats_;
+	// Without a display we draw alternately into two framebuffer objects, and wait for
+	// the vsyncs of a pretend display running at offscreen_refresh_ Hz.
+	bool offscreen_;
+	unsigned int offscreen_refresh_;
+	GLuint offscreen_fbos_[2];
+	GLuint offscreen_textures_[2];
+	unsigned int offscreen_back_;
+	DurationStats::Clock::time_point next_vsync_;
+	DurationStats vsync_stats_;
+	// When dma-buf import isn't possible (or we're told not to), frames are copied through a ring
+	// of upload slots instead, so that the copy of one frame overlaps the drawing of the last.
+	// Import the Y, U and V planes as separate single channel images, and convert them ourselves.
+	bool planes_;
+	bool upload_;
+	bool upload_forced_;
+	bool allow_upload_;
+	std::vector<UploadSlot> upload_slots_;
+	unsigned int upload_slot_;
+	size_t upload_size_;
+	bool upload_pbo_;
+	bool upload_persistent_;
+	uint64_t upload_bytes_;
+	DurationStats upload_stats_;
+	DurationStats import_stats_;
+	std::string renderer_;
 	// size of preview window
 	int x_;
 	int y_;
@@ -79,17 +203,25 @@ private:
 	unsigned int max_image_width_;
 	unsigned int max_image_height_;
 
-	int device;
+	int device = -1;
 	uint32_t connectorId;
-	drmModeModeInfo mode;
-	gbm_device *gbmDevice;
-	gbm_surface *gbmSurface;
-	drmModeCrtc *crtc;
-	drmModeRes *resources;
-	drmModeConnector *connector;
-	drmModeEncoder *encoder;
+	drmModeModeInfo mode = {};
+	gbm_device *gbmDevice = nullptr;
+	gbm_surface *gbmSurface = nullptr;
+	drmModeCrtc *crtc = nullptr;
+	drmModeRes *resources = nullptr;
+	drmModeConnector *connector = nullptr;
+	drmModeEncoder *encoder = nullptr;
 	gbm_bo *previousBo = nullptr;
 	uint32_t previousFb;
+	// With async flips, the first frame sets the mode and the rest are page flips that don't wait
+	// for vblank, if the driver allows. The buffer being flipped to is released on the next flip.
+	bool async_flip_;
+	uint32_t async_flags_;
+	bool mode_set_ = false;
+	bool flip_pending_ = false;
+	gbm_bo *pendingBo = nullptr;
+	uint32_t pendingFb;
 };
 
 // Get the EGL error back as a string. Useful for debugging.
@@ -146,6 +278,100 @@ static const std::string eglGetErrorStr()
     return "Unknown error!";
 }
 
+static constexpr unsigned int ATLAS_COLUMNS = 16;
+static constexpr unsigned int ATLAS_ROWS = (OSD_FONT_LAST - OSD_FONT_FIRST + ATLAS_COLUMNS) / ATLAS_COLUMNS;
+static constexpr unsigned int INFO_TEXT_MAX_LINES = 4;
+
+static constexpr unsigned int UPLOAD_SLOTS = 3;
+// Texture units for the Y, U and V planes; unit 1 has the glyph atlas.
+static const GLint plane_units[3] = { 0, 2, 3 };
+
+// The headers give the analysis shaders a camera() function that returns the RGB image, in
+// the order of EglPreview::Sampler.
+static const char *const fs_headers[] = {
+	"#version 100\n"
+	"#extension GL_OES_EGL_image_external : enable\n"
+	"precision mediump float;\n"
+	"uniform samplerExternalOES s;\n"
+	"vec4 camera(vec2 t) { return texture2D(s, t); }\n",
+	// Planar YUV, converted with a matrix for the colour space. crop hides any padding at the
+	// right of the planes.
+	"#version 100\n"
+	"precision mediump float;\n"
+	"uniform sampler2D s_y;\n"
+	"uniform sampler2D s_u;\n"
+	"uniform sampler2D s_v;\n"
+	"uniform float crop;\n"
+	"uniform vec3 yuv_offset;\n"
+	"uniform mat3 yuv_matrix;\n"
+	"vec4 camera(vec2 t) {\n"
+	"  t.x *= crop;\n"
+	"  vec3 yuv = vec3(texture2D(s_y, t).r, texture2D(s_u, t).r, texture2D(s_v, t).r);\n"
+	"  return vec4(yuv_matrix * (yuv - yuv_offset), 1.0);\n"
+	"}\n",
+};
+
+static const char fs_common[] =
+	"uniform vec2 texel;\n"
+	"varying vec2 texcoord;\n"
+	"float luma(vec4 c) { return dot(c.rgb, vec3(0.299, 0.587, 0.114)); }\n";
+
+// The fragment shader body for each analysis overlay, in the order of Preview::AnalysisOverlay.
+static const char *const analysis_shaders[] = {
+	// None
+	"void main() {\n"
+	"  gl_FragColor = camera(texcoord);\n"
+	"}\n",
+	// Focus peaking: paint pixels where the Laplacian of the luma is large.
+	"void main() {\n"
+	"  vec4 c = camera(texcoord);\n"
+	"  float lap = 4.0 * luma(c) - luma(camera(texcoord + vec2(texel.x, 0.0)))\n"
+	"    - luma(camera(texcoord - vec2(texel.x, 0.0))) - luma(camera(texcoord + vec2(0.0, texel.y)))\n"
+	"    - luma(camera(texcoord - vec2(0.0, texel.y)));\n"
+	"  gl_FragColor = abs(lap) > 0.12 ? vec4(1.0, 0.0, 0.0, 1.0) : c;\n"
+	"}\n",
+	// Zebra stripes over anything close to clipping.
+	"void main() {\n"
+	"  vec4 c = camera(texcoord);\n"
+	"  bool stripe = mod(gl_FragCoord.x + gl_FragCoord.y, 16.0) < 8.0;\n"
+	"  gl_FragColor = luma(c) > 0.95 && stripe ? vec4(0.0, 0.0, 0.0, 1.0) : c;\n"
+	"}\n",
+	// False colour: crushed blacks purple, shadows blue, mid grey green, highlights yellow, clipping red.
+	"void main() {\n"
+	"  float l = luma(camera(texcoord));\n"
+	"  vec3 c = vec3(l);\n"
+	"  if (l < 0.02) c = vec3(0.5, 0.0, 0.5);\n"
+	"  else if (l < 0.10) c = vec3(0.0, 0.0, 1.0);\n"
+	"  else if (l > 0.42 && l < 0.48) c = vec3(0.0, 1.0, 0.0);\n"
+	"  else if (l > 0.97) c = vec3(1.0, 0.0, 0.0);\n"
+	"  else if (l > 0.90) c = vec3(1.0, 1.0, 0.0);\n"
+	"  gl_FragColor = vec4(c, 1.0);\n"
+	"}\n",
+};
+static_assert(sizeof(analysis_shaders) / sizeof(analysis_shaders[0]) ==
+				  static_cast<size_t>(Preview::AnalysisOverlay::Count),
+			  "missing analysis overlay shader");
+
+// Info text quads are drawn over the camera image with a half-transparent background in each cell.
+static const char text_vs_source[] =
+	"#version 100\n"
+	"attribute vec2 pos;\n"
+	"attribute vec2 uv;\n"
+	"varying vec2 texcoord;\n"
+	"void main() {\n"
+	"  gl_Position = vec4(pos, 0.0, 1.0);\n"
+	"  texcoord = uv;\n"
+	"}\n";
+
+static const char text_fs_source[] =
+	"#version 100\n"
+	"precision mediump float;\n"
+	"uniform sampler2D atlas;\n"
+	"varying vec2 texcoord;\n"
+	"void main() {\n"
+	"  gl_FragColor = mix(vec4(0.0, 0.0, 0.0, 0.5), vec4(1.0), texture2D(atlas, texcoord).a);\n"
+	"}\n";
+
 static GLint compile_shader(GLenum target, const char *source)
 {
 	GLuint s = glCreateShader(target);
@@ -209,6 +435,26 @@ void EglPreview::gl_setup(int width, int height)
 	// auto makeCurrentResult = eglMakeCurrent(egl_display_, egl_surface_, egl_surface_, egl_context_);
 	// std::cout<<makeCurrentResult<<"\n";
 	// Set GL Viewport size, always needed!
+	if (offscreen_)
+	{
+		glGenTextures(2, offscreen_textures_);
+		glGenFramebuffers(2, offscreen_fbos_);
+		for (int i = 0; i < 2; i++)
+		{
+			glBindTexture(GL_TEXTURE_2D, offscreen_textures_[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, desiredWidth, desiredHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+			glBindFramebuffer(GL_FRAMEBUFFER, offscreen_fbos_[i]);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, offscreen_textures_[i], 0);
+			if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+				throw std::runtime_error("EglPreview: offscreen framebuffer incomplete");
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		offscreen_back_ = 0;
+		glBindFramebuffer(GL_FRAMEBUFFER, offscreen_fbos_[offscreen_back_]);
+		if (offscreen_refresh_)
+			next_vsync_ = DurationStats::Clock::now() + std::chrono::nanoseconds(1000000000 / offscreen_refresh_);
+	}
+
 	glViewport(0, 0, desiredWidth, desiredHeight);
 
 	// Get GL Viewport size and test if it is correct.
@@ -251,31 +497,172 @@ void EglPreview::gl_setup(int width, int height)
 
 	vs[sizeof(vs) - 1] = 0;
 	GLint vs_s = compile_shader(GL_VERTEX_SHADER, vs);
-	const char *fs =
-		"#version 100\n"
-		"#extension GL_OES_EGL_image_external : enable\n"
-	    "precision mediump float;\n"
-		"uniform samplerExternalOES s;\n"
-		"varying vec2 texcoord;\n"
-		"void main() {\n"
-		"  gl_FragColor = texture2D(s, texcoord);\n"
-		"}\n";
-	GLint fs_s = compile_shader(GL_FRAGMENT_SHADER, fs);
-	GLint prog = link_program(vs_s, fs_s);
 
-	glUseProgram(prog);
+	// Every analysis overlay gets its own program for each way of sampling the camera image, all
+	// compiled and linked here so that switching between them later is just a glUseProgram.
+	for (int sampler = 0; sampler < NUM_SAMPLERS; sampler++)
+	{
+		for (int i = 0; i < static_cast<int>(AnalysisOverlay::Count); i++)
+		{
+			std::string fs = std::string(fs_headers[sampler]) + fs_common + analysis_shaders[i];
+			GLint fs_s = compile_shader(GL_FRAGMENT_SHADER, fs.c_str());
+			GLint prog = link_program(vs_s, fs_s);
+			programs_[sampler][i] = prog;
+			program_pos_[sampler][i] = glGetAttribLocation(prog, "pos");
+			glUseProgram(prog);
+			glUniform2f(glGetUniformLocation(prog, "texel"), 1.0 / width, 1.0 / height);
+			if (sampler == PLANAR_SAMPLER)
+			{
+				glUniform1i(glGetUniformLocation(prog, "s_y"), plane_units[0]);
+				glUniform1i(glGetUniformLocation(prog, "s_u"), plane_units[1]);
+				glUniform1i(glGetUniformLocation(prog, "s_v"), plane_units[2]);
+				glUniform1f(glGetUniformLocation(prog, "crop"), 1.0);
+			}
+		}
+	}
 
-	static const float verts[] = { -w_factor, -h_factor, w_factor, -h_factor, w_factor, h_factor, -w_factor, h_factor };
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
-	glEnableVertexAttribArray(0);
+	GLint text_vs = compile_shader(GL_VERTEX_SHADER, text_vs_source);
+	GLint text_fs = compile_shader(GL_FRAGMENT_SHADER, text_fs_source);
+	text_program_ = link_program(text_vs, text_fs);
+	text_pos_ = glGetAttribLocation(text_program_, "pos");
+	text_uv_ = glGetAttribLocation(text_program_, "uv");
+	glUseProgram(text_program_);
+	glUniform1i(glGetUniformLocation(text_program_, "atlas"), 1);
+
+	// The atlas has every glyph of the font laid out in a grid, as an alpha-only texture.
+	std::vector<uint8_t> atlas(ATLAS_COLUMNS * OSD_FONT_WIDTH * ATLAS_ROWS * OSD_FONT_HEIGHT);
+	for (unsigned int c = 0; c <= OSD_FONT_LAST - OSD_FONT_FIRST; c++)
+	{
+		unsigned int x0 = (c % ATLAS_COLUMNS) * OSD_FONT_WIDTH, y0 = (c / ATLAS_COLUMNS) * OSD_FONT_HEIGHT;
+		for (unsigned int y = 0; y < OSD_FONT_HEIGHT; y++)
+		{
+			for (unsigned int x = 0; x < OSD_FONT_WIDTH; x++)
+				atlas[(y0 + y) * ATLAS_COLUMNS * OSD_FONT_WIDTH + x0 + x] = (osd_font[c][y] & (0x80 >> x)) ? 255 : 0;
+		}
+	}
+	glGenTextures(1, &text_atlas_);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, text_atlas_);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, ATLAS_COLUMNS * OSD_FONT_WIDTH, ATLAS_ROWS * OSD_FONT_HEIGHT, 0,
+				 GL_ALPHA, GL_UNSIGNED_BYTE, atlas.data());
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glActiveTexture(GL_TEXTURE0);
+
+	glGenBuffers(1, &text_vbo_);
+	text_vertex_count_ = 0;
+	info_text_dirty_ = true;
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glClearColor(0, 0, 0, 0);
+
+	const float verts[] = { -w_factor, -h_factor, w_factor, -h_factor, w_factor, h_factor, -w_factor, h_factor };
+	glGenBuffers(1, &quad_vbo_);
+	glBindBuffer(GL_ARRAY_BUFFER, quad_vbo_);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	// Round outwards, so that the damage covers every pixel the quad touches.
+	image_rect_[0] = (1.0 - w_factor) / 2 * mode.hdisplay;
+	image_rect_[1] = (1.0 - h_factor) / 2 * mode.vdisplay;
+	image_rect_[2] = mode.hdisplay - 2 * image_rect_[0];
+	image_rect_[3] = mode.vdisplay - 2 * image_rect_[1];
+	text_rect_[0] = text_rect_[1] = text_rect_[2] = text_rect_[3] = 0;
+	geometry_frame_ = frame_count_;
+
+	gpu_timers_ = epoxy_has_gl_extension("GL_EXT_disjoint_timer_query");
+	if (gpu_timers_)
+	{
+		glGenQueriesEXT(4, gpu_queries_);
+		std::fill(std::begin(gpu_query_pending_), std::end(gpu_query_pending_), false);
+	}
+	gpu_query_active_ = false;
 }
 
-drmModeConnector *EglPreview::getConnector(drmModeRes *resources)
+void EglPreview::gl_cleanup()
+{
+	for (auto &progs : programs_)
+	{
+		for (GLint prog : progs)
+			glDeleteProgram(prog);
+	}
+	glDeleteProgram(text_program_);
+	glDeleteTextures(1, &text_atlas_);
+	glDeleteBuffers(1, &text_vbo_);
+	glDeleteBuffers(1, &quad_vbo_);
+	if (gpu_timers_)
+		glDeleteQueriesEXT(4, gpu_queries_);
+	if (offscreen_)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteFramebuffers(2, offscreen_fbos_);
+		glDeleteTextures(2, offscreen_textures_);
+	}
+}
+
+// Build two triangles for every character, in screen pixels converted to clip space. The
+// glyphs are scaled up by a whole number so that nearest sampling of the atlas stays sharp.
+void EglPreview::updateInfoText()
+{
+	auto start = DurationStats::Clock::now();
+	const unsigned int scale = std::max(1, mode.vdisplay / 360);
+	const float cell_w = OSD_FONT_WIDTH * scale * 2.0 / mode.hdisplay;
+	const float cell_h = OSD_FONT_HEIGHT * scale * 2.0 / mode.vdisplay;
+	const float u_step = 1.0 / ATLAS_COLUMNS, v_step = 1.0 / ATLAS_ROWS;
+	const float left = -1.0 + 2 * scale * 2.0 / mode.hdisplay;
+
+	std::vector<float> verts;
+	std::stringstream ss(info_text_);
+	std::string line;
+	const float first_top = 1.0 - 2 * scale * 2.0 / mode.vdisplay;
+	float top = first_top, right = left;
+	for (unsigned int l = 0; l < INFO_TEXT_MAX_LINES && std::getline(ss, line); l++, top -= cell_h)
+	{
+		float x = left;
+		for (char ch : line)
+		{
+			if (x + cell_w > 1.0)
+				break;
+			unsigned int c = (osd_glyph(ch) - osd_font[0]) / OSD_FONT_HEIGHT;
+			float u = (c % ATLAS_COLUMNS) * u_step, v = (c / ATLAS_COLUMNS) * v_step;
+			const float quad[] = { x, top, u, v, x + cell_w, top, u + u_step, v,
+								   x + cell_w, top - cell_h, u + u_step, v + v_step, x, top, u, v,
+								   x + cell_w, top - cell_h, u + u_step, v + v_step, x, top - cell_h, u, v + v_step };
+			verts.insert(verts.end(), std::begin(quad), std::end(quad));
+			x += cell_w;
+		}
+		right = std::max(right, x);
+	}
+
+	// Grow the area we clear under the text, so that no old text is left on the letterbox bars.
+	if (!verts.empty())
+	{
+		EGLint x0 = (left + 1.0) / 2 * mode.hdisplay, x1 = std::ceil((right + 1.0) / 2 * mode.hdisplay);
+		EGLint y0 = (top + 1.0) / 2 * mode.vdisplay, y1 = std::ceil((first_top + 1.0) / 2 * mode.vdisplay);
+		if (text_rect_[2])
+		{
+			x0 = std::min(x0, text_rect_[0]), y0 = std::min(y0, text_rect_[1]);
+			x1 = std::max(x1, text_rect_[0] + text_rect_[2]), y1 = std::max(y1, text_rect_[1] + text_rect_[3]);
+		}
+		text_rect_[0] = x0, text_rect_[1] = y0, text_rect_[2] = x1 - x0, text_rect_[3] = y1 - y0;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, text_vbo_);
+	glBufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(float), verts.data(), GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	text_vertex_count_ = verts.size() / 4;
+	info_text_dirty_ = false;
+	info_text_stats_.Add(start);
+}
+
+drmModeConnector *EglPreview::getConnector(drmModeRes *resources, std::string const &name)
 {
 	for (int i = 0; i < resources->count_connectors; i++)
 	{
 		drmModeConnector *connector = drmModeGetConnector(device, resources->connectors[i]);
-		if (connector->connection == DRM_MODE_CONNECTED)
+		if (connector->connection == DRM_MODE_CONNECTED && (name.empty() || drm_connector_name(connector) == name))
 		{
 			return connector;
 		}
@@ -298,8 +685,11 @@ void EglPreview::gbmClean()
 {
 	printf("gbmClean");
 	// set the previous crtc
-	drmModeSetCrtc(device, crtc->crtc_id, crtc->buffer_id, crtc->x, crtc->y, &connectorId, 1, &crtc->mode);
-	drmModeFreeCrtc(crtc);
+	if (crtc)
+	{
+		drmModeSetCrtc(device, crtc->crtc_id, crtc->buffer_id, crtc->x, crtc->y, &connectorId, 1, &crtc->mode);
+		drmModeFreeCrtc(crtc);
+	}
 
 	// if (previousBo)
 	// {
@@ -307,8 +697,10 @@ void EglPreview::gbmClean()
 	// 	gbm_surface_release_buffer(gbmSurface, previousBo);
 	// }
 
-	gbm_surface_destroy(gbmSurface);
-	gbm_device_destroy(gbmDevice);
+	if (gbmSurface)
+		gbm_surface_destroy(gbmSurface);
+	if (gbmDevice)
+		gbm_device_destroy(gbmDevice);
 }
 
 static int match_config_to_visual(
@@ -357,16 +749,20 @@ static int match_config_to_visual(
 // 	return res;
 // }
 
-EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1), first_time_(true)
+void EglPreview::kmsSetup(Options const *options, int drm_fd)
 {
-	device = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
+	// We render on the same device that displays, so prefer one that has a GPU.
+	if (drm_fd >= 0)
+		device = drm_share_device(drm_fd);
+	else
+		device = drm_open_device(options->drm_device, options->drm_connector, true);
 	resources = drmModeGetResources(device);
 	if (resources == nullptr)
 	{
 		throw std::runtime_error("Unable to get DRM resources");
 	}
 
-	connector = getConnector(resources);
+	connector = getConnector(resources, options->drm_connector);
 	if (connector == nullptr)
 	{
 		drmModeFreeResources(resources);
@@ -420,6 +816,71 @@ EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1),
 	{
 		throw std::runtime_error("eglGetDisplay() failed");
 	}
+}
+
+// Find an EGL display that needs no screen: Mesa's surfaceless platform if we have it, otherwise
+// GBM on the first render node. mode is filled in to look like a display of the requested size.
+void EglPreview::offscreenSetup(Options const *options)
+{
+	mode.hdisplay = options->offscreen_width;
+	mode.vdisplay = options->offscreen_height;
+	mode.vrefresh = options->offscreen_refresh;
+
+	if (epoxy_has_egl_extension(EGL_NO_DISPLAY, "EGL_MESA_platform_surfaceless"))
+	{
+		egl_display_ = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+		LOG(2, "EglPreview: using the surfaceless platform");
+	}
+	else
+	{
+		for (auto const &d : drm_devices())
+		{
+			if (d.render_node.empty())
+				continue;
+			device = open(d.render_node.c_str(), O_RDWR | O_CLOEXEC);
+			if (device < 0)
+				continue;
+			LOG(2, "EglPreview: using GBM on " << d.render_node);
+			break;
+		}
+		if (device < 0)
+			throw std::runtime_error("EglPreview: no surfaceless EGL platform or render node for offscreen use");
+		gbmDevice = gbm_create_device(device);
+		if (!gbmDevice)
+			throw std::runtime_error("Couldn't open GBM device");
+		egl_display_ = eglGetPlatformDisplay(EGL_PLATFORM_GBM_KHR, gbmDevice, NULL);
+	}
+
+	if (!egl_display_)
+		throw std::runtime_error("eglGetPlatformDisplay() failed");
+}
+
+EglPreview::EglPreview(Options const *options, int drm_fd)
+	: Preview(options), last_fd_(-1), first_time_(true), analysis_overlay_(AnalysisOverlay::None), frame_count_(0),
+	  geometry_frame_(0), buffer_age_(false), partial_update_(false), swap_with_damage_(false), gpu_timers_(false),
+	  gpu_query_active_(false), gpu_stats_("EglPreview GPU frame times"), info_text_dirty_(false),
+	  info_text_stats_("EglPreview info text updates"), draw_stats_("EglPreview draws"), swap_stats_("EglPreview swaps"),
+	  offscreen_(!options->egl_offscreen.empty()),
+	  offscreen_refresh_(options->offscreen_refresh), offscreen_back_(0), vsync_stats_("EglPreview vsync waits"),
+	  planes_(options->egl_import == "planes"), upload_(options->egl_import == "upload"), upload_forced_(upload_),
+	  allow_upload_(options->egl_import != "dmabuf"), upload_bytes_(0), upload_stats_("EglPreview texture uploads"),
+	  import_stats_(planes_ ? "EglPreview per-plane dma-buf imports" : "EglPreview dma-buf imports")
+{
+	async_flip_ = options->async_flip;
+	async_flags_ = 0;
+	if (offscreen_)
+		offscreenSetup(options);
+	else
+		kmsSetup(options, drm_fd);
+
+	if (async_flip_ && !offscreen_)
+	{
+		uint64_t cap = 0;
+		if (drmGetCap(device, DRM_CAP_ASYNC_PAGE_FLIP, &cap) == 0 && cap)
+			async_flags_ = DRM_MODE_PAGE_FLIP_ASYNC;
+		else
+			LOG(1, "EglPreview: driver has no async page flips, flips will still wait for vblank");
+	}
 
 	// Other variables we will need further down the code.
     int major, minor;
@@ -438,13 +899,22 @@ EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1),
 
     printf("Initialized EGL version: %d.%d\n", major, minor);
 
+	buffer_age_ = epoxy_has_egl_extension(egl_display_, "EGL_EXT_buffer_age") ||
+				  epoxy_has_egl_extension(egl_display_, "EGL_KHR_partial_update");
+	partial_update_ = epoxy_has_egl_extension(egl_display_, "EGL_KHR_partial_update");
+	swap_with_damage_ = epoxy_has_egl_extension(egl_display_, "EGL_KHR_swap_buffers_with_damage");
+	LOG(2, "EglPreview: buffer age " << buffer_age_ << ", partial update " << partial_update_
+									 << ", swap with damage " << swap_with_damage_);
+
     // EGLint count;
     // EGLint numConfigs;
     // eglGetConfigs(egl_display_, NULL, 0, &count);
     // EGLConfig *configs = malloc(count * sizeof(configs));
 
-	static const EGLint attribs[] =
+	// The surfaceless platform only has pbuffer configs, but we need no surface at all.
+	const EGLint attribs[] =
 		{
+		EGL_SURFACE_TYPE, offscreen_ ? 0 : EGL_WINDOW_BIT,
 		EGL_RED_SIZE, 1,
 		EGL_GREEN_SIZE, 1,
 		EGL_BLUE_SIZE, 1,
@@ -470,7 +940,7 @@ EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1),
 		printf("No EGL configs with appropriate attributes.\n");
 	}
 
-	auto visual_id = DRM_FORMAT_XRGB8888;
+	auto visual_id = offscreen_ ? 0 : DRM_FORMAT_XRGB8888;
 	if (!visual_id)
 	{
 		config_index = 0;
@@ -501,8 +971,12 @@ EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1),
     	throw std::runtime_error("Failed to create EGL context! Error: " + eglGetErrorStr());
     }
 
-    egl_surface_ = eglCreateWindowSurface(egl_display_, config, (EGLNativeWindowType)gbmSurface, NULL);
-    if (egl_surface_ == EGL_NO_SURFACE)
+	// Offscreen we draw into our own framebuffer objects, so never need a surface.
+	if (offscreen_)
+		egl_surface_ = EGL_NO_SURFACE;
+	else
+		egl_surface_ = eglCreateWindowSurface(egl_display_, config, (EGLNativeWindowType)gbmSurface, NULL);
+    if (!offscreen_ && egl_surface_ == EGL_NO_SURFACE)
     {
         eglDestroyContext(egl_display_, egl_context_);
         eglTerminate(egl_display_);
@@ -517,6 +991,7 @@ EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1),
 	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context_);
 	int max_texture_size = 0;
 	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+	renderer_ = (const char *)glGetString(GL_RENDERER);
 	max_image_width_ = max_image_height_ = max_texture_size;
 	// This "undoes" the previous eglMakeCurrent.
 	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
@@ -528,7 +1003,46 @@ EglPreview::~EglPreview()
 {
 	printf("GL destroy");
 	EglPreview::Reset();
+	if (info_text_stats_.Count())
+		LOG(2, info_text_stats_.ToString());
+	// Offscreen, these costs are the point of the exercise.
+	unsigned int level = offscreen_ ? 1 : 2;
+	// The costs depend so much on the driver that they mean little without knowing which it was.
+	LOG(level, "EglPreview: " << renderer_ << ", "
+							  << (upload_ ? "texture uploads" : planes_ ? "per-plane import" : "dma-buf import") << ", "
+							  << (!async_flip_ ? "vsynced" : async_flags_ || offscreen_ ? "async" : "non-blocking")
+							  << " flips");
+	if (draw_stats_.Count())
+	{
+		LOG(level, draw_stats_.ToString());
+		LOG(level, swap_stats_.ToString());
+	}
+	if (gpu_stats_.Count())
+		LOG(level, gpu_stats_.ToString());
+	if (vsync_stats_.Count())
+		LOG(level, vsync_stats_.ToString());
+	if (import_stats_.Count())
+		LOG(level, import_stats_.ToString());
+	if (upload_stats_.Count())
+	{
+		double seconds = upload_stats_.MeanUs() * upload_stats_.Count() / 1e6;
+		LOG(level, upload_stats_.ToString());
+		LOG(level, "EglPreview: uploaded " << (upload_bytes_ >> 20) << "MB at " << (upload_bytes_ / seconds / 1e6)
+										 << "MB/s");
+	}
+	// Hand the display back as we found it, which also lets another preview take over from us.
+	if (previousBo)
+	{
+		drmModeRmFB(device, previousFb);
+		gbm_surface_release_buffer(gbmSurface, previousBo);
+	}
+	if (egl_surface_ != EGL_NO_SURFACE)
+		eglDestroySurface(egl_display_, egl_surface_);
 	eglDestroyContext(egl_display_, egl_context_);
+	eglTerminate(egl_display_);
+	gbmClean();
+	if (device >= 0)
+		close(device);
 }
 
 static void get_colour_space_info(std::optional<libcamera::ColorSpace> const &cs, EGLint &encoding, EGLint &range)
@@ -546,25 +1060,86 @@ static void get_colour_space_info(std::optional<libcamera::ColorSpace> const &cs
 		LOG(1, "EglPreview: unexpected colour space " << libcamera::ColorSpace::toString(cs));
 }
 
-void EglPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer)
+// The planar shaders convert to RGB themselves, with the same choice of matrix and range that
+// we would have hinted to EGL. The matrix is column-major, as GL wants it.
+static void get_yuv_matrix(std::optional<libcamera::ColorSpace> const &cs, GLfloat matrix[9], GLfloat offset[3])
 {
-	if (first_time_)
-	{
-		auto makeCurrentResult = eglMakeCurrent(egl_display_, egl_surface_, egl_surface_, egl_context_);
-		// This stuff has to be delayed until we know we're in the thread doing the display.
-		if (!makeCurrentResult)
-		{
-			throw std::runtime_error("eglMakeCurrent failed" + eglGetErrorStr());
-		}
-
-		gl_setup(info.width, info.height);
-		first_time_ = false;
-	}
+	EGLint encoding, range;
+	get_colour_space_info(cs, encoding, range);
+
+	const float kr = encoding == EGL_ITU_REC709_EXT ? 0.2126 : 0.299;
+	const float kb = encoding == EGL_ITU_REC709_EXT ? 0.0722 : 0.114;
+	const float kg = 1.0 - kr - kb;
+	const bool full = range == EGL_YUV_FULL_RANGE_EXT;
+	const float y_scale = full ? 1.0 : 255.0 / 219.0;
+	const float c_scale = full ? 1.0 : 255.0 / 224.0;
+
+	offset[0] = full ? 0.0 : 16.0 / 255.0;
+	offset[1] = offset[2] = 128.0 / 255.0;
+
+	const GLfloat m[9] = {
+		y_scale, y_scale, y_scale,
+		0.0f, -c_scale * (2 - 2 * kb) * kb / kg, c_scale * (2 - 2 * kb),
+		c_scale * (2 - 2 * kr), -c_scale * (2 - 2 * kr) * kr / kg, 0.0f,
+	};
+	std::copy(std::begin(m), std::end(m), matrix);
+}
 
+// Returns false if the dma-buf can't be imported and we're allowed to upload the frames instead.
+bool EglPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer)
+{
+	TRACE_SCOPE("EglPreview::makeBuffer");
+	auto start = DurationStats::Clock::now();
 	buffer.fd = fd;
 	buffer.size = size;
 	buffer.info = info;
 
+	if (planes_)
+	{
+		const EGLint offsets[3] = { 0, static_cast<EGLint>(info.stride * info.height),
+									static_cast<EGLint>(info.stride * info.height +
+														(info.stride / 2) * (info.height / 2)) };
+		glGenTextures(3, buffer.plane_textures);
+		for (int i = 0; i < 3; i++)
+		{
+			const unsigned int div = i ? 2 : 1;
+			EGLint plane_attribs[] = {
+				EGL_WIDTH, static_cast<EGLint>(info.width / div),
+				EGL_HEIGHT, static_cast<EGLint>(info.height / div),
+				EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_R8,
+				EGL_DMA_BUF_PLANE0_FD_EXT, fd,
+				EGL_DMA_BUF_PLANE0_OFFSET_EXT, offsets[i],
+				EGL_DMA_BUF_PLANE0_PITCH_EXT, static_cast<EGLint>(info.stride / div),
+				EGL_NONE
+			};
+
+			EGLImage image =
+				eglCreateImageKHR(egl_display_, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, plane_attribs);
+			if (!image)
+			{
+				glDeleteTextures(3, buffer.plane_textures);
+				if (allow_upload_)
+				{
+					LOG(1, "EglPreview: cannot import dma-buf planes (" << eglGetErrorStr()
+																		<< "), uploading textures instead");
+					return false;
+				}
+				throw std::runtime_error("failed to import planes of fd " + std::to_string(fd));
+			}
+
+			glBindTexture(GL_TEXTURE_2D, buffer.plane_textures[i]);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+			eglDestroyImageKHR(egl_display_, image);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		import_stats_.Add(start);
+		return true;
+	}
+
 	EGLint encoding, range;
 	get_colour_space_info(info.colour_space, encoding, range);
 
@@ -587,7 +1162,12 @@ void EglPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer
 	};
 
 	EGLImage image = eglCreateImageKHR(egl_display_, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
-	if (!image)
+	if (!image && allow_upload_)
+	{
+		LOG(1, "EglPreview: cannot import dma-buf (" << eglGetErrorStr() << "), uploading textures instead");
+		return false;
+	}
+	else if (!image)
 		throw std::runtime_error("failed to import fd " + std::to_string(fd));
 
 	glGenTextures(1, &buffer.texture);
@@ -597,20 +1177,337 @@ void EglPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer
 	glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
 
 	eglDestroyImageKHR(egl_display_, image);
+	import_stats_.Add(start);
+	return true;
 }
 
-void EglPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
+void EglPreview::destroyBuffer(Buffer &buffer)
+{
+	glDeleteTextures(1, &buffer.texture);
+	glDeleteTextures(3, buffer.plane_textures);
+	buffer = Buffer();
+}
+
+void EglPreview::setPlanarUniforms(StreamInfo const &info, float crop)
+{
+	GLfloat matrix[9], offset[3];
+	get_yuv_matrix(info.colour_space, matrix, offset);
+	for (GLint prog : programs_[PLANAR_SAMPLER])
+	{
+		glUseProgram(prog);
+		glUniform1f(glGetUniformLocation(prog, "crop"), crop);
+		glUniform3fv(glGetUniformLocation(prog, "yuv_offset"), 1, offset);
+		glUniformMatrix3fv(glGetUniformLocation(prog, "yuv_matrix"), 1, GL_FALSE, matrix);
+	}
+}
+
+// With ES 3 we copy through pixel unpack buffers, persistently mapped where GL_EXT_buffer_storage
+// allows, so that the GPU can fetch the texels asynchronously. Otherwise we can only hand GL the
+// camera buffer directly and let the driver copy it.
+void EglPreview::makeUploadSlots(StreamInfo const &info)
+{
+	upload_size_ = info.stride * info.height * 3 / 2;
+	upload_pbo_ = epoxy_gl_version() >= 30;
+	upload_persistent_ = upload_pbo_ && epoxy_has_gl_extension("GL_EXT_buffer_storage");
+	const GLenum format = upload_pbo_ ? GL_RED : GL_LUMINANCE;
+	const GLint internal_format = upload_pbo_ ? GL_R8 : GL_LUMINANCE;
+	const GLbitfield persistent_flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT_EXT | GL_MAP_COHERENT_BIT_EXT;
+
+	upload_slots_.resize(UPLOAD_SLOTS);
+	for (UploadSlot &slot : upload_slots_)
+	{
+		slot.pbo = 0;
+		slot.fence = 0;
+		slot.mem = nullptr;
+		if (upload_pbo_)
+		{
+			glGenBuffers(1, &slot.pbo);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+			if (upload_persistent_)
+			{
+				glBufferStorageEXT(GL_PIXEL_UNPACK_BUFFER, upload_size_, NULL, persistent_flags);
+				slot.mem = (uint8_t *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, upload_size_, persistent_flags);
+				if (!slot.mem)
+					throw std::runtime_error("EglPreview: failed to map pixel unpack buffer");
+			}
+			else
+				glBufferData(GL_PIXEL_UNPACK_BUFFER, upload_size_, NULL, GL_STREAM_DRAW);
+		}
+
+		glGenTextures(3, slot.textures);
+		for (int i = 0; i < 3; i++)
+		{
+			unsigned int div = i ? 2 : 1;
+			glBindTexture(GL_TEXTURE_2D, slot.textures[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, internal_format, info.stride / div, info.height / div, 0, format,
+						 GL_UNSIGNED_BYTE, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		}
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	upload_slot_ = 0;
+
+	// The textures are as wide as the stride, so the padding has to be cropped off.
+	setPlanarUniforms(info, (float)info.width / info.stride);
+
+	LOG(2, "EglPreview: uploading through " << (upload_persistent_ ? "persistent pixel unpack buffers"
+											: upload_pbo_ ? "pixel unpack buffers" : "client memory"));
+}
+
+void EglPreview::destroyUploadSlots()
+{
+	for (UploadSlot &slot : upload_slots_)
+	{
+		if (slot.fence)
+			glDeleteSync(slot.fence);
+		if (slot.mem)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		if (slot.pbo)
+			glDeleteBuffers(1, &slot.pbo);
+		glDeleteTextures(3, slot.textures);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	upload_slots_.clear();
+}
+
+// Copy the frame into the next slot and start the texture uploads from it. The slot was last
+// drawn UPLOAD_SLOTS - 1 frames ago, so its fence has normally passed long since.
+void EglPreview::uploadFrame(libcamera::Span<uint8_t> span, StreamInfo const &info)
+{
+	auto start = DurationStats::Clock::now();
+	if (upload_slots_.empty())
+		makeUploadSlots(info);
+
+	UploadSlot &slot = upload_slots_[upload_slot_];
+	const size_t size = std::min(span.size(), upload_size_);
+	const unsigned int widths[3] = { info.stride, info.stride / 2, info.stride / 2 };
+	const unsigned int heights[3] = { info.height, info.height / 2, info.height / 2 };
+	const size_t offsets[3] = { 0, (size_t)info.stride * info.height,
+								(size_t)info.stride * info.height + (info.stride / 2) * (info.height / 2) };
+
+	if (upload_pbo_)
+	{
+		if (slot.fence)
+		{
+			glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+			glDeleteSync(slot.fence);
+			slot.fence = 0;
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+		uint8_t *mem = slot.mem;
+		if (!mem)
+			mem = (uint8_t *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, upload_size_,
+											  GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT |
+												  GL_MAP_UNSYNCHRONIZED_BIT);
+		if (!mem)
+			throw std::runtime_error("EglPreview: failed to map pixel unpack buffer");
+		memcpy(mem, span.data(), size);
+		if (!slot.mem)
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	}
+
+	for (int i = 0; i < 3; i++)
+	{
+		const void *pixels = upload_pbo_ ? (const void *)offsets[i] : span.data() + offsets[i];
+		glActiveTexture(GL_TEXTURE0 + plane_units[i]);
+		glBindTexture(GL_TEXTURE_2D, slot.textures[i]);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, widths[i], heights[i], upload_pbo_ ? GL_RED : GL_LUMINANCE,
+						GL_UNSIGNED_BYTE, pixels);
+	}
+	glActiveTexture(GL_TEXTURE0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	upload_bytes_ += size;
+	upload_stats_.Add(start);
+}
+
+void EglPreview::SetInfoText(const std::string &text)
+{
+	// We may not have a GL context yet, so just note the change for the next Show.
+	if (text != info_text_)
+	{
+		info_text_ = text;
+		info_text_dirty_ = true;
+	}
+}
+
+void EglPreview::SetAnalysisOverlay(AnalysisOverlay overlay)
 {
+	analysis_overlay_ = overlay;
+}
+
+// Everything that has to happen on the display thread before a frame of this format can be drawn.
+void EglPreview::setupGl(StreamInfo const &info)
+{
+	if (first_time_)
+	{
+		auto makeCurrentResult = eglMakeCurrent(egl_display_, egl_surface_, egl_surface_, egl_context_);
+		// This stuff has to be delayed until we know we're in the thread doing the display.
+		if (!makeCurrentResult)
+		{
+			throw std::runtime_error("eglMakeCurrent failed" + eglGetErrorStr());
+		}
+
+		// Don't let EGL wait for vblank either, for platforms where it would.
+		if (async_flip_)
+			eglSwapInterval(egl_display_, 0);
+
+		gl_setup(info.width, info.height);
+		if (planes_)
+			setPlanarUniforms(info, 1.0);
+		first_time_ = false;
+		setup_info_ = info;
+	}
+	else if (!info.SameLayout(setup_info_))
+	{
+		// The camera was reconfigured. Only the GL objects depend on the image format, so the
+		// context, surface and display all stay as they are.
+		if (!upload_slots_.empty())
+			destroyUploadSlots();
+		gl_cleanup();
+		gl_setup(info.width, info.height);
+		if (planes_)
+			setPlanarUniforms(info, 1.0);
+		setup_info_ = info;
+	}
+}
+
+// Import the dma-buf, unless we're uploading frames instead, or find we have to.
+void EglPreview::importBuffer(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
+{
+	if (upload_)
+		return;
+
 	Buffer &buffer = buffers_[fd];
-	if (buffer.fd == -1)
-		makeBuffer(fd, span.size(), info, buffer);
+	if (buffer.fd != -1 && !buffer.info.SameLayout(info))
+		destroyBuffer(buffer);
+	if (buffer.fd == -1 && !makeBuffer(fd, span.size(), info, buffer))
+	{
+		buffers_.erase(fd);
+		upload_ = true;
+	}
+}
 
-	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT);
+void EglPreview::Prepare(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
+{
+	setupGl(info);
+	importBuffer(fd, span, info);
+	// Without imports, it's the upload slots that are made on the first frame.
+	if (upload_ && upload_slots_.empty())
+		makeUploadSlots(info);
+}
 
-	glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffer.texture);
+void EglPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
+{
+	TRACE_SCOPE("EglPreview::Show");
+
+	setupGl(info);
+	importBuffer(fd, span, info);
+
+	// Once copied, the camera buffer can go straight back.
+	if (upload_)
+	{
+		uploadFrame(span, info);
+		done_callback_(fd);
+	}
+
+	if (info_text_dirty_)
+		updateInfoText();
+
+	auto draw_start = DurationStats::Clock::now();
+
+	// A buffer last drawn before the geometry changed needs everything redrawing. Otherwise only
+	// the text background needs clearing, as the camera image is opaque.
+	int age = bufferAge();
+	bool full = age == 0 || frame_count_ < geometry_frame_ + age;
+	EGLint rects[8] = { 0, 0, mode.hdisplay, mode.vdisplay };
+	EGLint num_rects = 1;
+	if (!full)
+	{
+		std::copy(std::begin(image_rect_), std::end(image_rect_), rects);
+		std::copy(std::begin(text_rect_), std::end(text_rect_), rects + 4);
+		num_rects = text_rect_[2] ? 2 : 1;
+	}
+	// The damage region has to be set before anything is drawn.
+	if (partial_update_)
+		eglSetDamageRegionKHR(egl_display_, egl_surface_, rects, num_rects);
+	beginGpuTimer();
+
+	if (full)
+		glClear(GL_COLOR_BUFFER_BIT);
+	else if (text_rect_[2])
+	{
+		glEnable(GL_SCISSOR_TEST);
+		glScissor(text_rect_[0], text_rect_[1], text_rect_[2], text_rect_[3]);
+		glClear(GL_COLOR_BUFFER_BIT);
+		glDisable(GL_SCISSOR_TEST);
+	}
+
+	int overlay = static_cast<int>(analysis_overlay_);
+	int sampler = upload_ || planes_ ? PLANAR_SAMPLER : EXTERNAL_SAMPLER;
+	GLint pos = program_pos_[sampler][overlay];
+	glUseProgram(programs_[sampler][overlay]);
+	glBindBuffer(GL_ARRAY_BUFFER, quad_vbo_);
+	glVertexAttribPointer(pos, 2, GL_FLOAT, GL_FALSE, 0, (void *)0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glEnableVertexAttribArray(pos);
+	if (!upload_ && planes_)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			glActiveTexture(GL_TEXTURE0 + plane_units[i]);
+			glBindTexture(GL_TEXTURE_2D, buffers_[fd].plane_textures[i]);
+		}
+		glActiveTexture(GL_TEXTURE0);
+	}
+	else if (!upload_)
+		glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffers_[fd].texture);
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-	gbmSwapBuffers();
+	glDisableVertexAttribArray(pos);
+	if (upload_)
+	{
+		if (upload_pbo_)
+			upload_slots_[upload_slot_].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		upload_slot_ = (upload_slot_ + 1) % UPLOAD_SLOTS;
+	}
+
+	if (text_vertex_count_)
+	{
+		glUseProgram(text_program_);
+		glBindBuffer(GL_ARRAY_BUFFER, text_vbo_);
+		glVertexAttribPointer(text_pos_, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void *)0);
+		glVertexAttribPointer(text_uv_, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void *)(2 * sizeof(float)));
+		glEnableVertexAttribArray(text_pos_);
+		glEnableVertexAttribArray(text_uv_);
+		glEnable(GL_BLEND);
+		glDrawArrays(GL_TRIANGLES, 0, text_vertex_count_);
+		glDisable(GL_BLEND);
+		glDisableVertexAttribArray(text_pos_);
+		glDisableVertexAttribArray(text_uv_);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	endGpuTimer();
+	draw_stats_.Add(draw_start);
+
+	auto swap_start = DurationStats::Clock::now();
+	if (offscreen_)
+		offscreenSwapBuffers();
+	else
+		gbmSwapBuffers(rects, num_rects);
+	swap_stats_.Add(swap_start);
+	frame_count_++;
+
+	if (upload_)
+		return;
+
 	if (last_fd_ >= 0)
 	{
 		done_callback_(last_fd_);
@@ -619,15 +1516,117 @@ void EglPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 	last_fd_ = fd;
 }
 
-void EglPreview::gbmSwapBuffers()
+// Swap in an empty frame. The GL context and buffer imports all stay, ready for the next Show().
+void EglPreview::Hide()
+{
+	if (first_time_)
+		return;
+
+	EGLint rects[4] = { 0, 0, mode.hdisplay, mode.vdisplay };
+	if (partial_update_)
+		eglSetDamageRegionKHR(egl_display_, egl_surface_, rects, 1);
+	glClear(GL_COLOR_BUFFER_BIT);
+	if (offscreen_)
+		offscreenSwapBuffers();
+	else
+		gbmSwapBuffers(rects, 1);
+	frame_count_++;
+	// The other buffers still hold the old image, so the next frames must redraw everything.
+	geometry_frame_ = frame_count_;
+
+	if (last_fd_ >= 0)
+		done_callback_(last_fd_);
+	last_fd_ = -1;
+}
+
+// How many frames ago the buffer we're about to draw into was drawn, or 0 if we can't tell. Our
+// own offscreen buffers simply alternate.
+int EglPreview::bufferAge()
+{
+	if (offscreen_)
+		return frame_count_ >= geometry_frame_ + 2 ? 2 : 0;
+	EGLint age = 0;
+	if (buffer_age_ && !eglQuerySurface(egl_display_, egl_surface_, EGL_BUFFER_AGE_EXT, &age))
+		age = 0;
+	return age;
+}
+
+// Time the frame on the GPU, with a few queries in flight so that we never wait for a result.
+// A frame whose query slot is still busy just doesn't get timed.
+void EglPreview::beginGpuTimer()
+{
+	if (!gpu_timers_)
+		return;
+
+	unsigned int slot = frame_count_ % 4;
+	if (gpu_query_pending_[slot])
+	{
+		GLuint available = 0;
+		glGetQueryObjectuivEXT(gpu_queries_[slot], GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+		if (!available)
+			return;
+
+		GLuint64 ns = 0;
+		GLint disjoint = 0;
+		glGetQueryObjectui64vEXT(gpu_queries_[slot], GL_QUERY_RESULT_EXT, &ns);
+		// Something like a clock change makes the result meaningless.
+		glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+		if (!disjoint)
+			gpu_stats_.Add(std::chrono::nanoseconds(ns));
+		gpu_query_pending_[slot] = false;
+	}
+
+	glBeginQueryEXT(GL_TIME_ELAPSED_EXT, gpu_queries_[slot]);
+	gpu_query_active_ = true;
+}
+
+void EglPreview::endGpuTimer()
 {
-	eglSwapBuffers(egl_display_, egl_surface_);
+	if (!gpu_query_active_)
+		return;
+
+	glEndQueryEXT(GL_TIME_ELAPSED_EXT);
+	gpu_query_pending_[frame_count_ % 4] = true;
+	gpu_query_active_ = false;
+}
+
+void EglPreview::gbmSwapBuffers(EGLint *rects, EGLint num_rects)
+{
+	{
+		TRACE_SCOPE("EglPreview swap");
+		if (swap_with_damage_)
+			eglSwapBuffersWithDamageKHR(egl_display_, egl_surface_, rects, num_rects);
+		else
+			eglSwapBuffers(egl_display_, egl_surface_);
+	}
+	TRACE_SCOPE("EglPreview flip");
 	struct gbm_bo *bo = gbm_surface_lock_front_buffer(gbmSurface);
 	uint32_t handle = gbm_bo_get_handle(bo).u32;
 	uint32_t pitch = gbm_bo_get_stride(bo);
 	uint32_t fb;
 	drmModeAddFB(device, mode.hdisplay, mode.vdisplay, 24, 32, pitch, handle, &fb);
+
+	if (async_flip_ && mode_set_)
+	{
+		// One flip at a time. An async one completes almost at once.
+		waitForFlip(-1);
+		int ret = drmModePageFlip(device, crtc->crtc_id, fb, DRM_MODE_PAGE_FLIP_EVENT | async_flags_, this);
+		if (ret == -EINVAL && async_flags_)
+		{
+			LOG(1, "EglPreview: driver refuses async flips, flips will wait for vblank");
+			async_flags_ = 0;
+			ret = drmModePageFlip(device, crtc->crtc_id, fb, DRM_MODE_PAGE_FLIP_EVENT, this);
+		}
+		if (ret)
+			throw std::runtime_error("drmModePageFlip failed: " + std::string(strerror(-ret)));
+		flip_pending_ = true;
+		pendingBo = bo;
+		pendingFb = fb;
+		return;
+	}
+
 	drmModeSetCrtc(device, crtc->crtc_id, fb, 0, 0, &connectorId, 1, &mode);
+	mode_set_ = true;
 
 	if (previousBo)
 	{
@@ -639,15 +1638,77 @@ void EglPreview::gbmSwapBuffers()
 	previousFb = fb;
 }
 
+void EglPreview::flipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *data)
+{
+	EglPreview *preview = static_cast<EglPreview *>(data);
+	TRACE_INSTANT("EglPreview flip done");
+	if (preview->previousBo)
+	{
+		drmModeRmFB(preview->device, preview->previousFb);
+		gbm_surface_release_buffer(preview->gbmSurface, preview->previousBo);
+	}
+	preview->previousBo = preview->pendingBo;
+	preview->previousFb = preview->pendingFb;
+	preview->pendingBo = nullptr;
+	preview->flip_pending_ = false;
+}
+
+void EglPreview::waitForFlip(int timeout_ms)
+{
+	pollfd pfd = { device, POLLIN, 0 };
+	while (flip_pending_ && poll(&pfd, 1, timeout_ms) > 0)
+	{
+		drmEventContext ctx = {};
+		ctx.version = 2;
+		ctx.page_flip_handler = flipHandler;
+		drmHandleEvent(device, &ctx);
+	}
+}
+
+// Stand in for a real swap: wait for the GPU to finish the frame, "show" it at the next vsync of
+// the pretend display, and then draw into the other buffer.
+void EglPreview::offscreenSwapBuffers()
+{
+	TRACE_SCOPE("EglPreview swap");
+	glFinish();
+
+	// In async mode the pretend display tears rather than waiting.
+	if (offscreen_refresh_ && !async_flip_)
+	{
+		auto wait_start = DurationStats::Clock::now();
+		auto period = std::chrono::nanoseconds(1000000000 / offscreen_refresh_);
+		// If we missed vsyncs, the frame goes out on the next one that's still to come.
+		if (next_vsync_ < wait_start)
+			next_vsync_ += ((wait_start - next_vsync_) / period + 1) * period;
+		std::this_thread::sleep_until(next_vsync_);
+		next_vsync_ += period;
+		vsync_stats_.Add(wait_start);
+	}
+
+	offscreen_back_ ^= 1;
+	glBindFramebuffer(GL_FRAMEBUFFER, offscreen_fbos_[offscreen_back_]);
+}
+
 void EglPreview::Reset()
 {
+	if (flip_pending_)
+		waitForFlip(100);
+
 	std::cout << "RESET!";
 
 	for (auto &it : buffers_)
-		glDeleteTextures(1, &it.second.texture);
+		destroyBuffer(it.second);
 	buffers_.clear();
 	last_fd_ = -1;
 
+	// gl_setup() runs again on the next Show, so don't leak what it made.
+	if (!first_time_)
+	{
+		destroyUploadSlots();
+		gl_cleanup();
+	}
+	upload_ = upload_forced_;
+
 	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 	first_time_ = true;
 }
@@ -664,7 +1725,7 @@ void EglPreview::Reset()
 // 	return false;
 // }
 
-Preview *make_egl_preview(Options const *options)
+Preview *make_egl_preview(Options const *options, int drm_fd)
 {
-	return new EglPreview(options);
+	return new EglPreview(options, drm_fd);
 }
@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * osd_font.hpp - tiny bitmap font for on-screen info text.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Each glyph is 5x7 pixels in a 6x8 cell. Rows are stored top to bottom, with
+// the leftmost pixel in the most significant bit.
+static constexpr unsigned int OSD_FONT_WIDTH = 6;
+static constexpr unsigned int OSD_FONT_HEIGHT = 8;
+static constexpr char OSD_FONT_FIRST = ' ';
+static constexpr char OSD_FONT_LAST = '~';
+
+extern const uint8_t osd_font[OSD_FONT_LAST - OSD_FONT_FIRST + 1][OSD_FONT_HEIGHT];
+
+// Return the glyph rows for a character, substituting '?' for anything unprintable.
+inline uint8_t const *osd_glyph(char c)
+{
+	if (c < OSD_FONT_FIRST || c > OSD_FONT_LAST)
+		c = '?';
+	return osd_font[c - OSD_FONT_FIRST];
+}
@@ -9,17 +9,17 @@
 
 #include "preview.hpp"
 
-Preview *make_egl_preview(Options const *options);
-Preview *make_drm_preview(Options const *options);
+Preview *make_egl_preview(Options const *options, int drm_fd);
+Preview *make_drm_preview(Options const *options, int drm_fd);
 
-Preview *make_preview(Options const *options)
+Preview *make_preview(Options const *options, int drm_fd)
 {
 	Preview *p = nullptr;
 	try
 	{
 		if (options->useGlesPreview)
 		{
-			p = make_egl_preview(options);
+			p = make_egl_preview(options, drm_fd);
 			if (p)
 			{
 				LOG(1, "Made X/EGL preview window");
@@ -27,7 +27,7 @@ Preview *make_preview(Options const *options)
 		}
 		else
 		{
-			p = make_drm_preview(options);
+			p = make_drm_preview(options, drm_fd);
 			if (p)
 			{
 				LOG(1, "Made DRM preview window");
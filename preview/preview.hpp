@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <functional>
 #include <string>
 
@@ -20,6 +21,15 @@ class Preview
 {
 public:
 	typedef std::function<void(int fd)> DoneCallback;
+	// Analysis aids that a preview may draw over the camera image.
+	enum class AnalysisOverlay
+	{
+		None,
+		FocusPeaking,
+		Zebra,
+		FalseColour,
+		Count
+	};
 
 	Preview(Options const *options) : options_(options) {}
 	virtual ~Preview() {}
@@ -27,6 +37,9 @@ public:
 	// is no longer displaying the buffer and it can be safely recycled.
 	void SetDoneCallback(DoneCallback callback) { done_callback_ = callback; }
 	virtual void SetInfoText(const std::string &text) {}
+	// Choose the analysis overlay drawn over subsequent frames. Previews that can't draw
+	// these simply ignore it.
+	virtual void SetAnalysisOverlay(AnalysisOverlay overlay) {}
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) = 0;
@@ -35,10 +48,29 @@ public:
 	virtual void Reset() = 0;
 	// Return the maximum image size allowed.
 	virtual void MaxImageSize(unsigned int &w, unsigned int &h) const = 0;
+	// Return the size of the area the image is shown in, or zeroes if it isn't known.
+	virtual void DisplaySize(unsigned int &w, unsigned int &h) const { w = h = 0; }
+	// Return how many frames were discarded because the previous one hadn't reached the screen yet.
+	virtual uint64_t MissedVblanks() const { return 0; }
+	// A file descriptor that becomes readable when the preview has events to handle (such as
+	// completed page flips), or -1 if it has none. HandleEvents() is then called, on the same
+	// thread as Show(), without blocking.
+	virtual int EventFd() const { return -1; }
+	virtual void HandleEvents() {}
+	// Take the image off the screen and hand back any buffers still held, but keep whatever was
+	// set up so that the next Show() is quick.
+	virtual void Hide() {}
+	// Import a buffer ahead of its first Show(), so that showing it is no slower than showing any
+	// other. Called on the same thread as Show().
+	virtual void Prepare(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) {}
+	// The DRM device the preview displays on, or -1 if none. Another preview made with it can be
+	// set up on the same display while this one is still showing frames.
+	virtual int DrmFd() const { return -1; }
 
 protected:
 	DoneCallback done_callback_;
 	Options const *options_;
 };
 
-Preview *make_preview(Options const *options);
+// With drm_fd, the preview shares that DRM device instead of opening its own.
+Preview *make_preview(Options const *options, int drm_fd = -1);
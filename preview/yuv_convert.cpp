@@ -0,0 +1,332 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * yuv_convert.cpp - YUV420 to XRGB8888 conversion for displays without a YUV plane.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YUV_X86 1
+#endif
+
+#include "core/logging.hpp"
+
+#include "yuv_convert.hpp"
+
+// All the kernels use the same 16-bit fixed point arithmetic, so they all give identical
+// results. The SIMD versions saturate their intermediate sums, which can only happen when
+// the final value would have been clamped anyway.
+
+YuvCoefficients yuv_coefficients(std::optional<libcamera::ColorSpace> const &cs)
+{
+	// Limited range BT.601 is the default, as in the rest of the preview code.
+	if (cs == libcamera::ColorSpace::Sycc)
+		return { 0, 64, 90, 22, 46, 113 };
+	else if (cs == libcamera::ColorSpace::Smpte170m)
+		/* all good */;
+	else if (cs == libcamera::ColorSpace::Rec709)
+		return { 16, 75, 115, 14, 34, 135 };
+	else
+		LOG(1, "YuvToRgb: unexpected colour space " << libcamera::ColorSpace::toString(cs));
+	return { 16, 75, 102, 25, 52, 129 };
+}
+
+static inline uint32_t clamp_pixel(int r, int g, int b)
+{
+	r = std::clamp(r >> 6, 0, 255);
+	g = std::clamp(g >> 6, 0, 255);
+	b = std::clamp(b >> 6, 0, 255);
+	return 0xff000000 | (r << 16) | (g << 8) | b;
+}
+
+static void yuv_row_scalar(uint8_t const *y, uint8_t const *u, uint8_t const *v, uint32_t *dst, unsigned int width,
+						   YuvCoefficients const &c)
+{
+	for (unsigned int x = 0; x < width; x++)
+	{
+		int y16 = (y[x] - c.y_offset) * c.y_gain;
+		int u16 = u[x / 2] - 128, v16 = v[x / 2] - 128;
+		dst[x] = clamp_pixel(y16 + c.r_v * v16, y16 - c.g_u * u16 - c.g_v * v16, y16 + c.b_u * u16);
+	}
+}
+
+#if defined(__ARM_NEON)
+
+static void yuv_row_neon(uint8_t const *y, uint8_t const *u, uint8_t const *v, uint32_t *dst, unsigned int width,
+						 YuvCoefficients const &c)
+{
+	const int16x8_t y_offset = vdupq_n_s16(c.y_offset), bias = vdupq_n_s16(128);
+	unsigned int x = 0;
+
+	for (; x + 16 <= width; x += 16)
+	{
+		const uint8x16_t y8 = vld1q_u8(y + x);
+		const uint8x8x2_t u8 = vzip_u8(vld1_u8(u + x / 2), vld1_u8(u + x / 2));
+		const uint8x8x2_t v8 = vzip_u8(vld1_u8(v + x / 2), vld1_u8(v + x / 2));
+		uint8x8_t r[2], g[2], b[2];
+
+		for (unsigned int i = 0; i < 2; i++)
+		{
+			int16x8_t y16 = vreinterpretq_s16_u16(vmovl_u8(i ? vget_high_u8(y8) : vget_low_u8(y8)));
+			y16 = vmulq_n_s16(vsubq_s16(y16, y_offset), c.y_gain);
+			const int16x8_t u16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8.val[i])), bias);
+			const int16x8_t v16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8.val[i])), bias);
+
+			r[i] = vqshrun_n_s16(vqaddq_s16(y16, vmulq_n_s16(v16, c.r_v)), 6);
+			g[i] = vqshrun_n_s16(vqsubq_s16(vqsubq_s16(y16, vmulq_n_s16(u16, c.g_u)), vmulq_n_s16(v16, c.g_v)), 6);
+			b[i] = vqshrun_n_s16(vqaddq_s16(y16, vmulq_n_s16(u16, c.b_u)), 6);
+		}
+
+		uint8x16x4_t bgrx;
+		bgrx.val[0] = vcombine_u8(b[0], b[1]);
+		bgrx.val[1] = vcombine_u8(g[0], g[1]);
+		bgrx.val[2] = vcombine_u8(r[0], r[1]);
+		bgrx.val[3] = vdupq_n_u8(0xff);
+		vst4q_u8(reinterpret_cast<uint8_t *>(dst + x), bgrx);
+	}
+
+	yuv_row_scalar(y + x, u + x / 2, v + x / 2, dst + x, width - x, c);
+}
+
+#elif defined(YUV_X86)
+
+// Convert 8 (SSE2) or 16 (AVX2) pixels held as 16-bit lanes, returning the clamped channels.
+#define YUV_CONVERT_LANES(PREFIX, y16, u16, v16, r, g, b)                                                            \
+	do                                                                                                                 \
+	{                                                                                                                  \
+		y16 = PREFIX##_mullo_epi16(PREFIX##_sub_epi16(y16, y_offset), y_gain);                                       \
+		r = PREFIX##_adds_epi16(y16, PREFIX##_mullo_epi16(v16, r_v));                                                  \
+		g = PREFIX##_subs_epi16(PREFIX##_subs_epi16(y16, PREFIX##_mullo_epi16(u16, g_u)),                             \
+								PREFIX##_mullo_epi16(v16, g_v));                                                       \
+		b = PREFIX##_adds_epi16(y16, PREFIX##_mullo_epi16(u16, b_u));                                                  \
+		r = PREFIX##_min_epi16(PREFIX##_max_epi16(PREFIX##_srai_epi16(r, 6), zero), max);                           \
+		g = PREFIX##_min_epi16(PREFIX##_max_epi16(PREFIX##_srai_epi16(g, 6), zero), max);                           \
+		b = PREFIX##_min_epi16(PREFIX##_max_epi16(PREFIX##_srai_epi16(b, 6), zero), max);                           \
+	} while (0)
+
+static void yuv_row_sse2(uint8_t const *y, uint8_t const *u, uint8_t const *v, uint32_t *dst, unsigned int width,
+						 YuvCoefficients const &c)
+{
+	const __m128i zero = _mm_setzero_si128(), max = _mm_set1_epi16(255), alpha = _mm_set1_epi16((short)0xff00);
+	const __m128i bias = _mm_set1_epi16(128), y_offset = _mm_set1_epi16(c.y_offset), y_gain = _mm_set1_epi16(c.y_gain);
+	const __m128i r_v = _mm_set1_epi16(c.r_v), g_u = _mm_set1_epi16(c.g_u), g_v = _mm_set1_epi16(c.g_v);
+	const __m128i b_u = _mm_set1_epi16(c.b_u);
+	unsigned int x = 0;
+
+	for (; x + 16 <= width; x += 16)
+	{
+		const __m128i y8 = _mm_loadu_si128(reinterpret_cast<__m128i const *>(y + x));
+		__m128i u8 = _mm_loadl_epi64(reinterpret_cast<__m128i const *>(u + x / 2));
+		__m128i v8 = _mm_loadl_epi64(reinterpret_cast<__m128i const *>(v + x / 2));
+		u8 = _mm_unpacklo_epi8(u8, u8);
+		v8 = _mm_unpacklo_epi8(v8, v8);
+
+		for (unsigned int i = 0; i < 2; i++)
+		{
+			__m128i y16 = i ? _mm_unpackhi_epi8(y8, zero) : _mm_unpacklo_epi8(y8, zero);
+			__m128i u16 = _mm_sub_epi16(i ? _mm_unpackhi_epi8(u8, zero) : _mm_unpacklo_epi8(u8, zero), bias);
+			__m128i v16 = _mm_sub_epi16(i ? _mm_unpackhi_epi8(v8, zero) : _mm_unpacklo_epi8(v8, zero), bias);
+			__m128i r, g, b;
+			YUV_CONVERT_LANES(_mm, y16, u16, v16, r, g, b);
+
+			const __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8)), rx = _mm_or_si128(r, alpha);
+			__m128i *out = reinterpret_cast<__m128i *>(dst + x + 8 * i);
+			_mm_storeu_si128(out, _mm_unpacklo_epi16(bg, rx));
+			_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(bg, rx));
+		}
+	}
+
+	yuv_row_scalar(y + x, u + x / 2, v + x / 2, dst + x, width - x, c);
+}
+
+__attribute__((target("avx2"))) static void yuv_row_avx2(uint8_t const *y, uint8_t const *u, uint8_t const *v,
+														  uint32_t *dst, unsigned int width, YuvCoefficients const &c)
+{
+	const __m256i zero = _mm256_setzero_si256(), max = _mm256_set1_epi16(255);
+	const __m256i alpha = _mm256_set1_epi16((short)0xff00), bias = _mm256_set1_epi16(128);
+	const __m256i y_offset = _mm256_set1_epi16(c.y_offset), y_gain = _mm256_set1_epi16(c.y_gain);
+	const __m256i r_v = _mm256_set1_epi16(c.r_v), g_u = _mm256_set1_epi16(c.g_u), g_v = _mm256_set1_epi16(c.g_v);
+	const __m256i b_u = _mm256_set1_epi16(c.b_u);
+	unsigned int x = 0;
+
+	for (; x + 32 <= width; x += 32)
+	{
+		const __m128i u8 = _mm_loadu_si128(reinterpret_cast<__m128i const *>(u + x / 2));
+		const __m128i v8 = _mm_loadu_si128(reinterpret_cast<__m128i const *>(v + x / 2));
+
+		for (unsigned int i = 0; i < 2; i++)
+		{
+			// Widening keeps the pixels in order, unlike the in-lane AVX2 unpacks.
+			__m256i y16 = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<__m128i const *>(y + x + 16 * i)));
+			__m256i u16 = _mm256_cvtepu8_epi16(i ? _mm_unpackhi_epi8(u8, u8) : _mm_unpacklo_epi8(u8, u8));
+			__m256i v16 = _mm256_cvtepu8_epi16(i ? _mm_unpackhi_epi8(v8, v8) : _mm_unpacklo_epi8(v8, v8));
+			u16 = _mm256_sub_epi16(u16, bias);
+			v16 = _mm256_sub_epi16(v16, bias);
+			__m256i r, g, b;
+			YUV_CONVERT_LANES(_mm256, y16, u16, v16, r, g, b);
+
+			// The unpacks work within each 128-bit lane, giving pixels 0-3 and 8-11 in lo, and
+			// 4-7 and 12-15 in hi, so put the halves back in order when storing.
+			const __m256i bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8)), rx = _mm256_or_si256(r, alpha);
+			const __m256i lo = _mm256_unpacklo_epi16(bg, rx), hi = _mm256_unpackhi_epi16(bg, rx);
+			__m256i *out = reinterpret_cast<__m256i *>(dst + x + 16 * i);
+			_mm256_storeu_si256(out, _mm256_permute2x128_si256(lo, hi, 0x20));
+			_mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(lo, hi, 0x31));
+		}
+	}
+
+	yuv_row_sse2(y + x, u + x / 2, v + x / 2, dst + x, width - x, c);
+}
+
+#endif
+
+std::vector<YuvKernelInfo> const &yuv_kernels()
+{
+	static const std::vector<YuvKernelInfo> kernels = []() {
+		std::vector<YuvKernelInfo> k = { { "scalar", yuv_row_scalar } };
+#if defined(__ARM_NEON)
+		k.push_back({ "neon", yuv_row_neon });
+#elif defined(YUV_X86)
+		if (__builtin_cpu_supports("sse2"))
+			k.push_back({ "sse2", yuv_row_sse2 });
+		if (__builtin_cpu_supports("avx2"))
+			k.push_back({ "avx2", yuv_row_avx2 });
+#endif
+		return k;
+	}();
+	return kernels;
+}
+
+YuvToRgb::YuvToRgb(unsigned int num_threads)
+	: kernel_(yuv_kernels().back()), x_map_src_width_(0), generation_(0), pending_(0), abort_(false)
+{
+	if (!num_threads)
+		num_threads = std::clamp(std::thread::hardware_concurrency(), 1u, 4u);
+
+	scratch_.resize(num_threads);
+	for (unsigned int i = 1; i < num_threads; i++)
+		workers_.emplace_back(&YuvToRgb::workerThread, this, i);
+}
+
+YuvToRgb::~YuvToRgb()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		work_cond_.notify_all();
+	}
+	for (auto &t : workers_)
+		t.join();
+}
+
+void YuvToRgb::SetKernel(std::string const &name)
+{
+	if (name == "auto")
+	{
+		kernel_ = yuv_kernels().back();
+		return;
+	}
+
+	for (auto const &k : yuv_kernels())
+	{
+		if (name == k.name)
+		{
+			kernel_ = k;
+			return;
+		}
+	}
+
+	throw std::runtime_error("YUV conversion kernel " + name + " not available");
+}
+
+void YuvToRgb::Convert(uint8_t const *src, unsigned int src_width, unsigned int src_height, unsigned int src_stride,
+					   YuvCoefficients const &coeffs, uint8_t *dst, unsigned int dst_width, unsigned int dst_height,
+					   unsigned int dst_stride)
+{
+	job_ = { src, src_width, src_height, src_stride, coeffs, dst, dst_width, dst_height, dst_stride };
+
+	if (x_map_.size() != dst_width || x_map_src_width_ != src_width)
+	{
+		x_map_src_width_ = src_width;
+		x_map_.resize(dst_width);
+		for (unsigned int x = 0; x < dst_width; x++)
+			x_map_[x] = x * src_width / dst_width;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		generation_++;
+		pending_ = workers_.size();
+		work_cond_.notify_all();
+	}
+
+	convertRows(0, scratch_[0]);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	done_cond_.wait(lock, [this] { return pending_ == 0; });
+}
+
+void YuvToRgb::workerThread(unsigned int index)
+{
+	unsigned int generation = 0;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			work_cond_.wait(lock, [&] { return abort_ || generation_ != generation; });
+			if (abort_)
+				return;
+			generation = generation_;
+		}
+
+		convertRows(index, scratch_[index]);
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (--pending_ == 0)
+			done_cond_.notify_one();
+	}
+}
+
+void YuvToRgb::convertRows(unsigned int band, std::vector<uint32_t> &scratch)
+{
+	const Job &j = job_;
+	const unsigned int bands = NumThreads();
+	const unsigned int row_start = j.dst_height * band / bands, row_end = j.dst_height * (band + 1) / bands;
+	const bool scale_x = j.src_width != j.dst_width;
+	const unsigned int uv_stride = j.src_stride / 2;
+	uint8_t const *u_plane = j.src + j.src_stride * j.src_height;
+	uint8_t const *v_plane = u_plane + uv_stride * (j.src_height / 2);
+
+	if (scale_x)
+		scratch.resize(j.src_width);
+	unsigned int last_sy = j.src_height;
+
+	for (unsigned int row = row_start; row < row_end; row++)
+	{
+		const unsigned int sy = row * j.src_height / j.dst_height;
+		uint32_t *out = reinterpret_cast<uint32_t *>(j.dst + row * j.dst_stride);
+		uint8_t const *y = j.src + sy * j.src_stride;
+		uint8_t const *u = u_plane + (sy / 2) * uv_stride, *v = v_plane + (sy / 2) * uv_stride;
+
+		if (!scale_x)
+			kernel_.kernel(y, u, v, out, j.src_width, j.coeffs);
+		else
+		{
+			// Convert the source row somewhere cached (once, even when upscaling), then pick
+			// out the pixels we need. This beats gathering the YUV samples first.
+			if (sy != last_sy)
+				kernel_.kernel(y, u, v, scratch.data(), j.src_width, j.coeffs);
+			last_sy = sy;
+			for (unsigned int x = 0; x < j.dst_width; x++)
+				out[x] = scratch[x_map_[x]];
+		}
+	}
+}
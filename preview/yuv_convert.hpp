@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2026, Raspberry Pi Ltd
+ *
+ * yuv_convert.hpp - YUV420 to XRGB8888 conversion for displays without a YUV plane.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/color_space.h>
+
+// Fixed point (6 fractional bits) conversion coefficients for one colour space.
+struct YuvCoefficients
+{
+	int16_t y_offset;
+	int16_t y_gain;
+	int16_t r_v;
+	int16_t g_u;
+	int16_t g_v;
+	int16_t b_u;
+};
+
+YuvCoefficients yuv_coefficients(std::optional<libcamera::ColorSpace> const &cs);
+
+// Convert one row of pixels. u and v are at half the horizontal resolution of y, and
+// the output pixels are written as little-endian XRGB8888 (so B, G, R, X in memory).
+typedef void (*YuvRowKernel)(uint8_t const *y, uint8_t const *u, uint8_t const *v, uint32_t *dst,
+							 unsigned int width, YuvCoefficients const &coeffs);
+
+struct YuvKernelInfo
+{
+	char const *name;
+	YuvRowKernel kernel;
+};
+
+// All the kernels that this build contains and this CPU can run, the portable scalar
+// reference first and the fastest last.
+std::vector<YuvKernelInfo> const &yuv_kernels();
+
+class YuvToRgb
+{
+public:
+	// A num_threads of 0 picks something sensible for the machine.
+	YuvToRgb(unsigned int num_threads = 0);
+	~YuvToRgb();
+
+	// Choose a kernel by name, or "auto" for the fastest available one.
+	void SetKernel(std::string const &name);
+	char const *KernelName() const { return kernel_.name; }
+	unsigned int NumThreads() const { return workers_.size() + 1; }
+
+	// Convert the whole source image, scaling it (nearest neighbour) into a dst_width x dst_height
+	// rectangle at dst. The work is split by rows across the worker threads and the calling one.
+	void Convert(uint8_t const *src, unsigned int src_width, unsigned int src_height, unsigned int src_stride,
+				 YuvCoefficients const &coeffs, uint8_t *dst, unsigned int dst_width, unsigned int dst_height,
+				 unsigned int dst_stride);
+
+private:
+	struct Job
+	{
+		uint8_t const *src;
+		unsigned int src_width;
+		unsigned int src_height;
+		unsigned int src_stride;
+		YuvCoefficients coeffs;
+		uint8_t *dst;
+		unsigned int dst_width;
+		unsigned int dst_height;
+		unsigned int dst_stride;
+	};
+
+	void workerThread(unsigned int index);
+	void convertRows(unsigned int band, std::vector<uint32_t> &scratch);
+
+	YuvKernelInfo kernel_;
+	Job job_;
+	std::vector<unsigned int> x_map_;
+	unsigned int x_map_src_width_;
+	std::vector<std::vector<uint32_t>> scratch_;
+	std::vector<std::thread> workers_;
+	std::mutex mutex_;
+	std::condition_variable work_cond_;
+	std::condition_variable done_cond_;
+	unsigned int generation_;
+	unsigned int pending_;
+	bool abort_;
+};
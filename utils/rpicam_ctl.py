@@ -0,0 +1,136 @@
+#!/usr/bin/python3
+#
+# rpicam-apps daemon control and time-to-first-frame benchmark
+# Copyright (C) 2026, Raspberry Pi Ltd.
+#
+# Send a command to rpicam-vid --daemon:
+#     rpicam_ctl.py --socket /tmp/rpicam.sock start
+#
+# or switch it to another size and frame rate, which prints how long the old frame stayed up:
+#     rpicam_ctl.py reconfigure 1280 720 --fps 30
+#
+# Or compare how long the first frame takes to reach the screen when rpicam-vid is launched from
+# scratch ("cold") with a start command to a daemon that has the camera ready ("warm"):
+#     rpicam_ctl.py bench --runs 10 -- --lores-preview
+#
+import argparse
+import queue
+import re
+import socket
+import statistics
+import subprocess
+import threading
+import time
+
+FIRST_FRAME = re.compile(r'First frame shown ([0-9.]+)ms')
+READY = re.compile(r'Camera ready')
+
+
+def command(path, cmd, timeout=10):
+    with socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET) as s:
+        s.settimeout(timeout)
+        s.connect(path)
+        s.send(cmd.encode())
+        return s.recv(256).decode()
+
+
+def launch(app):
+    # The apps log to stderr, which is read all the time so that the pipe never fills up.
+    proc = subprocess.Popen(app, stdin=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    proc.lines = queue.Queue()
+    threading.Thread(target=lambda: [proc.lines.put(line) for line in proc.stderr], daemon=True).start()
+    return proc
+
+
+def wait_for_line(proc, pattern, timeout):
+    deadline = time.monotonic() + timeout
+    while (remaining := deadline - time.monotonic()) > 0:
+        try:
+            line = proc.lines.get(timeout=remaining)
+        except queue.Empty:
+            break
+        if match := pattern.search(line):
+            return match
+    raise RuntimeError(f'rpicam-vid never logged "{pattern.pattern}"')
+
+
+def stop(proc):
+    proc.terminate()
+    try:
+        proc.wait(5)
+    except subprocess.TimeoutExpired:
+        proc.kill()
+        proc.wait()
+
+
+def summary(name, times):
+    print(f'{name}: mean {statistics.mean(times):.1f}ms, min {min(times):.1f}ms, max {max(times):.1f}ms '
+          f'over {len(times)} runs')
+
+
+def bench(args):
+    app = [args.exe] + args.app_args
+
+    # Cold: everything from process launch, timed from out here.
+    cold = []
+    for _ in range(args.runs):
+        start = time.monotonic()
+        proc = launch(app)
+        try:
+            wait_for_line(proc, FIRST_FRAME, args.timeout)
+            cold.append((time.monotonic() - start) * 1000)
+        finally:
+            stop(proc)
+
+    # Warm: the daemon already has the camera configured and the display set up.
+    warm, reported = [], []
+    proc = launch(app + ['--daemon', args.socket])
+    try:
+        wait_for_line(proc, READY, args.timeout)
+        for _ in range(args.runs):
+            start = time.monotonic()
+            reply = command(args.socket, 'start', args.timeout)
+            warm.append((time.monotonic() - start) * 1000)
+            if not reply.startswith('started'):
+                raise RuntimeError(f'daemon replied "{reply}" to start')
+            reported.append(float(reply.split()[1]))
+            # Let it run a little, as a real client would.
+            time.sleep(args.hold)
+            command(args.socket, 'stop', args.timeout)
+        command(args.socket, 'quit', args.timeout)
+    finally:
+        stop(proc)
+
+    summary('Cold launch to first frame', cold)
+    summary('Warm start command to first frame (client)', warm)
+    summary('Warm start command to first frame (daemon)', reported)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Control rpicam-vid --daemon, or benchmark its time to first frame')
+    parser.add_argument('--socket', default='/tmp/rpicam.sock', help='Daemon socket')
+    sub = parser.add_subparsers(dest='cmd', required=True)
+    for cmd in ['start', 'stop', 'status', 'switch-preview', 'quit']:
+        sub.add_parser(cmd)
+    r = sub.add_parser('reconfigure', help='Change the video size and frame rate while running')
+    r.add_argument('width', type=int)
+    r.add_argument('height', type=int)
+    r.add_argument('--fps', type=float, default=0, help='New frame rate, 0 to leave it alone')
+    b = sub.add_parser('bench', help='Compare cold launches with daemon start commands')
+    b.add_argument('--exe', default='rpicam-vid', help='rpicam-vid executable')
+    b.add_argument('--runs', type=int, default=10)
+    b.add_argument('--hold', type=float, default=0.5, help='Seconds to run the preview each time')
+    b.add_argument('--timeout', type=float, default=30)
+    b.add_argument('app_args', nargs='*', help='Extra rpicam-vid options, after --')
+    args = parser.parse_args()
+
+    if args.cmd == 'bench':
+        bench(args)
+    elif args.cmd == 'reconfigure':
+        print(command(args.socket, f'reconfigure {args.width} {args.height} {args.fps}'))
+    else:
+        print(command(args.socket, args.cmd))
+
+
+if __name__ == '__main__':
+    main()
@@ -5,6 +5,7 @@
 #
 import argparse
 import json
+import struct
 import subprocess
 
 try:
@@ -21,6 +22,22 @@ def read_times_pts(file):
         return [float(line) for line in f.readlines()]
 
 
+def read_times_metadata_log(file):
+    # Binary log from rpicam-apps --metadata-log: a 64 byte header, then 64 byte records
+    # with the sensor timestamp (ns) at offset 8 and its valid bit (1) in the flags at offset 4.
+    with open(file, 'rb') as f:
+        header = f.read(64)
+        if header[:8] != b'RPIMDLOG':
+            raise RuntimeError('Metadata log format unknown')
+        record_size = struct.unpack_from('<I', header, 12)[0]
+        times = []
+        while len(record := f.read(record_size)) == record_size:
+            valid, timestamp = struct.unpack_from('<IQ', record, 4)
+            if valid & 1:
+                times.append(timestamp / 1e6)
+        return times
+
+
 def read_times_container(file):
     cmd = ['ffprobe', file, '-hide_banner', '-select_streams', 'v', '-show_entries', 'frame', '-of', 'json']
     r = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True)
@@ -67,14 +84,16 @@ def plot_pts(diffs, avg, title, narrow):
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='rpicam-apps timestamp analysis tool')
-    parser.add_argument('filename', help='PTS file generated from rpicam-vid (with a .txt or .pts extension)'
-                                         ' or an avi/mkv/mp4 container file', type=str)
+    parser.add_argument('filename', help='PTS file generated from rpicam-vid (with a .txt or .pts extension),'
+                                         ' a --metadata-log file (.bin) or an avi/mkv/mp4 container file', type=str)
     parser.add_argument('--plot', help='Plot timestamp graph', action='store_true')
     parser.add_argument('--narrow', help='Narrow the y-axis by hiding outliers', action='store_true')
     args = parser.parse_args()
 
     if args.filename.lower().endswith(('.txt', '.pts')):
         times = read_times_pts(args.filename)
+    elif args.filename.lower().endswith('.bin'):
+        times = read_times_metadata_log(args.filename)
     elif args.filename.lower().endswith(('.avi', '.mkv', '.mp4')):
         times = read_times_container(args.filename)
     else: